@@ -0,0 +1,462 @@
+//
+// Writes samples as an Apache Arrow IPC stream.
+//
+// Stream layout (https://arrow.apache.org/docs/format/Columnar.html#ipc-streaming-format):
+//   each message is 0xFFFFFFFF, int32 metadata length, a flatbuffer 'Message' padded to
+//   8 bytes, then the message body. Schema, one DictionaryBatch for 'file', then the
+//   RecordBatches, then 0xFFFFFFFF 0x00000000 to end the stream.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <algorithm>
+
+#include <string.h>
+
+#include "arrowwriter.h"
+#include "utctime.h"
+
+// Values from Arrow's Schema.fbs / Message.fbs
+enum {
+	METADATA_V5 = 4,
+	HEADER_SCHEMA = 1, HEADER_DICTIONARY_BATCH = 2, HEADER_RECORD_BATCH = 3,
+	TYPE_INT = 2, TYPE_FLOATING_POINT = 3, TYPE_UTF8 = 5, TYPE_DATE = 8, TYPE_TIMESTAMP = 10,
+	PRECISION_DOUBLE = 2,
+	DATE_UNIT_DAY = 0,
+	TIME_UNIT_MILLISECOND = 1
+};
+
+static const size_t NUM_FIELDS = 7;		// time, lat, lon, ele, file, day, media
+static const int64_t DICTIONARY_ID = 0;
+
+static inline size_t padTo8(size_t n) {
+	return (n + 7) & ~(size_t)7;
+}
+
+//
+// Just enough of a flatbuffer builder for Arrow's metadata.
+//
+// Unlike the real builder this one works front to back: a table is written first with
+// empty offset slots, then whatever it points at is written after it and the slot is
+// patched. uoffsets only ever point forward, which is all the format asks for.
+//
+class FlatBuf {
+public:
+	std::vector<uint8_t> buf;
+
+	void pad(size_t align) {
+		while (buf.size() % align)
+			buf.push_back(0);
+	}
+
+	template<class T> size_t put(T v) {
+		size_t at;
+
+		pad(sizeof(T));
+		at = buf.size();
+		buf.resize(at + sizeof(T));
+		memcpy(&buf[at], &v, sizeof(T));
+		return at;
+	}
+
+	void patchOffset(size_t slot, size_t target) {
+		uint32_t off = (uint32_t)(target - slot);
+		memcpy(&buf[slot], &off, sizeof(off));
+	}
+
+	size_t putString(const std::string &s) {
+		size_t at = put<uint32_t>(s.size());
+
+		buf.insert(buf.end(), s.begin(), s.end());
+		buf.push_back(0);
+		return at;
+	}
+
+	// Vector of 'count' elements of 'elemSize' bytes, element data aligned to 'align'.
+	// 'data' may be NULL to leave zeroed slots (ie uoffsets to patch later).
+	size_t putVector(uint32_t count, size_t elemSize, size_t align, const void* data) {
+		size_t at;
+
+		while ((buf.size() + sizeof(uint32_t)) % align || buf.size() % sizeof(uint32_t))
+			buf.push_back(0);
+		at = put<uint32_t>(count);
+		if (data)
+			buf.insert(buf.end(), (const uint8_t*)data, (const uint8_t*)data + count * elemSize);
+		else
+			buf.resize(buf.size() + count * elemSize, 0);
+		return at;
+	}
+};
+
+//
+// One table's fields by id. finish() writes the vtable and then the table (largest fields
+// first so everything is naturally aligned) and returns where the table starts; offset
+// slots can then be found with slot() and patched once their target is written.
+//
+class FlatTable {
+public:
+	template<class T> void add(int id, T v) {
+		Field f;
+
+		f.id = id;
+		f.size = sizeof(T);
+		memcpy(f.bytes, &v, sizeof(T));
+		fields.push_back(f);
+	}
+
+	void addOffset(int id) { add<uint32_t>(id, 0); };
+
+	size_t finish(FlatBuf &fb) {
+		std::vector<Field*> bySize;
+		size_t inlineSize = sizeof(int32_t), maxAlign = sizeof(int32_t), vtable;
+		int numIds = 0;
+
+		for (auto &f: fields) {
+			bySize.push_back(&f);
+			numIds = std::max(numIds, f.id + 1);
+			maxAlign = std::max(maxAlign, f.size);
+		}
+		std::stable_sort(bySize.begin(), bySize.end(), [](const Field* a, const Field* b) { return a->size > b->size; });
+
+		for (auto f: bySize) {
+			inlineSize = (inlineSize + f->size - 1) / f->size * f->size;
+			f->rel = inlineSize;
+			inlineSize += f->size;
+		}
+
+		vtable = fb.put<uint16_t>(sizeof(uint16_t) * (2 + numIds));
+		fb.put<uint16_t>(inlineSize);
+		for (int id = 0; id < numIds; id++) {
+			uint16_t rel = 0;
+			for (auto &f: fields)
+				if (f.id == id)
+					rel = f.rel;
+			fb.put<uint16_t>(rel);
+		}
+
+		fb.pad(maxAlign);
+		pos = fb.put<int32_t>((int32_t)(fb.buf.size() - vtable));
+		fb.buf.resize(pos + inlineSize, 0);
+		for (auto &f: fields)
+			memcpy(&fb.buf[pos + f.rel], f.bytes, f.size);
+
+		return pos;
+	}
+
+	size_t slot(int id) {
+		for (auto &f: fields)
+			if (f.id == id)
+				return pos + f.rel;
+		return 0;
+	}
+
+protected:
+	struct Field {
+		int id;
+		size_t size;
+		size_t rel;
+		uint8_t bytes[8];
+	};
+
+	std::vector<Field> fields;
+	size_t pos;
+};
+
+// Arrow's FieldNode and Buffer structs - both a pair of int64.
+struct ArrowPair {
+	int64_t a, b;
+};
+
+//
+// Message { version, header_type, header, bodyLength } with the header table built by
+// 'header' right after it.
+//
+template<class F> static std::vector<uint8_t> buildMessage(uint8_t headerType, int64_t bodyLength, F header) {
+	FlatBuf fb;
+	FlatTable msg;
+	size_t root = fb.put<uint32_t>(0);
+
+	msg.add<int16_t>(0, METADATA_V5);
+	msg.add<uint8_t>(1, headerType);
+	msg.addOffset(2);
+	msg.add<int64_t>(3, bodyLength);
+	fb.patchOffset(root, msg.finish(fb));
+
+	fb.patchOffset(msg.slot(2), header(fb));
+	fb.pad(8);
+	return fb.buf;
+}
+
+//
+// RecordBatch { length, nodes, buffers } - used on its own and inside a DictionaryBatch.
+//
+static size_t buildRecordBatch(FlatBuf &fb, int64_t length, const std::vector<ArrowPair> &nodes, const std::vector<ArrowPair> &buffers) {
+	FlatTable rb;
+	size_t at;
+
+	rb.add<int64_t>(0, length);
+	rb.addOffset(1);
+	rb.addOffset(2);
+	at = rb.finish(fb);
+
+	fb.patchOffset(rb.slot(1), fb.putVector(nodes.size(), sizeof(ArrowPair), 8, nodes.data()));
+	fb.patchOffset(rb.slot(2), fb.putVector(buffers.size(), sizeof(ArrowPair), 8, buffers.data()));
+	return at;
+}
+
+//
+// Field { name, nullable, type_type, type, dictionary, children }. Arrow insists on a
+// children vector even when there are none.
+//
+static size_t buildField(FlatBuf &fb, const char* name, uint8_t typeType, bool bDictionary) {
+	FlatTable field, type;
+	size_t at;
+
+	field.addOffset(0);
+	field.add<uint8_t>(1, 0);		// nullable - never
+	field.add<uint8_t>(2, typeType);
+	field.addOffset(3);
+	if (bDictionary)
+		field.addOffset(4);
+	field.addOffset(5);
+	at = field.finish(fb);
+
+	fb.patchOffset(field.slot(0), fb.putString(name));
+
+	switch (typeType) {
+	case TYPE_TIMESTAMP:
+		type.add<int16_t>(0, TIME_UNIT_MILLISECOND);
+		type.addOffset(1);
+		fb.patchOffset(field.slot(3), type.finish(fb));
+		fb.patchOffset(type.slot(1), fb.putString("UTC"));
+		break;
+	case TYPE_FLOATING_POINT:
+		type.add<int16_t>(0, PRECISION_DOUBLE);
+		fb.patchOffset(field.slot(3), type.finish(fb));
+		break;
+	case TYPE_DATE:
+		type.add<int16_t>(0, DATE_UNIT_DAY);
+		fb.patchOffset(field.slot(3), type.finish(fb));
+		break;
+	default:	// Utf8 has no fields of its own
+		fb.patchOffset(field.slot(3), type.finish(fb));
+		break;
+	}
+
+	if (bDictionary) {
+		FlatTable dict, indexType;
+
+		dict.add<int64_t>(0, DICTIONARY_ID);
+		dict.addOffset(1);
+		dict.add<uint8_t>(2, 0);		// isOrdered
+		fb.patchOffset(field.slot(4), dict.finish(fb));
+
+		indexType.add<int32_t>(0, 32);	// bitWidth
+		indexType.add<uint8_t>(1, 1);	// is_signed
+		fb.patchOffset(dict.slot(1), indexType.finish(fb));
+	}
+
+	fb.patchOffset(field.slot(5), fb.putVector(0, sizeof(uint32_t), sizeof(uint32_t), NULL));
+	return at;
+}
+
+ArrowWriter::ArrowWriter() {
+	fp = NULL;
+	batchRows = DEFAULT_BATCH_ROWS;
+	bOK = false;
+}
+
+ArrowWriter::~ArrowWriter() {
+	if (fp)
+		close();
+}
+
+bool ArrowWriter::open(const char* fname) {
+	fp = fopen(fname, "wb");
+	if (!fp) {
+		std::cerr << "ERROR: Could not open output file: " << fname << std::endl;
+		return false;
+	}
+
+	bOK = true;
+	return true;
+}
+
+void ArrowWriter::writeBody(const void* data, size_t len) {
+	static const uint8_t zeros[8] = { 0 };
+	size_t padding = padTo8(len) - len;
+
+	if (!fp)
+		return;
+
+	if ((len && fwrite(data, 1, len, fp) != len) || (padding && fwrite(zeros, 1, padding, fp) != padding))
+		bOK = false;
+}
+
+void ArrowWriter::writeMessage(const std::vector<uint8_t> &metadata) {
+	uint32_t prefix[2] = { 0xFFFFFFFF, (uint32_t)metadata.size() };
+
+	if (!fp)
+		return;
+
+	if (fwrite(prefix, sizeof(prefix), 1, fp) != 1 || fwrite(metadata.data(), 1, metadata.size(), fp) != metadata.size())
+		bOK = false;
+}
+
+void ArrowWriter::writeSchema() {
+	static const char* const names[NUM_FIELDS] = { "time", "lat", "lon", "ele", "file", "day", "media" };
+	static const uint8_t types[NUM_FIELDS] = { TYPE_TIMESTAMP, TYPE_FLOATING_POINT, TYPE_FLOATING_POINT, TYPE_FLOATING_POINT, TYPE_UTF8, TYPE_DATE,
+		TYPE_FLOATING_POINT };
+
+	writeMessage(buildMessage(HEADER_SCHEMA, 0, [&](FlatBuf &fb) {
+		FlatTable schema;
+		size_t at, vec;
+
+		schema.addOffset(1);		// fields (endianness 0 = little is the default)
+		at = schema.finish(fb);
+
+		vec = fb.putVector(NUM_FIELDS, sizeof(uint32_t), sizeof(uint32_t), NULL);
+		fb.patchOffset(schema.slot(1), vec);
+		for (size_t i = 0; i < NUM_FIELDS; i++) {
+			size_t slot = vec + sizeof(uint32_t) * (i + 1);
+			fb.patchOffset(slot, buildField(fb, names[i], types[i], types[i] == TYPE_UTF8));
+		}
+
+		return at;
+	}));
+}
+
+//
+// The whole 'file' dictionary as one utf8 batch: int32 offsets then the characters.
+//
+void ArrowWriter::writeFileNames(const std::vector<std::string> &names) {
+	std::vector<int32_t> offsets(1, 0);
+	std::string chars;
+	std::vector<ArrowPair> nodes, buffers;
+	int64_t offsetsLen, charsLen;
+
+	for (auto &n: names) {
+		chars += n;
+		offsets.push_back(chars.size());
+	}
+
+	offsetsLen = offsets.size() * sizeof(int32_t);
+	charsLen = chars.size();
+
+	nodes.push_back({ (int64_t)names.size(), 0 });
+	buffers.push_back({ 0, 0 });							// validity - no nulls
+	buffers.push_back({ 0, offsetsLen });
+	buffers.push_back({ (int64_t)padTo8(offsetsLen), charsLen });
+
+	writeMessage(buildMessage(HEADER_DICTIONARY_BATCH, padTo8(offsetsLen) + padTo8(charsLen), [&](FlatBuf &fb) {
+		FlatTable dict;
+		size_t at;
+
+		dict.add<int64_t>(0, DICTIONARY_ID);
+		dict.addOffset(1);
+		at = dict.finish(fb);
+
+		fb.patchOffset(dict.slot(1), buildRecordBatch(fb, names.size(), nodes, buffers));
+		return at;
+	}));
+
+	writeBody(offsets.data(), offsetsLen);
+	writeBody(chars.data(), charsLen);
+}
+
+//
+// Rows [first, first+count) of 'store'. The per batch scratch columns must already hold this batch's values.
+//
+void ArrowWriter::writeBatch(const SampleStore &store, size_t first, size_t count) {
+	std::vector<ArrowPair> nodes, buffers;
+	const void* data[NUM_FIELDS] = { store.timeColumn().data() + first, lat.data(), lon.data(), ele.data(), fileIds.data(), days.data(),
+		mediaSeconds.data() };
+	const size_t widths[NUM_FIELDS] = { sizeof(int64_t), sizeof(double), sizeof(double), sizeof(double), sizeof(int32_t), sizeof(int32_t),
+		sizeof(double) };
+	int64_t offset = 0;
+
+	for (size_t i = 0; i < NUM_FIELDS; i++) {
+		int64_t len = count * widths[i];
+
+		nodes.push_back({ (int64_t)count, 0 });
+		buffers.push_back({ offset, 0 });			// validity - no nulls
+		buffers.push_back({ offset, len });
+		offset += padTo8(len);
+	}
+
+	writeMessage(buildMessage(HEADER_RECORD_BATCH, offset, [&](FlatBuf &fb) {
+		return buildRecordBatch(fb, count, nodes, buffers);
+	}));
+
+	for (size_t i = 0; i < NUM_FIELDS; i++)
+		writeBody(data[i], count * widths[i]);
+}
+
+//
+// Schema, the file name dictionary (one entry per range), then every row in batches.
+// A store without ranges is written as a single unnamed file. 'day' is the day of the
+// file's first sample, like the GPX and CSV grouping, not the row's own.
+//
+void ArrowWriter::writeStore(const SampleStore &store) {
+	const std::vector<SampleStore::Range> &ranges = store.getRanges();
+	const int64_t* timeMs = store.timeColumn().data();
+	const uint32_t* mediaMs = store.mediaColumn().data();
+	const int32_t* latUnits = store.latColumn().data();
+	const int32_t* lonUnits = store.lonColumn().data();
+	const int32_t* eleUnits = store.eleColumn().data();
+	std::vector<std::string> names;
+	size_t range = 0;
+
+	for (auto &r: ranges)
+		names.push_back(r.name);
+	if (names.empty())
+		names.push_back("");
+
+	writeSchema();
+	writeFileNames(names);
+
+	for (size_t first = 0; first < store.size(); first += batchRows) {
+		size_t count = std::min(batchRows, store.size() - first);
+
+		lat.resize(count);
+		lon.resize(count);
+		ele.resize(count);
+		fileIds.resize(count);
+		days.resize(count);
+		mediaSeconds.resize(count);
+
+		for (size_t i = 0; i < count; i++) {
+			size_t row = first + i;
+
+			while (range + 1 < ranges.size() && row >= ranges[range].first + ranges[range].count)
+				range++;
+
+			lat[i] = SampleStore::toDegrees(latUnits[row]);
+			lon[i] = SampleStore::toDegrees(lonUnits[row]);
+			ele[i] = SampleStore::toMetres(eleUnits[row]);
+			fileIds[i] = (int32_t)range;
+			days[i] = (int32_t)utc::floorDiv(timeMs[ranges.empty() ? 0 : ranges[range].first], 86400000);
+			mediaSeconds[i] = mediaMs[row] / 1000.0;
+		}
+
+		writeBatch(store, first, count);
+	}
+}
+
+bool ArrowWriter::close() {
+	uint32_t eos[2] = { 0xFFFFFFFF, 0 };
+
+	if (!fp)
+		return false;
+
+	if (fwrite(eos, sizeof(eos), 1, fp) != 1)
+		bOK = false;
+
+	if (fclose(fp) != 0)
+		bOK = false;
+	fp = NULL;
+
+	return bOK;
+}
@@ -0,0 +1,64 @@
+#ifndef _ARROWWRITER_H
+#define _ARROWWRITER_H
+//
+// Writes samples as an Apache Arrow IPC stream (the .arrows / "streaming format") so
+// pandas, polars, DuckDB etc. can load them without parsing any text.
+//
+// Self contained - the few flatbuffer tables the format needs are laid out by hand in
+// arrowwriter.cpp, no Arrow or flatbuffers library involved.
+//
+// Columns:
+//   time  timestamp[ms, UTC]
+//   lat   float64
+//   lon   float64
+//   ele   float64
+//   file  dictionary<int32, utf8> - the index is the file id, the dictionary its name
+//   day   date32 - UTC day the file is grouped under (its first sample's), as in GPX/CSV
+//   media float64 - seconds into the clip (the sample's media time)
+//
+// File ids are the store's range indexes, so a store filled by SamplesHandler (one range
+// per file) maps straight onto it. The time buffer goes to disk straight out of the
+// SampleStore column; lat/lon/ele are scaled from the store's fixed point units into
+// per batch scratch like the computed columns, batchRows rows per record batch.
+//
+// Usage: open(), writeStore(), close().
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "samplestore.h"
+
+class ArrowWriter {
+public:
+	ArrowWriter();
+	~ArrowWriter();
+	void setBatchRows(size_t rows) { batchRows = rows ? rows : 1; };
+	bool open(const char* fname);
+	void writeStore(const SampleStore &store);
+	bool close();
+
+protected:
+	void writeSchema();
+	void writeFileNames(const std::vector<std::string> &names);
+	void writeBatch(const SampleStore &store, size_t first, size_t count);
+	void writeMessage(const std::vector<uint8_t> &metadata);
+	void writeBody(const void* data, size_t len);
+
+	enum { DEFAULT_BATCH_ROWS = 65536 };
+
+	FILE* fp;
+	size_t batchRows;
+	std::vector<double> lat, lon, ele;		// Per batch scratch for the scaled and computed columns
+	std::vector<int32_t> fileIds, days;
+	std::vector<double> mediaSeconds;
+	bool bOK;
+};
+
+#endif
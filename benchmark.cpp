@@ -0,0 +1,355 @@
+//
+// Benchmark suite for the extraction pipeline - the goproWhereWhenBench target.
+//
+// Generates synthetic GoPro clips (see mp4synth.h) so nothing but this binary is needed,
+// then times each stage on them separately, from opening the MP4 through to writing GPX:
+//
+//   open        OpenMP4Source() + CloseSource()
+//   getpayload  GetPayloadView() of every payload
+//   gpmfnext    GPMF_Next() over every KLV of payloads already in memory
+//   scaleddata  GPMF_ScaledData() of the GPS5, ACCL and GYRO of every payload
+//   process/all GoProMeta::openFile() + processFile() keeping every sample
+//   process/5s  the same at the default one sample every 5s
+//   grouping    SamplesHandler::ExportDataGroupDailySegmented() of every sample
+//   gpx         GPXExporter::WriteDays()
+//   gpxwriter   GPXWriter against the XmlStream writer it replaced on one big day
+//
+// Each reports ns per payload and MB/s of the bytes that stage works through - payload
+// bytes, what GoProMeta actually read from the clips for process (the sample tables
+// included, skipped payloads not), the sample columns for grouping and the GPX written
+// for gpx. Run a Release build.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "getopt/getopt.hpp"
+
+#include "opts.h"
+#include "goprometa.h"
+#include "exporters.h"
+#include "mp4synth.h"
+
+using namespace std;
+
+extern void benchmark_GPXWriter(size_t numPoints);
+
+struct BenchConfig {
+	BenchConfig() : files(4), repeats(5), gpxPoints(1000000), bUseMemoryMap(false), bKeep(false), dir("/tmp/goproWhereWhenBench") {
+		synth.payloads = 600;
+	};
+	SynthMP4Config synth;
+	unsigned int files;
+	unsigned int repeats;		// Stages that are quick on their own are run this many times
+	size_t gpxPoints;			// Size of the gpxwriter day, 0 skips it
+	bool bUseMemoryMap;
+	bool bKeep;					// Leave the generated clips (and GPX) behind
+	string dir;
+};
+
+static double secondsSince(const chrono::steady_clock::time_point &t0) {
+	return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+static void report(const char* name, uint64_t payloads, uint64_t bytes, double secs) {
+	cout << "  " << left << setw(12) << name << right << fixed
+		<< setw(10) << payloads << " payloads "
+		<< setw(12) << setprecision(1) << (payloads ? secs * 1e9 / payloads : 0.0) << " ns/payload "
+		<< setw(10);
+	if (bytes)
+		cout << setprecision(1) << (secs > 0.0 ? bytes / secs / 1e6 : 0.0) << " MB/s" << endl;
+	else
+		cout << "-" << endl;
+}
+
+static uint64_t fileSize(const string &fname) {
+	struct stat st;
+
+	return stat(fname.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+int main(int argc, const char** argv) {
+	struct getopt args(argc, argv);
+	BenchConfig cfg;
+	opts byteParser;
+	vector<string> clips;
+	vector<vector<uint32_t>> payloads;		// Every payload of the first clip, for the in-memory stages
+	uint64_t clipPayloads, payloadBytes = 0, totalPayloads;
+
+	if (args.has("-h") || args.has("--help")) {
+		cout << "goproWhereWhenBench Usage:" << endl
+			<< " --payloads=N : Payloads (1.001s each) per generated clip. (default: 600)" << endl
+			<< " --files=N : Number of clips. (default: 4)" << endl
+			<< " --accl=N : ACCL samples per payload, 0 leaves the stream out. (default: 200)" << endl
+			<< " --gyro=N : GYRO samples per payload, 0 leaves the stream out. (default: 200)" << endl
+			<< " --padding=bytes : Stand-in video bytes ahead of each payload, K/M suffixes allowed. (default: 0)" << endl
+			<< " --repeats=N : Runs of the in-memory stages. (default: 5)" << endl
+			<< " --gpxpoints=N : Points in the gpxwriter comparison, 0 skips it. (default: 1000000)" << endl
+			<< " --dir=directory : Where the clips and GPX go. (default: /tmp/goproWhereWhenBench)" << endl
+			<< " --mmap : Memory map the clips in the getpayload and processfile stages." << endl
+			<< " --keep : Don't delete the clips and GPX afterwards." << endl;
+		return 1;
+	}
+
+	if (args.has("--payloads"))
+		cfg.synth.payloads = (uint32_t)atoi(args["--payloads"].c_str());
+	if (args.has("--files"))
+		cfg.files = (unsigned int)atoi(args["--files"].c_str());
+	if (args.has("--accl"))
+		cfg.synth.acclSamples = (uint16_t)atoi(args["--accl"].c_str());
+	if (args.has("--gyro"))
+		cfg.synth.gyroSamples = (uint16_t)atoi(args["--gyro"].c_str());
+	if (args.has("--repeats"))
+		cfg.repeats = (unsigned int)atoi(args["--repeats"].c_str());
+	if (args.has("--gpxpoints"))
+		cfg.gpxPoints = (size_t)atoll(args["--gpxpoints"].c_str());
+	if (args.has("--dir"))
+		cfg.dir = args["--dir"];
+	if (args.has("--mmap"))
+		cfg.bUseMemoryMap = true;
+	if (args.has("--keep"))
+		cfg.bKeep = true;
+	if (args.has("--padding")) {
+		int64_t padding;
+
+		if (!byteParser.parseByteCount(args["--padding"].c_str(), padding)) {
+			cout << "ERROR: --padding expects a byte count such as 65536, 512K or 16M" << endl;
+			return -1;
+		}
+		cfg.synth.paddingBytes = (uint64_t)padding;
+	}
+
+	if (cfg.synth.payloads == 0 || cfg.files == 0 || cfg.repeats == 0) {
+		cout << "ERROR: --payloads, --files and --repeats must be at least 1" << endl;
+		return -1;
+	}
+
+	mkdir(cfg.dir.c_str(), 0755);
+	clipPayloads = cfg.synth.payloads;
+	totalPayloads = clipPayloads * cfg.files;
+
+	cout << "Benchmarking " << cfg.files << " clips of " << clipPayloads << " payloads (ACCL " << cfg.synth.acclSamples
+		<< ", GYRO " << cfg.synth.gyroSamples << ", GPS5 " << cfg.synth.gpsSamples << " samples, "
+		<< cfg.synth.paddingBytes << " bytes padding) in " << cfg.dir << endl;
+
+	//
+	// generate - one clip after the other in time so they all group into the same day(s).
+	//
+	{
+		auto t0 = chrono::steady_clock::now();
+		uint64_t written = 0;
+
+		for (unsigned int f = 0; f < cfg.files; f++) {
+			SynthMP4Config synth = cfg.synth;
+			string clip = cfg.dir + "/bench" + to_string(f) + ".MP4";
+
+			synth.startMs += (int64_t)f * synth.payloads * 1001;
+			synth.seed = f + 1;
+			if (!writeSynthMP4(clip.c_str(), synth)) {
+				cout << "ERROR: Could not write " << clip << endl;
+				return -2;
+			}
+			clips.push_back(clip);
+			written += fileSize(clip);
+		}
+		report("generate", totalPayloads, written, secondsSince(t0));
+	}
+
+	//
+	// open
+	//
+	{
+		auto t0 = chrono::steady_clock::now();
+
+		for (unsigned int r = 0; r < cfg.repeats; r++)
+			for (auto &clip: clips) {
+				size_t mp4 = OpenMP4Source((char*)clip.c_str(), MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE);
+
+				if (mp4 == 0) {
+					cout << "ERROR: Could not open " << clip << endl;
+					return -3;
+				}
+				CloseSource(mp4);
+			}
+		report("open", totalPayloads * cfg.repeats, 0, secondsSince(t0));
+	}
+
+	//
+	// getpayload - also keeps a copy of the first clip's payloads for the stages below.
+	//
+	{
+		auto t0 = chrono::steady_clock::now();
+		uint64_t bytes = 0;
+
+		for (size_t c = 0; c < clips.size(); c++) {
+			size_t mp4 = OpenMP4SourceEx((char*)clips[c].c_str(), MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE,
+				cfg.bUseMemoryMap ? MP4_SOURCE_FLAG_MMAP : 0);
+			uint32_t n = GetNumberPayloads(mp4);
+
+			for (uint32_t i = 0; i < n; i++) {
+				uint32_t size = GetPayloadSize(mp4, i);
+				uint32_t* payload = GetPayloadView(mp4, i);
+
+				if (payload == NULL) {
+					cout << "ERROR: Could not read payload " << i << " of " << clips[c] << endl;
+					return -4;
+				}
+				if (c == 0)
+					payloads.push_back(vector<uint32_t>(payload, payload + size / 4));
+				bytes += size;
+			}
+			CloseSource(mp4);
+		}
+		report("getpayload", totalPayloads, bytes, secondsSince(t0));
+
+		for (auto &p: payloads)
+			payloadBytes += p.size() * 4;
+	}
+
+	//
+	// gpmfnext
+	//
+	{
+		auto t0 = chrono::steady_clock::now();
+		GPMF_stream ms;
+		uint64_t keys = 0;
+
+		for (unsigned int r = 0; r < cfg.repeats; r++)
+			for (auto &p: payloads) {
+				if (GPMF_Init(&ms, p.data(), p.size() * 4) != GPMF_OK)
+					return -5;
+				do {
+					keys++;
+				} while (GPMF_Next(&ms, GPMF_RECURSE_LEVELS) == GPMF_OK);
+			}
+		report("gpmfnext", payloads.size() * cfg.repeats, payloadBytes * cfg.repeats, secondsSince(t0));
+		cout << "              (" << keys / (payloads.size() * cfg.repeats) << " KLVs a payload)" << endl;
+	}
+
+	//
+	// scaleddata
+	//
+	{
+		const uint32_t keys[3] = { STR2FOURCC("GPS5"), STR2FOURCC("ACCL"), STR2FOURCC("GYRO") };
+		auto t0 = chrono::steady_clock::now();
+		vector<double> scaled;
+		GPMF_stream ms;
+		double sum = 0.0;
+
+		for (unsigned int r = 0; r < cfg.repeats; r++)
+			for (auto &p: payloads) {
+				for (auto key: keys) {
+					uint32_t samples, elements;
+
+					if (GPMF_Init(&ms, p.data(), p.size() * 4) != GPMF_OK)
+						return -6;
+					if (GPMF_FindNext(&ms, key, GPMF_RECURSE_LEVELS) != GPMF_OK)
+						continue;
+
+					samples = GPMF_Repeat(&ms);
+					elements = GPMF_ElementsInStruct(&ms);
+					if (scaled.size() < samples * elements)
+						scaled.resize(samples * elements);
+					if (GPMF_ScaledData(&ms, scaled.data(), scaled.size() * sizeof(double), 0, samples, GPMF_TYPE_DOUBLE) == GPMF_OK)
+						sum += scaled[0];
+				}
+			}
+		report("scaleddata", payloads.size() * cfg.repeats, payloadBytes * cfg.repeats, secondsSince(t0));
+		if (sum == 0.12345)		// Keep the work from being optimized away
+			cout << sum << endl;
+	}
+
+	//
+	// processfile - the samples of the every-sample run feed grouping and gpx.
+	//
+	SamplesHandler handler;
+	for (int timing = 0; timing <= 5; timing += 5) {
+		auto t0 = chrono::steady_clock::now();
+		GoProMeta gpm;
+		uint64_t bytesRead = 0;		// At 5s most payloads are skipped, not read
+
+		gpm.setSecondsBetweenSamples(timing);
+		gpm.setUseMemoryMap(cfg.bUseMemoryMap);
+
+		for (auto &clip: clips) {
+			if (!gpm.openFile(clip.c_str()) || !gpm.processFile()) {
+				cout << gpm.getErrors() << "ERROR: Could not process " << clip << endl;
+				return -7;
+			}
+			bytesRead += gpm.getBytesRead();
+			if (timing == 0) {
+				SampleStore samples;
+
+				gpm.getOutputPoints(samples);
+				handler.AddSampleSet(clip.c_str(), move(samples));
+			}
+		}
+		gpm.closeFile();
+		report(timing ? "process/5s" : "process/all", totalPayloads, bytesRead, secondsSince(t0));
+	}
+
+	//
+	// grouping
+	//
+	map<string, TrackViews> groups;
+	{
+		const SampleStore &store = handler.getStore();
+		uint64_t sampleBytes = store.size() * (sizeof(int64_t) + 3 * sizeof(int32_t) + 2 * sizeof(uint32_t));
+		streambuf* console = cout.rdbuf(NULL);		// The grouping lists the days it found
+		auto t0 = chrono::steady_clock::now();
+		double secs;
+
+		for (unsigned int r = 0; r < cfg.repeats; r++) {
+			groups.clear();
+			handler.ExportDataGroupDailySegmented(groups);
+		}
+		secs = secondsSince(t0);
+		cout.rdbuf(console);
+		cout.clear();
+		report("grouping", totalPayloads * cfg.repeats, sampleBytes * cfg.repeats, secs);
+	}
+
+	//
+	// gpx
+	//
+	{
+		auto t0 = chrono::steady_clock::now();
+		GPXExporter gpxOut(&handler);
+		uint64_t written = 0;
+		double secs;
+
+		gpxOut.WriteDays(groups, cfg.dir.c_str());
+		secs = secondsSince(t0);
+
+		for (auto &day: groups) {
+			string gpx = cfg.dir + "/" + day.first + ".gpx";
+
+			written += fileSize(gpx);
+			if (!cfg.bKeep)
+				remove(gpx.c_str());
+		}
+		report("gpx", totalPayloads, written, secs);
+	}
+
+	if (!cfg.bKeep)
+		for (auto &clip: clips)
+			remove(clip.c_str());
+
+	//
+	// gpxwriter
+	//
+	if (cfg.gpxPoints)
+		benchmark_GPXWriter(cfg.gpxPoints);
+
+	return 0;
+}
@@ -0,0 +1,244 @@
+//
+// Buffered CSV writer for the export path.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <algorithm>
+
+#include <string.h>
+#include <strings.h>
+
+#include "csvwriter.h"
+
+// GPS5 is scaled integers - 1e7 for lat/lon and 1e3 for elevation - so these keep every digit.
+static const int LATLON_DECIMALS = 7;
+static const int ELE_DECIMALS = 3;
+
+static const char* const COLUMN_NAMES[] = { "time", "lat", "lon", "ele", "file", "payload", "media" };
+
+CSVWriter::CSVWriter() {
+	fp = NULL;
+	used = 0;
+	columns = defaultColumns();
+	bOK = false;
+}
+
+CSVWriter::~CSVWriter() {
+	if (fp)
+		close();
+}
+
+std::vector<CSVWriter::Column> CSVWriter::defaultColumns() {
+	return { COL_TIME, COL_LAT, COL_LON, COL_ELE, COL_FILE };
+}
+
+//
+// Comma separated column names, case insensitive. Anything unknown, repeated (or an empty
+// list) fails.
+//
+bool CSVWriter::parseColumns(const char* list, std::vector<Column> &cols) {
+	std::string input(list ? list : "");
+	size_t start = 0;
+
+	cols.clear();
+
+	while (start <= input.size()) {
+		size_t end = input.find(',', start);
+		std::string name = input.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		bool bFound = false;
+
+		for (int c = COL_TIME; c <= COL_MEDIA; c++) {
+			if (!strcasecmp(name.c_str(), COLUMN_NAMES[c])) {
+				cols.push_back((Column)c);
+				bFound = true;
+			}
+		}
+
+		if (!bFound || std::count(cols.begin(), cols.end(), cols.back()) > 1)
+			return false;
+
+		if (end == std::string::npos)
+			break;
+		start = end + 1;
+	}
+
+	return !cols.empty();
+}
+
+bool CSVWriter::open(const char* fname) {
+	fp = fopen(fname, "wb");
+	if (!fp) {
+		std::cerr << "ERROR: Could not open output file: " << fname << std::endl;
+		return false;
+	}
+
+	buffer.resize(BUFFER_SIZE);
+	used = 0;
+	bOK = true;
+	return true;
+}
+
+void CSVWriter::flushBuffer() {
+	if (used && fp && fwrite(&buffer[0], 1, used, fp) != used)
+		bOK = false;
+	used = 0;
+}
+
+void CSVWriter::append(const char* text, size_t len) {
+	if (!fp)
+		return;
+
+	if (used + len > buffer.size()) {
+		flushBuffer();
+
+		// Bigger than the whole buffer - straight through.
+		if (len > buffer.size()) {
+			if (fp && fwrite(text, 1, len, fp) != len)
+				bOK = false;
+			return;
+		}
+	}
+
+	memcpy(&buffer[used], text, len);
+	used += len;
+}
+
+//
+// Flush before a row when less than this is left. Counts every column in the list, so a
+// caller that repeats one through setColumns() still can't run past the buffer.
+//
+size_t CSVWriter::maxRowText(size_t fileFieldLen) const {
+	size_t len = 1;		// '\n'
+
+	for (auto c: columns) {
+		len++;			// ','
+		switch (c) {
+		case COL_TIME:
+			len += FORMAT_DATETIME_MS_LEN;
+			break;
+		case COL_LAT:
+		case COL_LON:
+		case COL_ELE:
+			len += FORMAT_MAX_FIXED;
+			break;
+		case COL_FILE:
+			len += fileFieldLen;
+			break;
+		case COL_PAYLOAD:
+		case COL_MEDIA:
+			len += FORMAT_MAX_NUMBER;
+			break;
+		}
+	}
+
+	return len;
+}
+
+void CSVWriter::writeHeader() {
+	for (size_t c = 0; c < columns.size(); c++) {
+		if (c)
+			append(",", 1);
+		append(COLUMN_NAMES[columns[c]], strlen(COLUMN_NAMES[columns[c]]));
+	}
+	append("\n", 1);
+}
+
+//
+// The file name is quoted (RFC 4180) once up front, every row just copies it.
+//
+void CSVWriter::writeRows(const std::string &file, const SampleSpan &samples) {
+	std::string field;
+	size_t rowMax, last = samples.first + samples.count;
+
+	if (!fp || !samples.store)
+		return;
+
+	if (file.find_first_of(",\"\r\n") != std::string::npos) {
+		field = "\"";
+		for (char ch: file) {
+			if (ch == '"')
+				field += '"';
+			field += ch;
+		}
+		field += '"';
+	}
+	else
+		field = file;
+
+	// A silly long name must still fit a whole row in the buffer.
+	rowMax = maxRowText(field.size());
+	if (rowMax > buffer.size()) {
+		flushBuffer();
+		buffer.resize(rowMax);
+	}
+
+	const int64_t* timeMs = samples.store->timeColumn().data();
+	const int32_t* lat = samples.store->latColumn().data();
+	const int32_t* lon = samples.store->lonColumn().data();
+	const int32_t* ele = samples.store->eleColumn().data();
+	const uint32_t* payload = samples.store->payloadColumn().data();
+	const uint32_t* mediaMs = samples.store->mediaColumn().data();
+
+	for (size_t i = samples.first; i < last; i++) {
+		char* p;
+
+		if (used + rowMax > buffer.size())
+			flushBuffer();
+
+		p = &buffer[used];
+
+		for (size_t c = 0; c < columns.size(); c++) {
+			if (c)
+				*p++ = ',';
+
+			switch (columns[c]) {
+			case COL_TIME:
+				p = formatDateTimeMs(p, timeMs[i]);
+				break;
+			case COL_LAT:
+				p = formatFixed(p, SampleStore::toDegrees(lat[i]), LATLON_DECIMALS);
+				break;
+			case COL_LON:
+				p = formatFixed(p, SampleStore::toDegrees(lon[i]), LATLON_DECIMALS);
+				break;
+			case COL_ELE:
+				p = formatFixed(p, SampleStore::toMetres(ele[i]), ELE_DECIMALS);
+				break;
+			case COL_FILE:
+				memcpy(p, field.data(), field.size());
+				p += field.size();
+				break;
+			case COL_PAYLOAD:
+				p = formatInteger(p, payload[i]);
+				break;
+			case COL_MEDIA:
+				// Seconds into the clip, to the millisecond.
+				p = formatInteger(p, mediaMs[i] / 1000);
+				*p++ = '.';
+				*p++ = '0' + mediaMs[i] / 100 % 10;
+				*p++ = '0' + mediaMs[i] / 10 % 10;
+				*p++ = '0' + mediaMs[i] % 10;
+				break;
+			}
+		}
+		*p++ = '\n';
+
+		used = p - &buffer[0];
+	}
+}
+
+bool CSVWriter::close() {
+	if (!fp)
+		return false;
+
+	flushBuffer();
+
+	if (fclose(fp) != 0)
+		bOK = false;
+	fp = NULL;
+
+	return bOK;
+}
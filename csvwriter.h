@@ -0,0 +1,53 @@
+#ifndef _CSVWRITER_H
+#define _CSVWRITER_H
+//
+// Buffered CSV writer for the export path.
+//
+// Rows are formatted straight into one large buffer (no iostreams) and go out in big
+// fwrite()s, so a big export is limited by the disk rather than by number formatting.
+// Which columns appear, and in what order, is up to the caller.
+//
+// Usage: setColumns(), open(), writeHeader(), writeRows() per track, close().
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "samplestore.h"
+#include "fastformat.h"
+
+class CSVWriter {
+public:
+	enum Column { COL_TIME, COL_LAT, COL_LON, COL_ELE, COL_FILE, COL_PAYLOAD, COL_MEDIA };
+
+	CSVWriter();
+	~CSVWriter();
+	static bool parseColumns(const char* list, std::vector<Column> &cols);	// ie "time,lat,lon,ele,file,payload,media", each once
+	static std::vector<Column> defaultColumns();
+	void setColumns(const std::vector<Column> &_columns) { columns = _columns; };
+	bool open(const char* fname);
+	void writeHeader();
+	void writeRows(const std::string &file, const SampleSpan &samples);
+	bool close();
+
+protected:
+	void append(const char* text, size_t len);
+	void flushBuffer();
+	size_t maxRowText(size_t fileFieldLen) const;	// Longest row the columns can make
+
+	enum { BUFFER_SIZE = 1 << 20 };
+
+	FILE* fp;
+	std::vector<char> buffer;
+	size_t used;
+	std::vector<Column> columns;
+	bool bOK;
+};
+
+#endif
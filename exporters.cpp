@@ -10,10 +10,18 @@
 #include <iomanip>
 #include <fstream>
 #include <string>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
 
+#include <stdio.h>
+#include <string.h>
 #include <libgen.h>
 
 #include "exporters.h"
+#include "gpxwriter.h"
+#include "csvwriter.h"
+#include "arrowwriter.h"
 
 using namespace	xmlw;
 
@@ -31,59 +39,73 @@ SamplesHandler::~SamplesHandler() {
 
 }
 
-bool SamplesHandler::AddSampleSet(const char* keyname, std::vector<GPSSample> samples) {
+//
+// Takes ownership of 'samples' - the caller's store is left empty. They're only parked
+// here; gatherPending() moves the lot into 'store' once every file is in and the total
+// is known, rather than growing it (and copying what's there) file after file.
+//
+bool SamplesHandler::AddSampleSet(const char* keyname, SampleStore &&samples) {
+	std::lock_guard<std::mutex> guard(addLock);
+
 	if (trackGroups.find(keyname) != trackGroups.end()) {
 		std::cerr << "ERROR: keyname in use - SamplesHandler cannot add SampleSet named: " << keyname << std::endl;
 		return false;
 	}
 
-	trackGroups[keyname] = samples;
+	trackGroups[keyname] = store.getRanges().size() + pending.size();
+	pending.emplace_back(keyname, std::move(samples));
 	return true;
 }
 
-void SamplesHandler::makeUniqueBasenames(std::map<std::string, std::vector<GPSSample>> &inbound) {
-	std::map<std::string, std::vector<GPSSample>> outbound;
-	std::string nameInQuestion;
+void SamplesHandler::gatherPending() {
+	std::lock_guard<std::mutex> guard(addLock);
+
+	if (!pending.empty())
+		store.append(std::move(pending));
+}
+
+//
+// basename() of 'path', or basename-N when that is already in 'taken'. The winner is added to 'taken'.
+//
+static std::string claimUniqueBasename(const std::string &path, std::set<std::string> &taken) {
+	std::string name(path);
+	std::string nameInQuestion = basename((char*)name.c_str());
+	std::string candidate = nameInQuestion;
+
+	for (unsigned int ver=1; taken.find(candidate) != taken.end(); ver++)
+		candidate = nameInQuestion + "-" + std::to_string(ver);
+
+	taken.insert(candidate);
+	return candidate;
+}
+
+void SamplesHandler::makeUniqueBasenames(std::map<std::string, size_t> &inbound) {
+	std::map<std::string, size_t> outbound;
+	std::set<std::string> taken;
+
+	gatherPending();
 
 	// Iterate the inbound list.
 	// Get the basename() for each entry and compare that against the outbound list
 	// For any non-unique item, create a unique version.
 	// Then put it into the outbound list.
 	//
-	// For any item that's found to be unique, simply copy it to the outbound list
-	for (auto in: inbound) {
-		unsigned int ver=1;
-
-		nameInQuestion = basename((char*)in.first.c_str()); // Hopefully it's NOT a troubled name...
-
-		if (outbound.find(nameInQuestion) == outbound.end()) {
-			// It's unique. Didn't find it in the list so we're good to simply add it.
-			outbound[nameInQuestion] = in.second;
-		}
-		else {
-			// Must create unique version of troubledName
-			// 
-			do {
-				std::string candidate;
-
-				candidate = nameInQuestion + "-" + std::to_string(ver);
-
-				// Check this one for uniqueness. If unique, add it and break;
-				if (outbound.find(candidate) == outbound.end()) {
-					outbound[candidate] = in.second;
-					break;
-				}
-			} while(1);
+	// For any item that's found to be unique, simply carry it over to the outbound list
+	for (auto &in: inbound) {
+		std::string unique = claimUniqueBasename(in.first, taken);
 
-		}
+		store.renameRange(in.second, unique);
+		outbound[unique] = in.second;
 	}
 
-	// In the end - copy back to the original.
-	inbound = outbound;
+	// In the end - hand the renamed map back to the original.
+	inbound.swap(outbound);
 }
 
-void SamplesHandler::ExportDataGroupDailySegmented(
-	std::map<std::string, std::map<std::string, std::vector<GPSSample>>> &outGroups) {
+//
+// outGroups only points into the store - it is valid until the SamplesHandler changes.
+//
+void SamplesHandler::ExportDataGroupDailySegmented(std::map<std::string, TrackViews> &outGroups) {
 	// iterate the full map
 	  // get the start date for entry
 	  // check if the output has an entry for this date
@@ -93,21 +115,22 @@ void SamplesHandler::ExportDataGroupDailySegmented(
 
 	makeUniqueBasenames(trackGroups); // Clean up trackGroups and strip path from keys
 
-	for (auto inmap: trackGroups) {
-		std::string fname = inmap.first;
-		std::vector<GPSSample> samples = inmap.second;
+	for (auto &inmap: trackGroups) {
+		const std::string &fname = inmap.first;
+		const SampleStore::Range &range = store.getRanges()[inmap.second];
+		SampleSpan samples(&store, range.first, range.count);
 		std::string trackDate;
-		std::map<std::string, std::vector<GPSSample>> blank;
+		TrackViews blank;
 
 		// Shouldn't happen, but validate there's an entry here before accessing it.
-		if (samples.size() == 0)
+		if (samples.count == 0)
 			continue;
 
 		// Date from the first entry of the iterated trackGroups items.
-		trackDate = samples[0].getDateOnly();
+		trackDate = store.getDateOnly(range.first);
 
 		// Quick status update of what's being iterated. #samples, datename, filename
-//		std::cout << "Iterating: " << samples.size() << " samples on " << trackDate << " in: ..." << rightStr(fname, 35) << std::endl;
+//		std::cout << "Iterating: " << samples.count << " samples on " << trackDate << " in: ..." << rightStr(fname, 35) << std::endl;
 
 		if (outGroups.find(trackDate.c_str()) == outGroups.end()) {
 			// No entry for this date yet.
@@ -115,20 +138,20 @@ void SamplesHandler::ExportDataGroupDailySegmented(
 
 			// Without an entry yet, we'll insert a 'blank' entry and then insert our 'inmap'
 			outGroups[trackDate] = blank;
-			outGroups[trackDate].insert(inmap);
+			outGroups[trackDate][fname] = samples;
 		}
 		else {
 			// date entry already exists. Add an entry directly to its existing map
 			// No need to be worried about uniqueness in sub-list since all keys
 			// are unique in the original map (by definition) and should already be basenames
 
-			outGroups[trackDate].insert(inmap);
+			outGroups[trackDate][fname] = samples;
 		}
 
 	}
 
 	std::cout << "outGroups[] has " << outGroups.size() << " unique date entries in it:" << std::endl;
-	for (auto m: outGroups) {
+	for (auto &m: outGroups) {
 		std::cout << " " << m.first << " has " << m.second.size() << " sets of samples." << std::endl;
 	}
 }
@@ -141,36 +164,90 @@ GPXExporter::~GPXExporter() {
 
 }
 
-void tagGPXStartup(XmlStream &xml) {
-	TD time;
-	time.setToCurrentTime();
+//
+// One GPX file holding a trk per entry of 'tracks', stamped with 'stamp' in the metadata.
+//
+static bool writeGPXDay(const std::string &fname, const TrackViews &tracks, const TD &stamp) {
+	GPXWriter gpx;
 
-	// Assumes xml is already associated with a file that's open.
-	xml << useIndentation(true) << prolog()
-		<< tag("gpx")
-		<< attr("xmlns") << "http://www.topografix.com/GPX/1/1"
-		<< attr("creator") << "goproWhereWhen"
-		<< attr("version") << "1.1"
-		<< attr("xmlns:xsi") << "http://www.w3.org/2001/XMLSchema-instance"
-		<< attr("xsi:schemaLocation") << "http://www.topografix.com/GPX/1/1 http://www.topografix.com/GPX/1/1/gpx.xsd";
+	if (!gpx.open(fname.c_str()))
+		return false;
 
-	xml << tag("metadata")
-			<< tag("link") << attr("href") << "http://www.ridebdr.com"
-				<< tag("text") << chardata() << "Robert Wolff - ADV Fan"
-				<< endtag()
-			<< endtag()
-			<< tag("time") << chardata() << time
-			<< endtag()
-		<< endtag();	// metadata
+	gpx.writeHeader(stamp);
+
+	for (auto &segs: tracks) {
+		const SampleStore &s = *segs.second.store;
+		const int64_t* timeMs = s.timeColumn().data();
+		const int32_t* lat = s.latColumn().data();
+		const int32_t* lon = s.lonColumn().data();
+		const int32_t* ele = s.eleColumn().data();
+		size_t last = segs.second.first + segs.second.count;
+
+		gpx.beginTrack(segs.first);
+		for (size_t i = segs.second.first; i < last; i++)
+			gpx.writePoint(timeMs[i], SampleStore::toDegrees(lat[i]), SampleStore::toDegrees(lon[i]), SampleStore::toMetres(ele[i]));
+		gpx.endTrack();
+	}
+
+	if (!gpx.close()) {
+		std::cerr << "ERROR: Failed writing GPX file: " << fname << std::endl;
+		return false;
+	}
 
+	return true;
+}
+
+static bool writeGPXDay(const std::string &fname, const TrackViews &tracks) {
+	TD now;
+
+	now.setToCurrentTime();
+	return writeGPXDay(fname, tracks, now);
+}
+
+//
+// One CSV file holding every track of 'tracks' back to back under a single header.
+//
+static bool writeCSVDay(const std::string &fname, const TrackViews &tracks, const std::vector<CSVWriter::Column> &columns) {
+	CSVWriter csv;
+
+	csv.setColumns(columns);
+	if (!csv.open(fname.c_str()))
+		return false;
+
+	csv.writeHeader();
+	for (auto &segs: tracks)
+		csv.writeRows(segs.first, segs.second);
+
+	if (!csv.close()) {
+		std::cerr << "ERROR: Failed writing CSV file: " << fname << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// <destdir>/<date><ext>, or just <date><ext> without a destdir.
+static std::string dayFileName(const std::string &prefix, const std::string &date, const char* ext) {
+	if (prefix != "")
+		return prefix + "/" + date + ext;
+	return date + ext;
 }
 
 bool GPXExporter::ExportDailySegmented(const char* destdir) {
-	std::string prefix(destdir); // destdir can be empty or null - it's ok.
-	std::map<std::string, std::map<std::string, std::vector<GPSSample>>> outGroups;
+	std::map<std::string, TrackViews> outGroups;
 
 	pHandler->ExportDataGroupDailySegmented(outGroups);
 
+	return WriteDays(outGroups, destdir);
+}
+
+//
+// One file per date, named for the date. For when the groups are shared with another exporter.
+//
+bool GPXExporter::WriteDays(const std::map<std::string, TrackViews> &outGroups, const char* destdir) {
+	std::string prefix(destdir ? destdir : ""); // destdir can be empty or null - it's ok.
+	bool bOK = true;
+
 /*
 <gpx>
   <metadata>...</metadata>
@@ -182,49 +259,571 @@ bool GPXExporter::ExportDailySegmented(const char* destdir) {
         <time>2009-10-17T18:37:26Z</time>
       </trkpt>
 */
-	for (auto dateGroup: outGroups) {
+	for (auto &dateGroup: outGroups) {
 		// Each dateGroup is a file to export
 		// Inside each entry, each sub-entry is a 'trk->name' with trkseg->trkpt
-		std::string fnameDate;
-		std::ofstream f;
-
-		if (prefix != "")
-			fnameDate = prefix + "/" + dateGroup.first + ".gpx";
-		else
-			fnameDate = dateGroup.first+".gpx";
-		f.open(fnameDate);
-
-		XmlStream xml(f);
-
-		tagGPXStartup(xml);
-
-		// Now iterate the entry for segments/tracks based on filename
-		// Will need to shorten the filename and ensure uniqueness too
-		for (auto segs: dateGroup.second) {
-		    xml << tag("trk");
-		      xml << tag("name")
-		    	  << chardata() << segs.first << endtag();
-		      xml << tag("trkseg");
-
-		    // Now iterate the samples found here as trkpt
-		    for (auto point: segs.second) {
-		    	xml << tag("trkpt")
-		    		<< attr("lat") << point.getLat()
-		    		<< attr("lon") << point.getLon();
-
-		    		xml << tag("ele")  << chardata() << point.getEle() << endtag();
-		    		xml << tag("time") << chardata() << point.getTD() << endtag();
-		    	xml << endtag(); // Finish trkpt
-		    }
-
-		    xml << endtag(); // Finish the trkseg
-		    xml << endtag(); // Finish trk
-		}
+		if (!writeGPXDay(dayFileName(prefix, dateGroup.first, ".gpx"), dateGroup.second))
+			bOK = false;
+	}
+
+	return bOK;
+}
+
+CSVExporter::CSVExporter(SamplesHandler* _pHandler) {
+	pHandler = _pHandler;
+	columns = CSVWriter::defaultColumns();
+}
+
+CSVExporter::~CSVExporter() {
+
+}
+
+bool CSVExporter::ExportDailySegmented(const char* destdir) {
+	std::map<std::string, TrackViews> outGroups;
+
+	pHandler->ExportDataGroupDailySegmented(outGroups);
+
+	return WriteDays(outGroups, destdir);
+}
+
+//
+// Same grouping as the GPX files - one per date - with the track name in the 'file' column.
+//
+bool CSVExporter::WriteDays(const std::map<std::string, TrackViews> &outGroups, const char* destdir) {
+	std::string prefix(destdir ? destdir : "");
+	bool bOK = true;
+
+	for (auto &dateGroup: outGroups) {
+		if (!writeCSVDay(dayFileName(prefix, dateGroup.first, ".csv"), dateGroup.second, columns))
+			bOK = false;
+	}
+
+	return bOK;
+}
+
+ArrowExporter::ArrowExporter(SamplesHandler* _pHandler) {
+	pHandler = _pHandler;
+}
+
+ArrowExporter::~ArrowExporter() {
+
+}
+
+//
+// The handler's store already has one range per file in file order - it's written as is.
+//
+bool ArrowExporter::Export(const char* fname) {
+	ArrowWriter arrow;
+
+	pHandler->settleTrackNames();
+
+	if (!arrow.open(fname))
+		return false;
+
+	arrow.writeStore(pHandler->getStore());
+
+	if (!arrow.close()) {
+		std::cerr << "ERROR: Failed writing Arrow file: " << fname << std::endl;
+		return false;
+	}
+
+	std::cout << "Wrote " << pHandler->getStore().size() << " samples to " << fname << std::endl;
+	return true;
+}
+
+GPXStreamExporter::GPXStreamExporter(const char* _destdir) {
+	prefix = _destdir ? _destdir : "";
+	bWriteGPX = true;
+	bWriteCSV = false;
+	csvColumns = CSVWriter::defaultColumns();
+}
+
+//
+// GPX only unless told otherwise. Each flushed day goes out in every selected format.
+//
+void GPXStreamExporter::setOutputs(bool _bWriteGPX, bool _bWriteCSV, const std::vector<CSVWriter::Column> &_csvColumns) {
+	bWriteGPX = _bWriteGPX;
+	bWriteCSV = _bWriteCSV;
+	csvColumns = _csvColumns;
+}
+
+GPXStreamExporter::~GPXStreamExporter() {
+
+}
+
+//
+// Must be handed the final (start-time ordered) file list before any samples arrive.
+// Unique track names are settled up front the same way makeUniqueBasenames() does it - in
+// full path order over every file that gets processed, samples or not - so names match a
+// non-streaming run. Files that won't open don't take one. (A file that opens fine but
+// turns out broken part way through still holds its name, whereas a batch run never
+// names it.)
+//
+void GPXStreamExporter::setFileOrder(const std::vector<std::string> &files, const std::vector<FileStart> &starts) {
+	std::set<std::string> paths;
 
-		xml << endtag(); // Finish gpx
+	uniqueNames.clear();
+	startDates.clear();
+	takenNames.clear();
 
-		f.close();
+	for (size_t i = 0; i < files.size(); i++) {
+		startDates[files[i]] = starts[i].key.substr(0, 10);		// YYYY-MM-DD
+		if (starts[i].bProcessable)
+			paths.insert(files[i]);
 	}
 
+	for (auto &p: paths)
+		uniqueNames[p] = claimUniqueBasename(p, takenNames);
+}
+
+bool GPXStreamExporter::AddSampleSet(const char* keyname, SampleStore &&samples) {
+	std::lock_guard<std::mutex> guard(addLock);
+	std::string trackDate, name;
+
+	// Every file still to come starts on or after this one, so no later file can add to
+	// an earlier day. Those are done.
+	flushDaysBefore(startDates[keyname]);
+
+	// Same rule as ExportDataGroupDailySegmented() - empty sets don't make it to the output.
+	if (samples.size() == 0)
+		return true;
+
+	trackDate = samples.getDateOnly(0);
+
+	if (uniqueNames.find(keyname) != uniqueNames.end())
+		name = uniqueNames[keyname];
+	else
+		name = claimUniqueBasename(keyname, takenNames);
+
+	if (flushedDays.find(trackDate) != flushedDays.end())
+		std::cerr << "WARNING: " << keyname << " has samples for " << trackDate
+			<< " which was already written. They will go to a separate file." << std::endl;
+
+	if (openDays[trackDate].find(name) != openDays[trackDate].end()) {
+		std::cerr << "ERROR: keyname in use - SamplesHandler cannot add SampleSet named: " << keyname << std::endl;
+		return false;
+	}
+
+	openDays[trackDate][name] = std::move(samples);
 	return true;
 }
+
+void GPXStreamExporter::flushDaysBefore(const std::string &dateLimit) {
+	while (!openDays.empty() && openDays.begin()->first < dateLimit)
+		flushDay(openDays.begin()->first);
+}
+
+void GPXStreamExporter::flushDay(const std::string &date) {
+	std::string fnameDate = date;
+	TrackViews tracks;
+
+	// A day showing up again after it was written (GPS time stepping backwards across midnight)
+	// can't be merged into the existing file without holding everything - give it its own.
+	for (unsigned int ver=1; flushedDays.find(fnameDate) != flushedDays.end(); ver++)
+		fnameDate = date + "-" + std::to_string(ver);
+
+	for (auto &t: openDays[date])
+		tracks[t.first] = SampleSpan(&t.second, 0, t.second.size());
+
+	if (bWriteGPX)
+		writeGPXDay(dayFileName(prefix, fnameDate, ".gpx"), tracks);
+	if (bWriteCSV)
+		writeCSVDay(dayFileName(prefix, fnameDate, ".csv"), tracks, csvColumns);
+
+	flushedDays.insert(fnameDate);
+	writtenDays[fnameDate] += openDays[date].size();
+	openDays.erase(date);
+}
+
+//
+// Writes whatever is still open and prints the same recap as ExportDataGroupDailySegmented().
+//
+void GPXStreamExporter::finish() {
+	std::lock_guard<std::mutex> guard(addLock);
+
+	while (!openDays.empty())
+		flushDay(openDays.begin()->first);
+
+	std::cout << "outGroups[] has " << writtenDays.size() << " unique date entries in it:" << std::endl;
+	for (auto &m: writtenDays) {
+		std::cout << " " << m.first << " has " << m.second << " sets of samples." << std::endl;
+	}
+}
+
+//
+// Pushes a batch of samples through the handler, grouping and GPX export (both the
+// batch and the streaming flavor) and checks that no sample set got copied along the way.
+//
+void unittest_SampleCopies() {
+	const unsigned int numSamples = 1000;
+	const unsigned int numFiles = 20;
+	const int64_t startMs = 1593864000000LL;	// 2020-07-04T12:00:00Z
+	SamplesHandler handler;
+	GPXStreamExporter stream("/tmp");
+	std::map<std::string, TrackViews> outGroups;
+	SampleStore setA;
+	FileStart start;
+	unsigned long before, rowsBefore;
+
+	before = SampleStore::getCopyCount();
+	rowsBefore = SampleStore::getRowCopyCount();
+
+	// Every row may be copied once, into its final place in the handler's store - never
+	// again as more files arrive.
+	for (unsigned int f = 0; f < numFiles; f++) {
+		SampleStore set;
+
+		set.reserve(numSamples);
+		for (unsigned int i = 0; i < numSamples; i++)
+			set.push_back(startMs + i * 1000, 39.0 + f + i * 0.0001, -105.0, 1600.0);
+		handler.AddSampleSet(("/" + std::to_string(f) + "/GX010001.MP4").c_str(), std::move(set));
+	}
+	handler.ExportDataGroupDailySegmented(outGroups);
+
+	GPXExporter gpxOut(&handler);
+	gpxOut.ExportDailySegmented("/tmp");
+	remove("/tmp/2020-07-04.gpx");
+
+	unsigned long rows = SampleStore::getRowCopyCount() - rowsBefore;
+	std::cout << "Checking sample copies (batch): " << SampleStore::getCopyCount() - before << " stores, " << rows << " rows : "
+		<< (SampleStore::getCopyCount() == before && rows <= numFiles * numSamples && handler.getStore().size() == numFiles * numSamples
+			? "PASSED." : "FAILED.") << std::endl;
+
+	for (unsigned int i = 0; i < numSamples; i++)
+		setA.push_back(startMs + i * 1000, 41.0 + i * 0.0001, -107.0, 1800.0);
+
+	before = SampleStore::getCopyCount();
+	rowsBefore = SampleStore::getRowCopyCount();
+
+	start.bProcessable = true;
+	start.key = "2020-07-04T12:00:00Z";
+	stream.setFileOrder({ "/c/GX010001.MP4" }, { start });
+	stream.AddSampleSet("/c/GX010001.MP4", std::move(setA));
+	stream.finish();
+	remove("/tmp/2020-07-04.gpx");
+
+	std::cout << "Checking sample copies (stream): " << SampleStore::getCopyCount() - before << " stores, "
+		<< SampleStore::getRowCopyCount() - rowsBefore << " rows : "
+		<< (SampleStore::getCopyCount() == before && SampleStore::getRowCopyCount() == rowsBefore ? "PASSED." : "FAILED.") << std::endl;
+}
+
+static std::string readWholeFile(const std::string &fname) {
+	std::ifstream f(fname, std::ios::binary);
+	std::ostringstream os;
+
+	os << f.rdbuf();
+	return os.str();
+}
+
+#if defined(UNITTEST) || defined(BENCHMARK)
+//
+// The XmlStream based writer GPXWriter replaced. Kept as the reference the fast path is
+// checked and benchmarked against - test and benchmark builds only.
+//
+static void writeGPXDayXmlStream(const std::string &fname, const TrackViews &tracks, const TD &stamp) {
+	std::ofstream f;
+
+	f.open(fname);
+
+	XmlStream xml(f);
+
+	xml << useIndentation(true) << prolog()
+		<< tag("gpx")
+		<< attr("xmlns") << "http://www.topografix.com/GPX/1/1"
+		<< attr("creator") << "goproWhereWhen"
+		<< attr("version") << "1.1"
+		<< attr("xmlns:xsi") << "http://www.w3.org/2001/XMLSchema-instance"
+		<< attr("xsi:schemaLocation") << "http://www.topografix.com/GPX/1/1 http://www.topografix.com/GPX/1/1/gpx.xsd";
+
+	xml << tag("metadata")
+			<< tag("link") << attr("href") << "http://www.ridebdr.com"
+				<< tag("text") << chardata() << "Robert Wolff - ADV Fan"
+				<< endtag()
+			<< endtag()
+			<< tag("time") << chardata() << stamp
+			<< endtag()
+		<< endtag();	// metadata
+
+	for (auto &segs: tracks) {
+	    xml << tag("trk");
+	      xml << tag("name")
+	    	  << chardata() << segs.first << endtag();
+	      xml << tag("trkseg");
+
+	    const SampleStore &s = *segs.second.store;
+	    size_t last = segs.second.first + segs.second.count;
+
+	    for (size_t i = segs.second.first; i < last; i++) {
+	    	xml << tag("trkpt")
+	    		<< attr("lat") << s.getLat(i)
+	    		<< attr("lon") << s.getLon(i);
+
+	    		xml << tag("ele")  << chardata() << s.getEle(i) << endtag();
+	    		xml << tag("time") << chardata() << UTCMillis(s.getTimeMs(i)) << endtag();
+	    	xml << endtag(); // Finish trkpt
+	    }
+
+	    xml << endtag(); // Finish the trkseg
+	    xml << endtag(); // Finish trk
+	}
+
+	xml << endtag(); // Finish gpx
+
+	f.close();
+}
+
+//
+// GPXWriter against XmlStream on awkward values - rounding ties, values right at a power
+// of ten, tiny/huge/negative numbers, an empty track - the two files must be identical.
+// Only values the store can hold: lat/lon to 1e-7 degrees, ele to the mm.
+//
+void unittest_GPXWriter() {
+	const int64_t startMs = 1593864000000LL;	// 2020-07-04T12:00:00Z
+	const double awkward[] = { 0.0, -0.0, 1.0, -1.0, 0.5, 9.9999995, 9.999995, 99.99995, 199.99995, 1e-4, 9.99999e-5,
+		1e-5, 123.4565, 1e-7, 214.7483647, -214.7483648, 47.644548, -122.326897, 4.46, 0.0001235, 2.5e-3, 39.1234565 };
+	const double awkwardEle[] = { 0.0, -0.5, 9.9995, 99999.95, 999999.5, 123456.5, 1234567.0, 2147483.647, -2147483.648,
+		1e-3, 0.0015, -430.5, 8848.865 };
+	const size_t numAwkward = sizeof(awkward) / sizeof(awkward[0]);
+	const size_t numAwkwardEle = sizeof(awkwardEle) / sizeof(awkwardEle[0]);
+	const std::string fast("/tmp/unittest_gpxwriter_fast.gpx"), ref("/tmp/unittest_gpxwriter_xmlstream.gpx");
+	SampleStore a, b, empty;
+	TrackViews tracks;
+	TD stamp;
+	unsigned int seed = 12345;
+
+	stamp.setFields(2020, 7, 4, 12, 34, 56);
+
+	for (size_t i = 0; i < numAwkward; i++)
+		a.push_back(startMs + i * 1000, awkward[i], awkward[numAwkward - 1 - i], awkwardEle[(i * 7) % numAwkwardEle]);
+
+	// Plenty of ordinary GPS-like values too.
+	for (unsigned int i = 0; i < 100000; i++) {
+		seed = seed * 1103515245 + 12345;
+		double lat = -90.0 + (seed % 180000000) / 1e6;
+		seed = seed * 1103515245 + 12345;
+		double lon = -180.0 + (seed % 360000000) / 1e6;
+		seed = seed * 1103515245 + 12345;
+		double ele = -400.0 + (seed % 90000000) / 1e4;
+
+		b.push_back(startMs + (int64_t)i * 1001, lat, lon, ele);
+	}
+
+	tracks["GX010001.MP4"] = SampleSpan(&a, 0, a.size());
+	tracks["GX010002.MP4"] = SampleSpan(&empty, 0, 0);
+	tracks["GX010003.MP4"] = SampleSpan(&b, 0, b.size());
+
+	writeGPXDay(fast, tracks, stamp);
+	writeGPXDayXmlStream(ref, tracks, stamp);
+
+	std::cout << "Checking GPXWriter matches XmlStream: "
+		<< (readWholeFile(fast) == readWholeFile(ref) ? "PASSED." : "FAILED.") << std::endl;
+
+	remove(fast.c_str());
+	remove(ref.c_str());
+}
+
+//
+// Writes the same 'numPoints' point day with XmlStream and with GPXWriter and reports both times.
+//
+void benchmark_GPXWriter(size_t numPoints) {
+	const int64_t startMs = 1593864000000LL;
+	const std::string fast("/tmp/benchmark_gpxwriter_fast.gpx"), ref("/tmp/benchmark_gpxwriter_xmlstream.gpx");
+	SampleStore s;
+	TrackViews tracks;
+	TD stamp;
+
+	stamp.setToCurrentTime();
+
+	s.reserve(numPoints);
+	for (size_t i = 0; i < numPoints; i++)
+		s.push_back(startMs + (int64_t)i * 1000, 39.0 + i * 1e-7, -105.0 - i * 1.3e-7, 1600.0 + (i % 5000) * 0.1);
+	tracks["GX010001.MP4"] = SampleSpan(&s, 0, s.size());
+
+	auto t0 = std::chrono::steady_clock::now();
+	writeGPXDayXmlStream(ref, tracks, stamp);
+	auto t1 = std::chrono::steady_clock::now();
+	writeGPXDay(fast, tracks, stamp);
+	auto t2 = std::chrono::steady_clock::now();
+
+	double refSecs = std::chrono::duration<double>(t1 - t0).count();
+	double fastSecs = std::chrono::duration<double>(t2 - t1).count();
+
+	std::cout << std::fixed << std::setprecision(3) << "GPX export of " << numPoints << " points: XmlStream " << refSecs << "s, GPXWriter " << fastSecs
+		<< "s (" << (fastSecs > 0 ? refSecs / fastSecs : 0) << "x), output "
+		<< (readWholeFile(fast) == readWholeFile(ref) ? "identical." : "DIFFERS.") << std::endl;
+
+	remove(fast.c_str());
+	remove(ref.c_str());
+}
+#endif
+
+//
+// CSVWriter against the same rows built with snprintf. GPS5-like values (scaled integers)
+// must come out exactly as %.7f / %.3f print them.
+//
+void unittest_CSVWriter() {
+	const int64_t startMs = 1593864000250LL;	// 2020-07-04T12:00:00.250Z
+	const std::string fname("/tmp/unittest_csvwriter.csv");
+	std::vector<CSVWriter::Column> cols;
+	std::string expected("payload,time,lat,lon,ele,file,media\n");
+	SampleStore s;
+	TrackViews tracks;
+	unsigned int seed = 4321;
+	char line[256];
+	bool bParse;
+
+	bParse = CSVWriter::parseColumns("payload,TIME,lat,lon,ele,file,Media", cols) && cols.size() == 7
+		&& !CSVWriter::parseColumns("time,latt", cols) && !CSVWriter::parseColumns("", cols)
+		&& !CSVWriter::parseColumns("time,", cols) && !CSVWriter::parseColumns("file,file,lat,lat,lat,lat", cols)
+		&& !CSVWriter::parseColumns("time,lat,TIME", cols);
+	std::cout << "Checking CSV column parsing: " << (bParse ? "PASSED." : "FAILED.") << std::endl;
+
+	for (unsigned int i = 0; i < 100000; i++) {
+		seed = seed * 1103515245 + 12345;
+		double lat = ((int64_t)(seed % 1800000000) - 900000000) / 1e7;
+		seed = seed * 1103515245 + 12345;
+		double lon = ((int64_t)(seed % 3600000000U) - 1800000000) / 1e7;
+		seed = seed * 1103515245 + 12345;
+		double ele = ((int64_t)(seed % 9000000) - 400000) / 1e3;
+		int64_t ms = startMs + (int64_t)i * 1001;
+		uint32_t mediaMs = i * 1001 / 18;
+		utc::Civil c = utc::fromMillis(ms);
+
+		s.push_back(ms, lat, lon, ele, i / 18, mediaMs);
+		snprintf(line, sizeof(line), "%u,%04d-%02d-%02dT%02d:%02d:%02d.%03dZ,%.7f,%.7f,%.3f,\"GX01,\"\"0001\"\".MP4\",%u.%03u\n",
+			i / 18, c.year, c.month, c.day, c.hour, c.minute, c.second, c.millis, lat, lon, ele, mediaMs / 1000, mediaMs % 1000);
+		expected += line;
+	}
+
+	tracks["GX01,\"0001\".MP4"] = SampleSpan(&s, 0, s.size());
+	CSVWriter::parseColumns("payload,time,lat,lon,ele,file,media", cols);
+	writeCSVDay(fname, tracks, cols);
+
+	std::cout << "Checking CSVWriter output: " << (readWholeFile(fname) == expected ? "PASSED." : "FAILED.") << std::endl;
+
+	remove(fname.c_str());
+}
+
+//
+// Raw GPS5 values scaled the way GPMF_ScaledData does (raw / SCAL as doubles) must come back
+// out of the fixed point store as the very same doubles, so the GPX and CSV files are byte
+// for byte those written from the parser's doubles directly. Covers the extremes of the
+// int32 range and a coarser SCAL (1e6 degrees, cm) as well as GoPro's own.
+//
+void unittest_FixedPointStore() {
+	const int64_t startMs = 1593864000000LL;	// 2020-07-04T12:00:00Z
+	const std::string storeGPX("/tmp/unittest_fixedpoint_store.gpx"), refGPX("/tmp/unittest_fixedpoint_ref.gpx");
+	const std::string storeCSV("/tmp/unittest_fixedpoint_store.csv");
+	const int32_t edges[] = { 0, 1, -1, 900000000, -900000000, 1800000000, -1800000000, 2147483647, -2147483647 - 1,
+		391234565, -1051234565, 99999995 };
+	const size_t numEdges = sizeof(edges) / sizeof(edges[0]);
+	std::vector<CSVWriter::Column> cols;
+	std::string expected("lat,lon,ele\n");
+	SampleStore s;
+	TrackViews tracks;
+	GPXWriter gpx;
+	TD stamp;
+	unsigned int seed = 777;
+	char line[128];
+	bool bSame = true;
+
+	stamp.setFields(2020, 7, 4, 12, 34, 56);
+	gpx.open(refGPX.c_str());
+	gpx.writeHeader(stamp);
+	gpx.beginTrack("GX010001.MP4");
+
+	for (unsigned int i = 0; i < 200000; i++) {
+		bool bCoarse = i & 1;
+		int32_t rawLat, rawLon, rawEle;
+
+		if (i < 2 * numEdges) {
+			rawLat = edges[i / 2];
+			rawLon = edges[numEdges - 1 - i / 2];
+			rawEle = edges[(i / 2 * 5) % numEdges];
+		}
+		else {
+			seed = seed * 1103515245 + 12345;
+			rawLat = (int32_t)(seed % 1800000001) - 900000000;
+			seed = seed * 1103515245 + 12345;
+			rawLon = (int32_t)(seed % 3600000001U - 1800000000);
+			seed = seed * 1103515245 + 12345;
+			rawEle = (int32_t)(seed % 9000000) - 400000;
+		}
+		if (bCoarse) {
+			// Whatever fits the store once scaled up to its units.
+			rawLat /= 10;
+			rawLon /= 10;
+			rawEle /= 10;
+		}
+
+		double lat = (double)rawLat / (double)(bCoarse ? 1000000 : 10000000);
+		double lon = (double)rawLon / (double)(bCoarse ? 1000000 : 10000000);
+		double ele = (double)rawEle / (double)(bCoarse ? 100 : 1000);
+		int64_t ms = startMs + (int64_t)i * 1000;
+
+		s.push_back(ms, lat, lon, ele);
+		bSame = bSame && s.getLat(i) == lat && s.getLon(i) == lon && s.getEle(i) == ele;
+
+		gpx.writePoint(ms, lat, lon, ele);
+		snprintf(line, sizeof(line), "%.7f,%.7f,%.3f\n", lat, lon, ele);
+		expected += line;
+	}
+	gpx.endTrack();
+	gpx.close();
+
+	tracks["GX010001.MP4"] = SampleSpan(&s, 0, s.size());
+	writeGPXDay(storeGPX, tracks, stamp);
+	CSVWriter::parseColumns("lat,lon,ele", cols);
+	writeCSVDay(storeCSV, tracks, cols);
+
+	std::cout << "Checking fixed point store against the parser's doubles: "
+		<< (bSame && readWholeFile(storeGPX) == readWholeFile(refGPX) && readWholeFile(storeCSV) == expected ? "PASSED." : "FAILED.")
+		<< std::endl;
+
+	remove(storeGPX.c_str());
+	remove(refGPX.c_str());
+	remove(storeCSV.c_str());
+}
+
+//
+// Writes a small two file store in tiny batches to /tmp/unittest_arrowwriter.arrows and
+// checks the stream framing and that a file running past midnight keeps its first day.
+// Loading a real export with pyarrow.ipc.open_stream() is the rest of the test.
+//
+void unittest_ArrowWriter() {
+	struct DayWriter : public ArrowWriter {
+		using ArrowWriter::days;	// Scratch of the last batch
+	};
+	const int64_t startMs = 1593907199000LL;	// 2020-07-04T23:59:59Z - crosses midnight
+	const char* fname = "/tmp/unittest_arrowwriter.arrows";
+	SampleStore all, a, b;
+	DayWriter arrow;
+	std::string bytes;
+	uint32_t eos[2];
+	bool bOK;
+
+	for (unsigned int i = 0; i < 10; i++) {
+		a.push_back(startMs + i * 1000, 39.0 + i * 0.0001, -105.0, 1600.0, i, i * 1001);
+		b.push_back(startMs + i * 500, 40.0, -106.0 + i * 0.0001, 1700.5, i, 2000 + i * 500);
+	}
+	all.append("GX010001.MP4", std::move(a));
+	all.append("GX010002.MP4", std::move(b));
+
+	arrow.setBatchRows(7);
+	bOK = arrow.open(fname);
+	arrow.writeStore(all);
+	bOK = arrow.close() && bOK;
+
+	// The last batch is all the second file, most of it on 2020-07-05.
+	bOK = bOK && arrow.days.size() == 6 && std::count(arrow.days.begin(), arrow.days.end(), 18447) == 6;
+
+	bytes = readWholeFile(fname);
+	if (bytes.size() >= sizeof(eos))
+		memcpy(eos, bytes.data() + bytes.size() - sizeof(eos), sizeof(eos));
+
+	std::cout << "Checking ArrowWriter stream framing and days: " << bytes.size() << " bytes : "
+		<< (bOK && bytes.size() % 8 == 0 && bytes.size() >= sizeof(eos) && bytes.compare(0, 4, "\xff\xff\xff\xff") == 0
+			&& eos[0] == 0xFFFFFFFF && eos[1] == 0 ? "PASSED." : "FAILED.") << std::endl;
+
+	remove(fname);
+}
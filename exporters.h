@@ -1,7 +1,7 @@
 #ifndef _GPXOUT_H
 #define _GPXOUT_H
 //
-// Ingests GPSSample vectors and outputs GPX Track files
+// Ingests GPSSample vectors and outputs GPX Track files (and/or CSV)
 // Has abilities to combine and trim and segregate samples
 //
 // Author: Robert Wolff
@@ -12,22 +12,36 @@
 #include <iomanip>
 #include <vector>
 #include <map>
+#include <set>
+#include <mutex>
 
 // std::min and std::max
 //#include <algorithm>
 
 #include "goprometa.h"
 #include "xmlwriter/xmlwriter.h"
+#include "csvwriter.h"
+#include "arrowwriter.h"
+
+// Read-only views of sample sets keyed by track name. Whoever built it still owns the samples.
+typedef std::map<std::string, SampleSpan> TrackViews;
 
 class SamplesHandler {
 public:
 	SamplesHandler();
-	~SamplesHandler();
-	bool AddSampleSet(const char* keyname, std::vector<GPSSample> samples);
-	void ExportDataGroupDailySegmented(std::map<std::string, std::map<std::string, std::vector<GPSSample>>> &outGroups);
-	void makeUniqueBasenames(std::map<std::string, std::vector<GPSSample>> &inbound);
+	virtual ~SamplesHandler();
+	virtual bool AddSampleSet(const char* keyname, SampleStore &&samples);
+	void ExportDataGroupDailySegmented(std::map<std::string, TrackViews> &outGroups);
+	void makeUniqueBasenames(std::map<std::string, size_t> &inbound);
+	void settleTrackNames() { makeUniqueBasenames(trackGroups); };	// Same names the grouping hands out
+	const SampleStore& getStore() { gatherPending(); return store; };
 protected:
-	std::map<std::string, std::vector<GPSSample>> trackGroups;	// All sample groups mapped by filename individually
+	void gatherPending();
+
+	SampleStore store;								// Every sample of every file, one range per file
+	std::vector<std::pair<std::string, SampleStore>> pending;	// Added but not in 'store' yet, in order
+	std::map<std::string, size_t> trackGroups;	// Range index in 'store' mapped by filename individually
+	std::mutex addLock;		// AddSampleSet() may be called from extraction worker threads
 };
 
 class GPXExporter {
@@ -35,9 +49,67 @@ public:
 	GPXExporter(SamplesHandler* _pHandler);
 	~GPXExporter();
 	bool ExportDailySegmented(const char* destdir="");
+	bool WriteDays(const std::map<std::string, TrackViews> &outGroups, const char* destdir="");
+protected:
+	SamplesHandler* pHandler;
+};
+
+//
+// Same daily grouping as GPXExporter but written as <date>.csv with selectable columns.
+//
+class CSVExporter {
+public:
+	CSVExporter(SamplesHandler* _pHandler);
+	~CSVExporter();
+	void setColumns(const std::vector<CSVWriter::Column> &_columns) { columns = _columns; };
+	bool ExportDailySegmented(const char* destdir="");
+	bool WriteDays(const std::map<std::string, TrackViews> &outGroups, const char* destdir="");
+protected:
+	SamplesHandler* pHandler;
+	std::vector<CSVWriter::Column> columns;
+};
+
+//
+// Every sample the handler holds as one Arrow IPC stream file - see ArrowWriter.
+//
+class ArrowExporter {
+public:
+	ArrowExporter(SamplesHandler* _pHandler);
+	~ArrowExporter();
+	bool Export(const char* fname);
 protected:
 	SamplesHandler* pHandler;
 };
 
+//
+// Streaming alternative to SamplesHandler + GPXExporter.
+// Files must be added in start-time order (see ExtractionPool::orderByStartTime) and each
+// day's GPX (and/or CSV) file is written as soon as no later file can contribute to it. Only the days
+// still open are held in memory rather than every sample of the run.
+//
+class GPXStreamExporter : public SamplesHandler {
+public:
+	GPXStreamExporter(const char* _destdir="");
+	~GPXStreamExporter();
+	void setOutputs(bool _bWriteGPX, bool _bWriteCSV, const std::vector<CSVWriter::Column> &_csvColumns);
+	void setFileOrder(const std::vector<std::string> &files, const std::vector<FileStart> &starts);
+	bool AddSampleSet(const char* keyname, SampleStore &&samples) override;
+	void finish();
+protected:
+	void flushDaysBefore(const std::string &dateLimit);
+	void flushDay(const std::string &date);
+
+	std::string prefix;
+	bool bWriteGPX;
+	bool bWriteCSV;
+	std::vector<CSVWriter::Column> csvColumns;
+	std::map<std::string, std::string> uniqueNames;		// full path -> unique basename
+	std::map<std::string, std::string> startDates;		// full path -> date of the first sample kept
+	std::map<std::string, std::map<std::string, SampleStore>> openDays;
+	std::map<std::string, size_t> writtenDays;			// date -> sets of samples, for the summary
+	std::set<std::string> flushedDays;
+	std::set<std::string> takenNames;
+};
+
 #endif
 
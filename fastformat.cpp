@@ -0,0 +1,230 @@
+//
+// Number and time formatting straight into a char buffer for the exporters.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+#include "fastformat.h"
+#include "utctime.h"
+
+// Powers of ten 10^-4 .. 10^15. The non-negative ones are exact doubles.
+static const double POW10[] = { 1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+								1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+static const int POW10_OFFSET = 4;
+
+static const char DIGIT_PAIRS[] =
+	"00010203040506070809" "10111213141516171819" "20212223242526272829" "30313233343536373839" "40414243444546474849"
+	"50515253545556575859" "60616263646566676869" "70717273747576777879" "80818283848586878889" "90919293949596979899";
+
+static char* fallback(char* out, double v, int precision) {
+	char buf[FORMAT_MAX_NUMBER + 16];
+	int len = snprintf(buf, sizeof(buf), "%.*g", precision, v);
+
+	memcpy(out, buf, len);
+	return out + len;
+}
+
+static inline char* twoDigits(char* out, int v) {
+	memcpy(out, &DIGIT_PAIRS[2 * v], 2);
+	return out + 2;
+}
+
+//
+// %g with precision P uses fixed notation when the decimal exponent X (after rounding to
+// P digits) satisfies -4 <= X < P, with P-1-X digits after the point and trailing zeros
+// removed. That's the range handled here.
+//
+char* formatSignificant(char* out, double v, int precision) {
+	char digits[16];
+	double mag, scaled, frac;
+	uint64_t r, limit;
+	int exp10, decimals, len;
+	char* p = out;
+
+	if (precision <= 0)
+		precision = 1;	// What printf does with %.0g
+
+	if (precision > 9 || !(v == v) || v == 0.0)
+		return fallback(out, v, precision);
+
+	mag = fabs(v);
+	if (mag < 1e-4 || mag >= POW10[precision + POW10_OFFSET])
+		return fallback(out, v, precision);
+
+	// Decimal exponent from the table. Stay away from the boundaries where the inexact
+	// negative powers (or the rounding below) could put us one off.
+	exp10 = -4;
+	while (exp10 + 1 < precision && mag >= POW10[exp10 + 1 + POW10_OFFSET])
+		exp10++;
+	if (mag < POW10[exp10 + POW10_OFFSET] * (1 + 1e-12) || mag > POW10[exp10 + 1 + POW10_OFFSET] * (1 - 1e-9))
+		return fallback(out, v, precision);
+
+	// exp10 < precision, so this is 0 .. precision+3 - all within the exact part of the table.
+	decimals = precision - 1 - exp10;
+
+	// One rounding in the multiply; only trust it when nowhere near a tie.
+	scaled = mag * POW10[decimals + POW10_OFFSET];
+
+	r = (uint64_t)scaled;
+	frac = scaled - (double)r;
+	if (fabs(frac - 0.5) < 1e-6)
+		return fallback(out, v, precision);
+	if (frac > 0.5)
+		r++;
+
+	// Rounded up into the next power of ten (9.9999996 -> 10.0000) - let printf sort it out.
+	limit = (uint64_t)POW10[precision + POW10_OFFSET];
+	if (r >= limit)
+		return fallback(out, v, precision);
+
+	// Digits of r, exactly 'precision' of them.
+	len = precision;
+	for (int i = len - 1; i >= 0; i--) {
+		digits[i] = '0' + (r % 10);
+		r /= 10;
+	}
+
+	if (v < 0)
+		*p++ = '-';
+
+	if (exp10 >= 0) {
+		int intDigits = exp10 + 1;
+
+		memcpy(p, digits, intDigits);
+		p += intDigits;
+
+		// Trim trailing zeros of the fraction - and the point itself if nothing is left.
+		int fracLen = len - intDigits;
+		while (fracLen > 0 && digits[intDigits + fracLen - 1] == '0')
+			fracLen--;
+
+		if (fracLen > 0) {
+			*p++ = '.';
+			memcpy(p, digits + intDigits, fracLen);
+			p += fracLen;
+		}
+	}
+	else {
+		int fracLen = len;
+
+		while (fracLen > 0 && digits[fracLen - 1] == '0')
+			fracLen--;
+
+		*p++ = '0';
+		*p++ = '.';
+		for (int i = exp10 + 1; i < 0; i++)
+			*p++ = '0';
+		memcpy(p, digits, fracLen);
+		p += fracLen;
+	}
+
+	return p;
+}
+
+//
+// Fixed point for the CSV exporter. The value is scaled and rounded half away from zero
+// in one step, which can differ from printf in the last digit for values that aren't
+// exactly representable - GPS5 data is scaled integers, so at its own precision (7
+// decimals for lat/lon, 3 for ele) every value comes out exact. A result of zero never
+// carries a '-'.
+//
+char* formatFixed(char* out, double v, int decimals) {
+	double mag, scaled;
+	uint64_t r, scale, whole, frac;
+
+	if (decimals < 0)
+		decimals = 0;
+
+	mag = fabs(v);
+	if (decimals > 9 || !(v == v) || mag >= 1e15 / POW10[decimals + POW10_OFFSET]) {
+		char buf[FORMAT_MAX_FIXED + 16];
+		int len = snprintf(buf, sizeof(buf), "%.*f", decimals, v);
+
+		memcpy(out, buf, len);
+		return out + len;
+	}
+
+	scale = (uint64_t)POW10[decimals + POW10_OFFSET];
+	scaled = mag * POW10[decimals + POW10_OFFSET];
+	r = (uint64_t)(scaled + 0.5);
+	whole = r / scale;
+	frac = r % scale;
+
+	if (v < 0 && r != 0)
+		*out++ = '-';
+
+	out = formatInteger(out, (int64_t)whole);
+
+	if (decimals) {
+		*out++ = '.';
+		for (int i = decimals - 1; i >= 0; i--) {
+			out[i] = '0' + (frac % 10);
+			frac /= 10;
+		}
+		out += decimals;
+	}
+
+	return out;
+}
+
+char* formatDateTime(char* out, int64_t ms) {
+	utc::Civil c = utc::fromMillis(ms);
+
+	// Four digit years are all GPS time will ever give us.
+	if (c.year < 1000 || c.year > 9999) {
+		int len = snprintf(out, FORMAT_DATETIME_LEN + 16, "%d-%02d-%02dT%02d:%02d:%02dZ", c.year, c.month, c.day, c.hour, c.minute, c.second);
+		return out + len;
+	}
+
+	out = twoDigits(out, c.year / 100);
+	out = twoDigits(out, c.year % 100);
+	*out++ = '-';
+	out = twoDigits(out, c.month);
+	*out++ = '-';
+	out = twoDigits(out, c.day);
+	*out++ = 'T';
+	out = twoDigits(out, c.hour);
+	*out++ = ':';
+	out = twoDigits(out, c.minute);
+	*out++ = ':';
+	out = twoDigits(out, c.second);
+	*out++ = 'Z';
+
+	return out;
+}
+
+char* formatInteger(char* out, int64_t v) {
+	char tmp[24];
+	int len = 0;
+	uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+
+	if (v < 0)
+		*out++ = '-';
+
+	do {
+		tmp[len++] = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+
+	while (len)
+		*out++ = tmp[--len];
+
+	return out;
+}
+
+char* formatDateTimeMs(char* out, int64_t ms) {
+	int millis = (int)(ms - utc::floorDiv(ms, 1000) * 1000);
+
+	out = formatDateTime(out, ms) - 1;	// Back over the 'Z'
+	*out++ = '.';
+	*out++ = '0' + millis / 100;
+	out = twoDigits(out, millis % 100);
+	*out++ = 'Z';
+
+	return out;
+}
@@ -0,0 +1,43 @@
+#ifndef _FASTFORMAT_H
+#define _FASTFORMAT_H
+//
+// Number and time formatting straight into a char buffer for the exporters.
+//
+// formatSignificant() produces exactly what an iostream (or printf's %.*g) prints for a
+// double at the given precision, but without locale/stream machinery. The common case -
+// a value that rounds cleanly to 'precision' significant digits - is handled with one
+// multiply and integer digit generation. Anything that could round differently (too
+// close to a half-way point or a power of ten, very large/small values, precision > 9)
+// falls back to snprintf, so the text is always identical.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <stdint.h>
+
+// Longest thing formatSignificant() can produce, with some room to spare.
+const int FORMAT_MAX_NUMBER = 32;
+// Longest thing formatFixed() can produce - DBL_MAX has 309 digits ahead of the point.
+const int FORMAT_MAX_FIXED = 330;
+// YYYY-MM-DDTHH:MM:SSZ
+const int FORMAT_DATETIME_LEN = 20;
+// YYYY-MM-DDTHH:MM:SS.sssZ
+const int FORMAT_DATETIME_MS_LEN = 24;
+
+// Writes 'v' as %.<precision>g would and returns the end of the text (not terminated).
+char* formatSignificant(char* out, double v, int precision);
+
+// Writes 'v' as %.<decimals>f would (rounding aside - see fastformat.cpp) and returns the end of the text.
+char* formatFixed(char* out, double v, int decimals);
+
+// Writes ms since the epoch as YYYY-MM-DDTHH:MM:SSZ and returns the end of the text.
+char* formatDateTime(char* out, int64_t ms);
+
+// Same with the milliseconds kept - YYYY-MM-DDTHH:MM:SS.sssZ
+char* formatDateTimeMs(char* out, int64_t ms);
+
+// Plain base 10 integer. Returns the end of the text.
+char* formatInteger(char* out, int64_t v);
+
+#endif
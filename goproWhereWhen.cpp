@@ -20,6 +20,9 @@
 #include <iomanip>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <map>
+#include <chrono>
 
 // basename()
 #include <libgen.h>
@@ -27,6 +30,11 @@
 #include "opts.h"
 #include "goprometa.h"
 #include "exporters.h"
+#include "workerpool.h"
+#include "stats.h"
+#include "progress.h"
+#include "spatialindex.h"
+#include "timeindex.h"
 
 using namespace std;
 
@@ -34,9 +42,141 @@ opts options;
 SamplesHandler sHandler;
 
 // Utils
-extern	void getAllFilesFromPath(const char* inPath, bool bRecurse, vector<string>& files);
+extern	bool getAllFilesFromPath(const char* inPath, bool bRecurse, const vector<string> &exts,
+						vector<string> &files, vector<string> &errors, unsigned int threads);
 extern	bool validateFileExts(const char* endingList, vector<string> &destList);
 extern	void pruneFilesList(vector<string> &filesInOut, vector<string> toKeep);
+extern	void unittest_ExtValidation();
+extern	void unittest_PruneFiles();
+
+// Exporters
+extern	void unittest_SampleCopies();
+extern	void unittest_GPXWriter();
+extern	void unittest_CSVWriter();
+extern	void unittest_FixedPointStore();
+extern	void unittest_ArrowWriter();
+
+// GoProMeta
+extern	void unittest_TimeDecode();
+extern	void unittest_PayloadScratch();
+extern	void unittest_TargetedWalk();
+extern	void unittest_GPSOffsetCache();
+extern	void unittest_PayloadSkip();
+extern	void unittest_SynthMP4();
+extern	void unittest_Stats();
+
+// Progress
+extern	void unittest_Progress();
+
+// Extraction pool
+extern	void unittest_StreamNames();
+
+// Queries
+extern	void unittest_SpatialIndex();
+extern	void unittest_TimeIndex();
+
+//
+// --dryrun report: one line per file, then how the files would spread over the output days.
+//
+static void printDryRun(const vector<string> &files, const vector<FileScan> &scans) {
+	map<string, unsigned int> days;
+	uint64_t totalPayloads = 0;
+	double totalDuration = 0.0;
+	size_t unreadable = 0, noFix = 0;
+
+	cout << fixed;
+	for (size_t i = 0; i < files.size(); i++) {
+		const FileScan &s = scans[i];
+		string name(files[i]);
+
+		cout << basename((char*)name.c_str()) << ": ";
+		if (!s.bOpened) {
+			cout << "not a GoPro MP4 with GPMF data" << endl;
+			unreadable++;
+			continue;
+		}
+
+		totalPayloads += s.numPayloads;
+		totalDuration += s.duration;
+		cout << s.numPayloads << " payloads, " << setprecision(1) << s.duration << "s";
+
+		if (!s.bHasFix) {
+			cout << ", no GPS fix" << endl;
+			noFix++;
+			continue;
+		}
+
+		// The exporters file a whole clip under the day of its first sample, midnight or not.
+		string startDay = s.start.getDateOnly();
+
+		cout << ", " << s.start << " to " << s.end << setprecision(7)
+			<< ", (" << s.startLat << "," << s.startLon << ") to (" << s.endLat << "," << s.endLon << ")"
+			<< ", day " << startDay << endl;
+		days[startDay]++;
+	}
+
+	cout << endl << "Dry run: " << files.size() << " files, " << totalPayloads << " payloads, "
+		<< setprecision(1) << totalDuration / 3600.0 << " hours. " << noFix << " without a GPS fix, "
+		<< unreadable << " unreadable." << endl;
+	for (auto &d: days)
+		cout << "  " << d.first << ": " << d.second << " file" << (d.second == 1 ? "" : "s") << endl;
+}
+
+//
+// --near report: every file with samples inside the circle, in the order they were there.
+//
+static void printNear(const SampleStore &store) {
+	SpatialIndex index;
+	vector<SpatialIndex::FileMatch> matches;
+
+	auto t0 = std::chrono::steady_clock::now();
+	index.build(store);
+	auto t1 = std::chrono::steady_clock::now();
+	index.near(options.nearLat, options.nearLon, options.nearRadius, matches);
+	auto t2 = std::chrono::steady_clock::now();
+
+	std::cerr << "Indexed " << index.size() << " samples in " << std::chrono::duration<double>(t1 - t0).count()
+		<< "s, query took " << std::chrono::duration<double, std::milli>(t2 - t1).count() << "ms" << std::endl;
+
+	cout << matches.size() << " file" << (matches.size() == 1 ? "" : "s") << " within " << options.nearRadius << "m of "
+		<< fixed << setprecision(7) << options.nearLat << "," << options.nearLon << ":" << endl;
+	for (auto &m: matches)
+		cout << store.getRanges()[m.range].name << ": " << m.samples << " samples, " << UTCMillis(m.firstMs)
+			<< " to " << UTCMillis(m.lastMs) << setprecision(1) << ", " << m.firstMediaMs / 1000.0 << "s to "
+			<< m.lastMediaMs / 1000.0 << "s into the clip" << endl;
+}
+
+//
+// --at / --between report: every file whose GPS track covers the time(s), how far into
+// the video that is and where it was.
+//
+static void printAt(const SampleStore &store) {
+	TimeIndex index;
+	vector<TimeIndex::Match> matches;
+	bool bBetween = options.queryToMs != options.queryFromMs;
+
+	auto t0 = std::chrono::steady_clock::now();
+	index.build(store);
+	auto t1 = std::chrono::steady_clock::now();
+	index.between(options.queryFromMs, options.queryToMs, matches);
+	auto t2 = std::chrono::steady_clock::now();
+
+	std::cerr << "Indexed " << index.size() << " files in " << std::chrono::duration<double>(t1 - t0).count()
+		<< "s, query took " << std::chrono::duration<double, std::milli>(t2 - t1).count() << "ms" << std::endl;
+
+	cout << matches.size() << " file" << (matches.size() == 1 ? "" : "s") << (bBetween ? " between " : " at ")
+		<< UTCMillis(options.queryFromMs);
+	if (bBetween)
+		cout << " and " << UTCMillis(options.queryToMs);
+	cout << ":" << endl;
+
+	for (auto &m: matches) {
+		cout << store.getRanges()[m.range].name << ": " << fixed << setprecision(1) << m.fromOffset << "s";
+		if (bBetween)
+			cout << " to " << m.toOffset << "s (" << UTCMillis(m.fromMs) << " to " << UTCMillis(m.toMs) << ")";
+		cout << " into the clip, " << setprecision(7) << m.lat << "," << m.lon << setprecision(1) << " ele " << m.ele << endl;
+	}
+}
 
 int main(int argc, const char** argv)
 {
@@ -44,10 +184,26 @@ int main(int argc, const char** argv)
   options.processOpts(argc, argv);
   vector<std::string> skippedFiles;
 
-//#define UNITTEST
+// cmake -DUNITTEST=ON - the test code is spread over several files, so the define is project wide.
 #ifdef UNITTEST
   unittest_ExtValidation();
   unittest_PruneFiles();
+  unittest_SampleCopies();
+  unittest_GPXWriter();
+  unittest_CSVWriter();
+  unittest_FixedPointStore();
+  unittest_ArrowWriter();
+  unittest_TimeDecode();
+  unittest_PayloadScratch();
+  unittest_TargetedWalk();
+  unittest_GPSOffsetCache();
+  unittest_PayloadSkip();
+  unittest_SynthMP4();
+  unittest_Stats();
+  unittest_Progress();
+  unittest_StreamNames();
+  unittest_SpatialIndex();
+  unittest_TimeIndex();
   exit(1);
 #endif
 
@@ -69,10 +225,18 @@ int main(int argc, const char** argv)
   }
 
   if (options.sourceDir != "") {
-  	getAllFilesFromPath(options.sourceDir.c_str(), options.sourceDirRecursive, files);
+  	vector<string> dirErrors;
 
-  	// Now let's apply the fileext results to this list to prune it down to our work items.
-  	pruneFilesList(files, options.fileExtList);
+  	// The walk applies the fileext list as it goes, so 'files' is already our work items (sorted).
+  	if (!getAllFilesFromPath(options.sourceDir.c_str(), options.sourceDirRecursive, options.fileExtList,
+  			files, dirErrors, options.walkJobs)) {
+  		for (auto &d: dirErrors)
+  			std::cerr << "ERROR: Directory could not be opened: " << d << std::endl;
+
+  		// Unreadable subdirectories are skipped, but there's nothing to do without the top one.
+  		if (std::find(dirErrors.begin(), dirErrors.end(), options.sourceDir) != dirErrors.end())
+  			exit(-1);
+  	}
 
 //  	std::cerr << "Final Files List:" << std::endl;
 //  	for (auto f: files)
@@ -84,48 +248,61 @@ int main(int argc, const char** argv)
   	files.push_back(options.inFile);
   }
 
-  vector<GPSSample> samples;
   // At this stage, we have a list of input files that need processed.
   // It's time to decide how to rip through that list and what to do with the results.
-  std::cerr << "Processing: ";
-  for (auto f: files) {
-  	GoProMeta *pGPM = new GoProMeta();
-  	samples.clear();
+  // The pool hands each file's samples to sHandler in list order regardless of --jobs.
+  // In --stream mode samples go to streamOut which writes each day out as soon as it's complete.
+  vector<CSVWriter::Column> csvColumns = CSVWriter::defaultColumns();
+  if (options.csvColumns != "" && !CSVWriter::parseColumns(options.csvColumns.c_str(), csvColumns)) {
+  	cout << "ERROR: Option '--csvcolumns' expects a comma separated list taken from" << endl;
+  	cout << "  time,lat,lon,ele,file,payload,media, each at most once - for example: --csvcolumns=time,lat,lon,file" << endl;
+  	exit(-8);
+  }
 
-  	std::cerr << basename((char*)f.c_str()) << ", ";
+  GPXStreamExporter streamOut;
+  streamOut.setOutputs(options.exportGPX, options.exportCSV, csvColumns);
+  ExtractionPool pool(options.streaming ? (SamplesHandler*)&streamOut : &sHandler, options.jobs);
+  pool.setSecondsBetweenSamples(options.timeBetweenSamples);
+  pool.setUseMemoryMap(options.useMemoryMap);
+  pool.setReadGap(options.readGap);
+  pool.setLockThresholds(options.minLockState, options.maxPrecision);
 
-  	pGPM->setSecondsBetweenSamples(options.timeBetweenSamples);
+  RunStats runStats;
+  if (options.stats)
+  	pool.setStats(&runStats);
 
-  	if (!pGPM->openFile(f.c_str())) {
-//  		std::cerr << "ERROR: Could not open file: " << f << std::endl;
-  		skippedFiles.push_back(f);
-  		delete pGPM;
-  		continue;
-//  		exit(-6);
-  	}
+  SampleCache cache;
+  if (options.cacheDir != "") {
+  	if (cache.setCacheDir(options.cacheDir.c_str()))
+  		pool.setCache(&cache);
+  	else
+  		std::cerr << "WARNING: Continuing without the sample cache." << std::endl;
+  }
 
-  	if (!pGPM->processFile()) {
-  		std::cerr << "ERROR: Could not process file properly: " << f << std::endl;
-  		delete pGPM;
-  		continue;
-//  		exit(-7);
-  	}
+  if (options.dryRun) {
+  	vector<FileScan> scans;
+
+  	pool.scanFiles(files, scans);
+  	printDryRun(files, scans);
+  	return 0;
+  }
 
-  	pGPM->getOutputPoints(samples);
-//  	std::cerr << "For file " << f << " Number of samples is: " << samples.size() << std::endl;
-//  	if (samples.size())
-//  		std::cerr << " First entry: " << samples[0] << std::endl;
+  if (options.streaming) {
+  	vector<FileStart> starts;
 
-	// Insert samples into SamplesHandler for safe keeping
-	if (!sHandler.AddSampleSet(f.c_str(), samples)) {
-		std::cerr << "Could not add samples for: " << f << std::endl;
-		// continuing...
-	}
+  	std::cerr << "Ordering by start time..." << std::endl;
+  	pool.orderByStartTime(files, starts);
+  	streamOut.setFileOrder(files, starts);
 
-  	delete pGPM;
+  	// Keep finished-but-uncommitted files from piling up behind a slow one.
+  	pool.setMaxInFlight(2 * pool.getJobs());
   }
 
-  std::cerr << std::endl;
+  ProgressReporter progress;
+  pool.setProgress(&progress);
+  progress.start(files.size());
+  pool.processFiles(files, skippedFiles);
+  progress.finish();
 
   // Now that we have all the files processed, what shall we do with them?
   //TODO: A --summary might iterate through skippedFiles to list what wasn't done.
@@ -133,11 +310,54 @@ int main(int argc, const char** argv)
   	<< " were processed and " << skippedFiles.size() << " were skipped." << std::endl;
 
   // Let's try 'exporting' in groups.
-//	std::map<std::string, std::map<std::string, std::vector<GPSSample>>> groupedDates;
+//	std::map<std::string, TrackViews> groupedDates;
 //	sHandler.ExportDataGroupDailySegmented(groupedDates);
 
-	GPXExporter gpxOut(&sHandler);
-	gpxOut.ExportDailySegmented();
+	// Whatever is left to do is for the run as a whole rather than any one file.
+	FileStats* pRunStats = options.stats ? &runStats.total : NULL;
+	uint64_t allocationsBefore = heapAllocations();
+
+	if (options.streaming) {
+		StageTimer timer(pRunStats, FileStats::STAGE_EXPORT);
+		streamOut.finish();
+	}
+	else if (options.nearQuery) {
+		printNear(sHandler.getStore());
+	}
+	else if (options.timeQuery) {
+		printAt(sHandler.getStore());
+	}
+	else {
+		std::map<std::string, TrackViews> groupedDates;
+		GPXExporter gpxOut(&sHandler);
+		CSVExporter csvOut(&sHandler);
+
+		// Group once - both formats write the same days.
+		{
+			StageTimer timer(pRunStats, FileStats::STAGE_GROUP);
+			sHandler.ExportDataGroupDailySegmented(groupedDates);
+		}
+
+		StageTimer timer(pRunStats, FileStats::STAGE_EXPORT);
+		if (options.exportGPX)
+			gpxOut.WriteDays(groupedDates);
+
+		if (options.exportCSV) {
+			csvOut.setColumns(csvColumns);
+			csvOut.WriteDays(groupedDates);
+		}
+
+		if (options.exportArrow) {
+			ArrowExporter arrowOut(&sHandler);
+			arrowOut.Export(options.arrowFile.c_str());
+		}
+	}
+
+	if (options.stats) {
+		runStats.total.allocations += heapAllocations() - allocationsBefore;
+		runStats.stop();
+		runStats.write(std::cerr, options.statsJSON);
+	}
 
   return 0;
 }
@@ -7,32 +7,58 @@
 //
 
 #include "goprometa.h"
+#ifdef UNITTEST
+#include "mp4synth.h"
+#endif
 
 // basename()
 #include <libgen.h>
 
 // Support for osstringstream
 #include <sstream>
+#include <chrono>
+#include <algorithm>
+
+#include <math.h>
 
 const unsigned int DEFAULT_TIMING = 5;
+const unsigned int DEFAULT_MIN_LOCK = 1;
+const double SKIP_MARGIN_SECONDS = 2.0;	// Allowed GPSU drift against the track's payload timing
+const unsigned int DEFAULT_MAX_PRECISION = 1000;
+const unsigned int GPS5_MAX_ELEMENTS = 16;	// GPS5 is lat, lon, ele, 2D speed, 3D speed
 
 GoProMeta::GoProMeta() {
 	payload = NULL;
 	mp4 = 0;
+	bUseMemoryMap = false;
+	bTargetedWalk = true;
+	gpsStreamOffset = 0;
+	gpsOffsetHits = 0;
+	gpsOffsetMisses = 0;
+	bSkipPayloads = true;
+	payloadsSkipped = 0;
+	readGap = -1;
 	ms = &metadata_stream;
 	secondsBetweenSamples = DEFAULT_TIMING;
+	minLockState = DEFAULT_MIN_LOCK;
+	maxPrecision = DEFAULT_MAX_PRECISION;
 	metadatalength = 0.0;
 	numPayloads = 0;
+	payloadsRead = 0;
+	payloadIndex = 0;
+	gpsuPayloadIndex = 0;
+	payloadIn = payloadOut = 0.0;
 	GPSSamples.clear();
 	nextSampleTime = 0;
+	scratchAllocations = 0;
+	memset(&payloadBuffers, 0, sizeof(payloadBuffers));
+	pStats = NULL;
 }
 
 GoProMeta::~GoProMeta() {
-	if (payload)
-		FreePayload(payload);
-
 	if (mp4)
 		CloseSource(mp4);
+	FreePayloadBuffers(&payloadBuffers);
 }
 
 //
@@ -42,26 +68,64 @@ void GoProMeta::setSecondsBetweenSamples(unsigned int newtiming) {
 	secondsBetweenSamples = newtiming;
 }
 
+//
+// minLockState of 1 matches the original 'any lock at all' behavior.
+//
+void GoProMeta::setLockThresholds(unsigned int _minLockState, unsigned int _maxPrecision) {
+	minLockState = _minLockState;
+	maxPrecision = _maxPrecision;
+}
+
+//
+// May be called again for the next file - the previous one is closed and the per-file
+// state reset, while the payload and scaling buffers carry over.
+//
 bool GoProMeta::openFile(const char* filename) {
 
+	closeFile();
+
 	lockState = 0;	// No_Lock
 	samplesProcessed = 0;
 	samplesSkippedForNoLock = 0;
 	samplesSkippedForPoorPrecision = 0;
 	GPSPrecision = 9999;
+	metadatalength = 0.0;
+	numPayloads = 0;
+	payloadsRead = 0;
+	payloadIndex = 0;
+	gpsuPayloadIndex = 0;
+	payloadIn = payloadOut = 0.0;
+	currentTime = TD();
+	nextSampleTime = 0;
+	gpsStreamOffset = 0;	// Every recording has its own layout
+	GPSSamples.clear();
+	errors.clear();
 
 	if (!filename)
 		return false;
 
 	fName = filename;
 
-	mp4 = OpenMP4Source((char*)filename, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE);
+	// With a memory mapped source every payload below is a zero-copy view into the mapping.
+	// If the mapping can't be made the source quietly stays on FILE* reads.
+	{
+		StageTimer timer(pStats, FileStats::STAGE_OPEN);
+		mp4 = OpenMP4SourceEx((char*)filename, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE,
+			bUseMemoryMap ? MP4_SOURCE_FLAG_MMAP : 0);
+	}
 	if (mp4 == 0)
 	{
 //		std::cerr << "error: " << filename << " is an invalid MP4/MOV or it has no GPMF data" << std::endl;
 		return false;
 	}
 
+	// Reads land in our buffers so they outlive this source and serve the next file too.
+	AttachPayloadBuffers(mp4, &payloadBuffers);
+
+	// Payloads closer together than readGap are pulled in by a single batched read.
+	if (readGap >= 0)
+		SetPayloadReadGap(mp4, (uint64_t)readGap, 0);
+
 	metadatalength = GetDuration(mp4);
 	if (metadatalength > 0.0)
 	{
@@ -73,120 +137,445 @@ bool GoProMeta::openFile(const char* filename) {
 	return true;
 }
 
+//
+// Acts on the KLV 'ms' is sitting on if it's one of the GPS keys.
+//
+bool GoProMeta::processKey() {
+	if (pStats)
+		pStats->klvs++;
+
+	switch(GPMF_Key(ms))
+	{
+	case STR2FOURCC("GPS5"):
+	  // GPS data samples
+	  if (!processGPS5()) {
+	  	errors += "ERROR: Failed to process GPS5 data.\n";
+	  	return false;
+	  }
+	  break;
+
+	case STR2FOURCC("GPSU"):
+	  // GPS UTC time
+	  if (!processGPSU()) {
+	  	errors += "ERROR: Failed to process GPSU data.\n";
+	  	return false;
+	  }
+	  break;
+
+	case STR2FOURCC("GPSP"):
+	  // GPS Precision
+	  if (!processGPSP()) {
+	  	errors += "ERROR: Failed to process GPSP data.\n";
+	  	return false;
+	  }
+	  break;
+
+	case STR2FOURCC("GPSF"):
+	  // GPS Fix on location
+	  if (!processGPSF()) {
+	  	errors += "ERROR: Failed to process GPSF data.\n";
+	  	return false;
+	  }
+	  break;
+
+	default: // if you don’t know the Key you can skip to the next
+	  break;
+	}
+
+	return true;
+}
+
+//
+// Payload walk that leaves each DEVC as soon as its GPS stream is done. A camera writes one GPS
+// STRM per payload, and on HERO7 and later it's followed by SHUT, WBAL, WRGB, ISOE, UNIF, FACE,
+// CORI, IORI, GRAV etc. - none of which are ever looked at now. The DEVC is walked on a copy
+// of the top level state which 'ms' points at meanwhile, so processGPS5() and GPMF_ScaledData()
+// see exactly what the full recursive walk would show them.
+//
+bool GoProMeta::walkGPSStreams() {
+	GPMF_stream devc, *top = ms;
+	bool bOK = true;
+
+	do {
+		bool bGPSDone = false;
+
+		if (GPMF_Key(top) != GPMF_KEY_DEVICE)
+			continue;
+
+		GPMF_CopyState(top, &devc);
+		if (GPMF_Next(&devc, GPMF_RECURSE_LEVELS) != GPMF_OK)	// Into the DEVC
+			continue;
+
+		ms = &devc;
+		do {
+			uint32_t strmPos = ms->pos;
+
+			if (GPMF_Key(ms) != GPMF_KEY_STREAM)		// DVID, DVNM, TICK...
+				continue;
+			if (GPMF_Next(ms, GPMF_RECURSE_LEVELS) != GPMF_OK)	// Into the STRM
+				break;
+
+			do {
+				bOK = processKey();
+				bGPSDone = bGPSDone || GPMF_Key(ms) == STR2FOURCC("GPS5");
+			} while (bOK && GPMF_Next(ms, GPMF_CURRENT_LEVEL) == GPMF_OK);
+
+			// Only a lone DEVC is learned - jumping straight to it skips any others.
+			if (bGPSDone)
+				gpsStreamOffset = (top->pos == 0 && 2 + (GPMF_DATA_SIZE(top->buffer[1]) >> 2) == top->buffer_size_longs) ? strmPos : 0;
+		// DEVC children sit at level 0 like the DEVCs themselves, so stop at the next one.
+		} while (bOK && !bGPSDone && GPMF_Next(ms, GPMF_RECURSE_LEVELS) == GPMF_OK && GPMF_Key(ms) != GPMF_KEY_DEVICE);
+		ms = top;
+	} while (bOK && GPMF_Next(top, GPMF_CURRENT_LEVEL) == GPMF_OK);
+
+	return bOK;
+}
+
+//
+// Walks the STRM at the offset the GPS stream had in the previous payload. Cameras lay the
+// DEVC out the same way payload after payload, so normally it's there again and nothing
+// before it needs looking at. The KLV headers are checked against the DEVC first, and the
+// stream state is put together the way GPMF_Next() would have left it on arriving there.
+// 'bFound' is false when that STRM turns out not to hold GPS5 - nothing was recorded then
+// as only the GPS keys are ever acted on.
+//
+bool GoProMeta::walkLearnedGPSStream(bool &bFound) {
+	GPMF_stream strm, *top = ms;
+	uint32_t* buffer = ms->buffer;
+	uint32_t devcEnd = 2 + (GPMF_DATA_SIZE(buffer[1]) >> 2);
+	uint32_t pos = gpsStreamOffset;
+	bool bOK = true;
+
+	bFound = false;
+	if (buffer[0] != GPMF_KEY_DEVICE || devcEnd > ms->buffer_size_longs || pos + 2 > devcEnd
+		|| buffer[pos] != GPMF_KEY_STREAM || GPMF_SAMPLE_TYPE(buffer[pos + 1]) != GPMF_TYPE_NEST
+		|| pos + 2 + (GPMF_DATA_SIZE(buffer[pos + 1]) >> 2) > devcEnd)
+		return true;
+
+	// A DEVC's children sit at level 0 with the DEVC's remaining size as the nest size.
+	GPMF_CopyState(top, &strm);
+	strm.pos = pos;
+	strm.nest_level = 0;
+	strm.nest_size[0] = devcEnd - pos;
+	strm.last_level_pos[0] = 0;
+
+	ms = &strm;
+	if (GPMF_Next(ms, GPMF_RECURSE_LEVELS) == GPMF_OK) {	// Into the STRM
+		do {
+			bOK = processKey();
+			bFound = bFound || GPMF_Key(ms) == STR2FOURCC("GPS5");
+		} while (bOK && GPMF_Next(ms, GPMF_CURRENT_LEVEL) == GPMF_OK);
+	}
+	ms = top;
+
+	return bOK;
+}
+
+//
+// Lets go of the source (file handle, mapping) but keeps the scratch buffers for the next file.
+//
+void GoProMeta::closeFile() {
+	if (mp4) {
+		if (pStats) {
+			uint32_t readCalls = 0;
+
+			pStats->bytesRead += GetBytesRead(mp4, &readCalls);
+			pStats->readCalls += readCalls;
+			pStats->fileBytes += GetSourceFileSize(mp4);
+			pStats->allocations += GetAllocations(mp4);
+		}
+
+		CloseSource(mp4);
+		mp4 = 0;
+	}
+}
+
 bool GoProMeta::processFile() {
 
-  if (mp4==0 || metadatalength==0.0 || numPayloads==0) {
-  	std::cerr << "ERROR: missing critical source objects in processFile: " 
-  		<< mp4 << " " << metadatalength << " " << numPayloads << std::endl;
+  if (!isProcessable()) {
+  	std::ostringstream os;
+
+  	os << "ERROR: missing critical source objects in processFile: " << mp4 << " " << metadatalength << " " << numPayloads << "\n";
+  	errors += os.str();
   	return false;
   }
 
+  double in, out, duration = 0.0;
+  int64_t scaleBefore = pStats ? pStats->ns[FileStats::STAGE_SCALE] : 0;
+
+  // Payloads all cover the same stretch of the track (see GetPayloadTime()).
+  if (GetPayloadTime(mp4, 0, &in, &out) == GPMF_OK && numPayloads > 1)
+	duration = out - in;
+
   for (uint32_t index = 0; index < numPayloads ; index++) {
-	uint32_t payloadsize = GetPayloadSize(mp4, index);
-	int32_t ret;
+	uint32_t payloadsize;
+
+	// Once a GPSU has pinned the track's timing to UTC, payloads that end well before the
+	// next wanted sample are never read at all.
+	if (bSkipPayloads && duration > 0.0) {
+		uint32_t wanted = nextWantedPayload(duration);
+
+		if (wanted > index) {
+			payloadsSkipped += std::min(wanted, numPayloads) - index;
+			index = wanted;
+			if (index >= numPayloads)
+				break;
+		}
+	}
 
-	payload = GetPayload(mp4, payload, index);
+	payloadsize = GetPayloadSize(mp4, index);
+
+	setPayloadTime(index);
+	{
+		StageTimer timer(pStats, FileStats::STAGE_READ);
+		payload = GetPayloadView(mp4, index);
+	}
 	if (payload == NULL) {
-		std::cerr << "ERROR: Could not find payload on index:" << index << std::endl;
+		errors += "ERROR: Could not find payload on index:" + std::to_string(index) + "\n";
 		return false;
 	}
 
-	ret = GPMF_Init(ms, payload, payloadsize);
+	payloadsRead++;
+
+	StageTimer timer(pStats, FileStats::STAGE_WALK);
+	if (!processPayload(payload, payloadsize))
+		return false;
+  }
+
+  // The walk's timer ran through every GPMF_ScaledData() as well.
+  if (pStats) {
+	pStats->ns[FileStats::STAGE_WALK] -= pStats->ns[FileStats::STAGE_SCALE] - scaleBefore;
+	pStats->payloads += payloadsRead;
+	pStats->payloadsSkipped += numPayloads - payloadsRead;
+	pStats->samples += GPSSamples.size();
+  }
+
+  return true;
+}
+
+//
+// Everything of interest in one GPMF payload.
+//
+bool GoProMeta::processPayload(uint32_t* data, uint32_t payloadsize) {
+	int32_t ret;
+
+	ret = GPMF_Init(ms, data, payloadsize);
 	if (ret != GPMF_OK) {
-		std::cerr << "ERROR: Could not GPMF_Init with payloadsize: " << payloadsize << std::endl;
+		errors += "ERROR: Could not GPMF_Init with payloadsize: " + std::to_string(payloadsize) + "\n";
 		return false;
 	}
 
-	// Now we've got the sample and we've begun parsing it for GPMF.
-	// Iterate through the sample and process anything we're interested in.
-	do
-	{
-		switch(GPMF_Key(ms))
-		{
-		case STR2FOURCC("GPS5"):
-		  // GPS data samples
-		  if (!processGPS5()) {
-		  	std::cerr << "ERROR: Failed to process GPS5 data." << std::endl;
-		  	return false;
-		  }
-		  break;
-	  
-		case STR2FOURCC("GPSU"): 
-		  // GPS UTC time
-		  if (!processGPSU()) {
-		  	std::cerr << "ERROR: Failed to process GPSU data." << std::endl;
-		  	return false;
-		  }
-		  break;
-	  
-		case STR2FOURCC("GPSP"): 
-		  // GPS Precision
-		  if (!processGPSP()) {
-		  	std::cerr << "ERROR: Failed to process GPSP data." << std::endl;
-		  	return false;
-		  }
-		  break;
-
-		case STR2FOURCC("GPSF"): 
-		  // GPS Fix on location
-		  if (!processGPSF()) {
-		  	std::cerr << "ERROR: Failed to process GPSF data." << std::endl;
-		  	return false;
-		  }
-		  break;
-
-		default: // if you don’t know the Key you can skip to the next
-		  break;
+	if (bTargetedWalk) {
+		bool bFound = false;
+
+		if (gpsStreamOffset && !walkLearnedGPSStream(bFound))
+			return false;
+
+		if (bFound)
+			gpsOffsetHits++;
+		else {
+			gpsOffsetMisses++;
+			if (!walkGPSStreams())
+				return false;
 		}
-	} while (GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS)); // Scan through all GPMF data
+	}
+	else {
+		// Now we've got the sample and we've begun parsing it for GPMF.
+		// Iterate through the sample and process anything we're interested in.
+		do
+		{
+			if (!processKey())
+				return false;
+		} while (GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS)); // Scan through all GPMF data
+	}
 
 	// RMW: I believe this is unnecessary as GPMF_Init() calls GPMF_ResetState(),
 	//      but I'll leave it in per the example in case there's some intertwined case I can't see.
 	GPMF_ResetState(ms);
-  }
 
-  std::cout << std::endl << basename((char*)fName.c_str()) << ": " << samplesProcessed << " points recorded. " << samplesSkippedForNoLock << " skipped due to NO GPS Lock. " 
-  		<< samplesSkippedForPoorPrecision << " skipped for poor precision." << std::endl;
+	return true;
+}
 
-  return true;
+//
+// Maps the next wanted sample time onto the track through the last GPSU seen and the payload
+// 'duration', and returns the first payload whose GPSU could be at or after it - everything
+// before is more than SKIP_MARGIN_SECONDS early. Each payload that is read brings a fresh
+// GPSU, so drift between GPS time and the track's timing never builds up. Anything at or
+// below the current payload means nothing can be skipped.
+//
+uint32_t GoProMeta::nextWantedPayload(double duration) {
+	double wantedIn, payloads;
+
+	// A GPSU from before the first kept sample can't be trusted - a camera without a lock
+	// writes whatever its clock says - so nothing is skipped on it.
+	if (!currentTime.isValid() || samplesProcessed == 0 || duration <= 0.0)
+		return 0;
+
+	// Seconds from the GPSU's payload to the next wanted sample, less the margin.
+	wantedIn = (double)nextSampleTime - currentTime.getEpochMs() / 1000.0 - SKIP_MARGIN_SECONDS;
+	payloads = ceil(wantedIn / duration);
+	if (payloads <= 0.0)
+		return 0;
+
+	return payloads >= (double)(UINT32_MAX - gpsuPayloadIndex) ? UINT32_MAX : gpsuPayloadIndex + (uint32_t)payloads;
+}
+
+//
+// Decodes payload 'index' on its own, as if it were the only one in the file, keeping every
+// sample that passes the lock and precision thresholds. True when at least one did.
+//
+bool GoProMeta::decodeFixedPayload(uint32_t index) {
+	uint32_t payloadsize = GetPayloadSize(mp4, index);
+
+	lockState = 0;
+	GPSPrecision = 9999;
+	currentTime = TD();
+	nextSampleTime = 0;
+	GPSSamples.clear();
+
+	setPayloadTime(index);
+	payload = GetPayloadView(mp4, index);
+
+	return payload != NULL && processPayload(payload, payloadsize) && GPSSamples.size() > 0;
+}
+
+void GoProMeta::scanFile(FileScan &scan) {
+	unsigned int timing = secondsBetweenSamples;
+	uint32_t first, last;
+
+	scan = FileScan();
+	if (mp4==0 || numPayloads==0)
+		return;
+
+	scan.bOpened = true;
+	scan.numPayloads = numPayloads;
+	scan.duration = metadatalength;
+
+	// Every sample of the two payloads counts, whatever the extraction timing is.
+	secondsBetweenSamples = 0;
+
+	for (first = 0; first < numPayloads && !decodeFixedPayload(first); first++)
+		;
+
+	if (first < numPayloads) {
+		scan.bHasFix = true;
+		scan.start.setEpochMs(GPSSamples.getTimeMs(0));
+		scan.startLat = GPSSamples.getLat(0);
+		scan.startLon = GPSSamples.getLon(0);
+
+		// Walking back from the end stops at 'first' at the latest, which has a fix.
+		for (last = numPayloads - 1; last > first && !decodeFixedPayload(last); last--)
+			;
+		if (last == first)
+			decodeFixedPayload(first);
+
+		scan.end.setEpochMs(GPSSamples.getTimeMs(GPSSamples.size() - 1));
+		scan.endLat = GPSSamples.getLat(GPSSamples.size() - 1);
+		scan.endLon = GPSSamples.getLon(GPSSamples.size() - 1);
+	}
+
+	GPSSamples.clear();
+	secondsBetweenSamples = timing;
+}
+
+//
+// Cheap pre-pass used to order files before the real extraction. The payloads go through
+// the same lock, precision and timing rules as in processFile(), but only until the first
+// sample is kept - its time is what the exporters file the track under, whereas a GPSU
+// from before the lock can be anything. Normally that's within the first few payloads.
+//
+bool GoProMeta::readStartTime(TD &start) {
+	if (mp4==0 || numPayloads==0)
+		return false;
+
+	for (uint32_t index = 0; index < numPayloads && GPSSamples.empty(); index++) {
+		uint32_t payloadsize = GetPayloadSize(mp4, index);
+
+		setPayloadTime(index);
+		payload = GetPayloadView(mp4, index);
+		if (payload == NULL || !processPayload(payload, payloadsize))
+			break;
+	}
+
+	if (GPSSamples.empty())
+		return false;
+
+	start.setEpochMs(GPSSamples.getTimeMs(0));
+	GPSSamples.clear();
+	return true;
+}
+
+//
+// One line recap of what processFile() did. Handed back as a string rather than
+// printed so that parallel workers don't interleave their output.
+//
+std::string GoProMeta::getSummary() {
+	std::ostringstream os;
+	std::string name(fName);
+
+	os << basename((char*)name.c_str()) << ": " << samplesProcessed << " points recorded. " << samplesSkippedForNoLock << " skipped due to NO GPS Lock. " 
+		<< samplesSkippedForPoorPrecision << " skipped for poor precision.\n";
+
+	return os.str();
 }
 
+//
+// When decimating (secondsBetweenSamples != 0) only the first sample of a GPS5 batch can
+// ever be kept, so that's the only one scaled - and nothing is scaled at all until the
+// time for the next sample comes around.
+//
 bool GoProMeta::processGPS5() {
 	uint32_t samples = GPMF_Repeat(ms);
 	uint32_t elements = GPMF_ElementsInStruct(ms);
 	uint32_t buffersize = samples * elements * sizeof(double);
 
-	double *ptr, *tmpbuffer = (double *)malloc(buffersize);
+	double *ptr;
 
-	if (!tmpbuffer)
-		return false;
+	if (!samples)
+		return true;
 
-	if (samples)
-	{
-		// Go get the data and scale it to
-		GPMF_ScaledData(ms, tmpbuffer, buffersize, 0, samples, GPMF_TYPE_DOUBLE);  //Output scaled data as floats
-
-		ptr = tmpbuffer;
-
-		// For sampling -- if secondsBetweenSamples is ZERO, we will record all samples.
-		// However, otherwise we need to see if it is time to sample and if it is,
-		//   we'll ONLY sample the initial one in the batch.
-		// It is my understanding that this 'batch' of samples represents the one-second
-		// group of 18 in the 18 Hz GPS sampling. A study of the real world data bears this out.
-		if (secondsBetweenSamples) {
-			recordSampleIfAppropriate(ptr);
-		}
-		else {
-			// Record every sample
-			for (uint32_t i = 0; i < samples; i++)
-			{
-				recordSample(ptr);
+	// For sampling -- if secondsBetweenSamples is ZERO, we will record all samples.
+	// However, otherwise we need to see if it is time to sample and if it is,
+	//   we'll ONLY sample the initial one in the batch.
+	// It is my understanding that this 'batch' of samples represents the one-second
+	// group of 18 in the 18 Hz GPS sampling. A study of the real world data bears this out.
+	if (secondsBetweenSamples) {
+		double first[GPS5_MAX_ELEMENTS];
 
-				ptr += elements; 		// Advance the pointer to the next sample.
-			}
+		if (!isTimeToSample())
+			return true;
+
+		if (elements > GPS5_MAX_ELEMENTS)
+			return false;
+
+		{
+			StageTimer timer(pStats, FileStats::STAGE_SCALE);
+			GPMF_ScaledData(ms, first, sizeof(first), 0, 1, GPMF_TYPE_DOUBLE);
 		}
+		recordSampleIfAppropriate(first, mediaMsOf(0, samples));
+		return true;
+	}
+
+	// The scratch only ever grows, so after the first few payloads this never allocates.
+	if (scaledScratch.size() < samples * elements) {
+		scaledScratch.resize(samples * elements);
+		scratchAllocations++;
+	}
 
-		free(tmpbuffer);
+	// Go get the data and scale it to
+	{
+		StageTimer timer(pStats, FileStats::STAGE_SCALE);
+		GPMF_ScaledData(ms, scaledScratch.data(), buffersize, 0, samples, GPMF_TYPE_DOUBLE);  //Output scaled data as floats
+	}
+
+	ptr = scaledScratch.data();
+
+	// Record every sample
+	for (uint32_t i = 0; i < samples; i++)
+	{
+		recordSample(ptr, mediaMsOf(i, samples));
+
+		ptr += elements; 		// Advance the pointer to the next sample.
 	}
 
 	return true;
@@ -201,6 +590,7 @@ bool GoProMeta::processGPSU() {
 
    	// UTC Time format yymmddhhmmss.sss 
    	currentTime.readGPMeta(pUTC);
+   	gpsuPayloadIndex = payloadIndex;
 
 //   	std::cout << "GPSU Decoded: DateTime: " << currentTime << std::endl;
    	return true;
@@ -225,8 +615,6 @@ bool GoProMeta::processGPSF() {
 			lockState = 0;
 			break;
 		case 1:
-			if (lockState != 1)
-				std::cout << std::endl  << "  1d? LOCK" << std::endl;
 			lockState = 1;
 			break;
 		case 2:
@@ -240,7 +628,6 @@ bool GoProMeta::processGPSF() {
 			lockState = 3;
 			break;
 		default:
-			std::cout << std::endl  << "  UNKNOWN" << std::endl;
 			lockState = 99;
 			break;
 	}
@@ -259,7 +646,25 @@ bool GoProMeta::processGPSP() {
    	return true;
 }
 
-void GoProMeta::recordSample(double* ptr) {
+//
+// The payload about to be parsed - its index and where it sits in the video.
+//
+void GoProMeta::setPayloadTime(uint32_t index) {
+	payloadIndex = index;
+	if (GetPayloadTime(mp4, index, &payloadIn, &payloadOut) != GPMF_OK)
+		payloadIn = payloadOut = 0.0;
+}
+
+//
+// The samples of a GPS5 repeat are spread evenly over the payload's media time.
+//
+uint32_t GoProMeta::mediaMsOf(uint32_t sample, uint32_t samples) {
+	double seconds = payloadIn + (payloadOut - payloadIn) * sample / samples;
+
+	return seconds > 0.0 ? (uint32_t)(seconds * 1000.0 + 0.5) : 0;
+}
+
+void GoProMeta::recordSample(double* ptr, uint32_t mediaMs) {
 	double dLat = *ptr;
 	double dLon = *(ptr+1);
 	double dEle = *(ptr+2);
@@ -267,149 +672,478 @@ void GoProMeta::recordSample(double* ptr) {
 	// Notation for processing or skipping one entry.
 //	std::cout << ".";
 
-	if (!lockState) {
+	if (lockState < minLockState) {
 		samplesSkippedForNoLock++;
 	}
-	else if (GPSPrecision > 1000) {
+	else if (GPSPrecision > maxPrecision) {
 		samplesSkippedForPoorPrecision++;
 	}
 	else {
 		samplesProcessed++;
 //		std::cout << "recording sample: " << currentTime << " " << dLat << " " << dLon << " " << dEle << std::endl;
-		GPSSamples.emplace_back(currentTime, dLat, dLon, dEle);
+		GPSSamples.push_back(currentTime.getEpochMs(), dLat, dLon, dEle, payloadIndex, mediaMs);
 	}
 }
 
-void GoProMeta::recordSampleIfAppropriate(double* ptr) {
+bool GoProMeta::isTimeToSample() {
 	// Let's make sure we don't record any GPS points until a GPSU valid time comes in.
-	if (currentTime.isValid() && currentTime.getTime() >= nextSampleTime) {
-		recordSample(ptr);
+	return currentTime.isValid() && currentTime.getTime() >= nextSampleTime;
+}
+
+void GoProMeta::recordSampleIfAppropriate(double* ptr, uint32_t mediaMs) {
+	if (isTimeToSample()) {
+		recordSample(ptr, mediaMs);
 
 		// Bump forward our next time to take a snapshot
 		nextSampleTime = currentTime.getTime() + secondsBetweenSamples;
 	}
 }
 
-void GoProMeta::getOutputPoints(std::vector<GPSSample> &samps) {
-	samps = GPSSamples; // Simply copy the big vector out to the caller.
+//
+// Hands the recorded samples over to the caller rather than copying them. Only valid
+// once per processFile().
+//
+void GoProMeta::getOutputPoints(SampleStore &samps) {
+	samps = std::move(GPSSamples);
+	GPSSamples.clear();
+}
+
+// Spot checks of the UTC conversion, done by the compiler.
+static_assert(utc::toMillis(1970, 1, 1, 0, 0, 0, 0) == 0, "epoch");
+static_assert(utc::toMillis(2000, 3, 1, 0, 0, 0, 0) == 951868800000LL, "day after a leap day");
+static_assert(utc::toMillis(2020, 7, 4, 12, 34, 56, 789) == 1593866096789LL, "GPSU style time");
+static_assert(utc::toMillis(1969, 12, 31, 23, 59, 59, 0) == -1000, "before the epoch");
+
+TD::TD() {
+	// 2000-01-01 12:00:00 UTC until a GPSU comes along.
+	ms = utc::toMillis(2000, 1, 1, 12, 0, 0, 0);
+	bIsSet=false;
 }
 
+TD::~TD() {
 
-GPSSample::GPSSample(TD &_t, double _lat, double _lon, double _ele) {
-	t = _t;
-	lat = _lat;
-	lon = _lon;
-	ele = _ele;
 }
 
-GPSSample::~GPSSample() {};
+void TD::setToCurrentTime() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-std::string GPSSample::getDateOnly() {
-	return t.getDateOnly();
+time_t TD::getTime() const {
+	return (time_t)utc::floorDiv(ms, 1000);
 }
 
-std::ostream& operator<<(std::ostream& os, const GPSSample& gs)
+std::string TD::getDateOnly() const {
+	std::ostringstream os;
+
+	utc::writeDate(os, utc::fromMillis(ms));
+
+	return std::string(os.str()); 
+}
+
+std::ostream& operator<<(std::ostream& os, const TD& dt)
 {
-	os << "time: " << gs.t << ", " << "lat: " << gs.lat << ", lon: " << gs.lon << ", ele: " << gs.ele;
+	utc::writeDateTime(os, utc::fromMillis(dt.ms));
 	return os;
 }
 
-bool operator<(GPSSample& lhs, GPSSample& rhs)
+//
+// UTC Time format yymmddhhmmss.sss - the .sss part is optional.
+//
+void TD::readGPMeta(const char* gp) {
+	int millis = 0;
+
+	// Quietly ignore anything that doesn't look like a GPSU rather than producing garbage.
+	for (int i = 0; i < 12; i++) {
+		if (gp[i] < '0' || gp[i] > '9')
+			return;
+	}
+
+	if (gp[12] == '.' && gp[13] >= '0' && gp[13] <= '9' && gp[14] >= '0' && gp[14] <= '9' && gp[15] >= '0' && gp[15] <= '9')
+		millis = 100*(gp[13]-'0') + 10*(gp[14]-'0') + (gp[15]-'0');
+
+	ms = utc::toMillis(
+		2000 + 10*(gp[0]-'0') + (gp[1]-'0'),	// year
+		10*(gp[2]-'0') + (gp[3]-'0'),			// month
+		10*(gp[4]-'0') + (gp[5]-'0'),			// day
+		10*(gp[6]-'0') + (gp[7]-'0'),			// hour
+		10*(gp[8]-'0') + (gp[9]-'0'),			// minute
+		10*(gp[10]-'0')+ (gp[11]-'0'),			// second
+		millis);
+
+	bIsSet=true;
+}
+
+void TD::setFields(int _year, int _month, int _day, int _hour, int _minute, int _second, int _millis) {
+	ms = utc::toMillis(_year, _month, _day, _hour, _minute, _second, _millis);
+	bIsSet=true;
+}
+
+int TD::getSeconds() const { return utc::fromMillis(ms).second; };
+
+bool operator<(const TD& lhs, const TD& rhs)
 {
-	return (lhs.getTime() < rhs.getTime());
+	return (lhs.ms < rhs.ms);
 }
 
-TD::TD() {
-			year = 2000;
-			month = day = 1;
-			hour = 12;
-			minute = second = 0;
-			theTime = 0;
-			calcTime();
-			bIsSet=false;
+void unittest_TimeDecode() {
+	TD a, b;
+	std::ostringstream os;
+	bool bOK = true;
+
+	// Month end into a shorter month - mktime() with an off by one month got this backwards.
+	a.readGPMeta("200131235959.500");
+	b.readGPMeta("200201000000.250");
+	os << a << " " << b;
+
+	std::cout << "Checking GPSU decode: '" << os.str() << "' " << a.getEpochMs() << " " << b.getEpochMs() << " : "
+		<< ((a < b && os.str() == "2020-01-31T23:59:59Z 2020-02-01T00:00:00Z" && b.getEpochMs() - a.getEpochMs() == 750)
+			? "PASSED." : "FAILED.") << std::endl;
+
+	// Every day from 1900 to 2100 round trips through the calendar fields.
+	for (int64_t day = utc::daysFromCivil(1900, 1, 1); day <= utc::daysFromCivil(2100, 12, 31); day++) {
+		int64_t ms = day * 86400000 + 12345678;
+		utc::Civil c = utc::fromMillis(ms);
+
+		if (utc::toMillis(c.year, c.month, c.day, c.hour, c.minute, c.second, c.millis) != ms) {
+			bOK = false;
+			break;
+		}
+	}
+	std::cout << "Checking civil date round trip 1900-2100: " << (bOK ? "PASSED." : "FAILED.") << std::endl;
 }
 
-TD::~TD() {
+#ifdef UNITTEST
+// Tests on generated GPMF and clips - the generator (mp4synth.cpp) is only built into test
+// and benchmark builds.
 
+//
+// An IMU style STRM (SCAL then 'samples' three axis int16 readings) as found around the GPS.
+//
+static void appendSensorStream(std::vector<uint8_t> &devc, const char* key, uint16_t samples) {
+	std::vector<uint8_t> strm, scal, tsmp, data(samples * 6, 0x11);
+	const char name[] = "Sensor (z,x,y)";
+
+	gpmfAppendBE32(tsmp, samples);
+	gpmfAppendBE32(scal, 418);
+	gpmfAppendKLV(strm, "STNM", 'c', 1, sizeof(name) - 1, (const uint8_t*)name);
+	gpmfAppendKLV(strm, "ORIN", 'c', 1, 3, (const uint8_t*)"ZXY");
+	gpmfAppendKLV(strm, "SIUN", 'c', 4, 1, (const uint8_t*)"m/s\xb2");
+	gpmfAppendKLV(strm, "TSMP", 'L', 4, 1, tsmp.data());
+	gpmfAppendKLV(strm, "SCAL", 'l', 4, 1, scal.data());
+	gpmfAppendKLV(strm, key, 's', 6, samples, data.data());
+	gpmfAppendKLV(devc, "STRM", 0, 4, strm.size() / 4, strm.data());
 }
 
-void TD::calcTime() {
-  struct tm t;
+//
+// A GPS STRM the way a camera writes one: GPSF, GPSU, GPSP, SCAL then an 18 sample GPS5.
+// With 'imuSamples' it sits after an ACCL and before GYRO, GRAV, CORI etc. of that many samples.
+//
+static std::vector<uint32_t> buildGPSPayload(const char* gpsu, int32_t lat, int32_t lon, int32_t ele, uint16_t imuSamples=0) {
+	const uint32_t scales[5] = { 10000000, 10000000, 1000, 1000, 100 };
+	std::vector<uint8_t> strm, devc, bytes, fix, precision, scal, gps5;
+	std::vector<uint32_t> payload;
+
+	gpmfAppendBE32(fix, 3);
+	precision.push_back(500 >> 8);
+	precision.push_back(500 & 0xff);
+	for (auto s: scales)
+		gpmfAppendBE32(scal, s);
+	for (int i = 0; i < 18; i++) {
+		gpmfAppendBE32(gps5, lat + i);
+		gpmfAppendBE32(gps5, lon - i);
+		gpmfAppendBE32(gps5, ele);
+		gpmfAppendBE32(gps5, 0);
+		gpmfAppendBE32(gps5, 0);
+	}
 
-  // Load the structure with our time.
-  t.tm_sec=second;
-  t.tm_min=minute;
-  t.tm_hour=hour;
-  t.tm_mday=day;
-  t.tm_mon=month;
-  t.tm_year=year-1900;
-  t.tm_wday=0;
-  t.tm_yday=0;
-  t.tm_isdst=0;  
+	gpmfAppendKLV(strm, "GPSF", 'L', 4, 1, fix.data());
+	gpmfAppendKLV(strm, "GPSU", 'U', 16, 1, (const uint8_t*)gpsu);
+	gpmfAppendKLV(strm, "GPSP", 'S', 2, 1, precision.data());
+	gpmfAppendKLV(strm, "SCAL", 'L', 4, 5, scal.data());
+	gpmfAppendKLV(strm, "GPS5", 'l', 20, 18, gps5.data());
+
+	if (imuSamples)
+		appendSensorStream(devc, "ACCL", imuSamples);
+	gpmfAppendKLV(devc, "STRM", 0, 4, strm.size() / 4, strm.data());
+	if (imuSamples) {
+		appendSensorStream(devc, "GYRO", imuSamples);
+		appendSensorStream(devc, "GRAV", imuSamples);
+		appendSensorStream(devc, "CORI", imuSamples);
+		appendSensorStream(devc, "IORI", imuSamples);
+		appendSensorStream(devc, "SHUT", imuSamples);
+		appendSensorStream(devc, "ISOE", imuSamples);
+	}
+	gpmfAppendKLV(bytes, "DEVC", 0, 4, devc.size() / 4, devc.data());
 
-  theTime = mktime(&t);
+	payload.resize(bytes.size() / 4);
+	memcpy(payload.data(), bytes.data(), bytes.size());
+	return payload;
 }
 
-void TD::setToCurrentTime() {
-	time_t t;
-	struct tm* ptm;
+//
+// Runs the same synthetic payload through one extractor over and over with every sample
+// kept. Once the scratch has grown to fit, no further payload may allocate.
+//
+void unittest_PayloadScratch() {
+	const unsigned int numPayloads = 1000;
+	std::vector<uint32_t> payload = buildGPSPayload("200704123456.000", 391234567, -1051234567, 1600000);
+	GoProMeta gpm;
+	SampleStore out;
+	uint32_t afterFirst;
+	bool bOK;
+
+	gpm.setSecondsBetweenSamples(0);
 
-	time(&t);
-	ptm = gmtime(&t);
-	year  = ptm->tm_year+1900;
-	month = ptm->tm_mon;
-	day   = ptm->tm_mday;
-	hour  = ptm->tm_hour;
-	minute= ptm->tm_min;
-	second= ptm->tm_sec;
+	bOK = gpm.processPayload(payload.data(), payload.size() * 4);
+	afterFirst = gpm.getScratchAllocations();
 
-	calcTime();	// set theTime based on UTC now.
+	for (unsigned int i = 1; i < numPayloads && bOK; i++)
+		bOK = gpm.processPayload(payload.data(), payload.size() * 4);
+
+	gpm.getOutputPoints(out);
+
+	std::cout << "Checking scratch allocations over " << numPayloads << " payloads: " << afterFirst << " then "
+		<< gpm.getScratchAllocations() - afterFirst << " : "
+		<< (bOK && afterFirst <= 1 && gpm.getScratchAllocations() == afterFirst && out.size() == numPayloads * 18
+			&& out.getLat(1) == 39.1234568 && out.getLon(1) == -105.1234568 && out.getEle(0) == 1600.0 ? "PASSED." : "FAILED.") << std::endl;
 }
 
-time_t TD::getTime() {
-  if (theTime==0)
-  	calcTime();
+//
+// The targeted walk must keep exactly what the full recursive walk keeps - with the GPS
+// stream alone and with it between big ACCL/GYRO/GRAV... streams. Timed a second time
+// with hourly decimation so the walk rather than the sample recording dominates.
+//
+void unittest_TargetedWalk() {
+	const unsigned int numPayloads = 20000;
+	std::vector<uint32_t> plain = buildGPSPayload("200704123456.000", 391234567, -1051234567, 1600000);
+	std::vector<uint32_t> busy = buildGPSPayload("200704123457.000", 391234667, -1051234667, 1601000, 400);
+	SampleStore stores[2];
+	double secs[2];
+	bool bOK = true;
+
+	for (int pass = 0; pass < 4; pass++) {
+		GoProMeta gpm;
+		bool bTargeted = pass & 1;
+		auto t0 = std::chrono::steady_clock::now();
+
+		gpm.setSecondsBetweenSamples(pass < 2 ? 0 : 3600);
+		gpm.setTargetedWalk(bTargeted);
+
+		for (unsigned int i = 0; i < numPayloads && bOK; i++)
+			bOK = gpm.processPayload(plain.data(), plain.size() * 4) && gpm.processPayload(busy.data(), busy.size() * 4);
+
+		if (pass < 2)
+			gpm.getOutputPoints(stores[bTargeted]);
+		else
+			secs[bTargeted] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	}
+
+	bOK = bOK && stores[0].size() == numPayloads * 36 && stores[1].size() == stores[0].size()
+		&& stores[1].timeColumn() == stores[0].timeColumn() && stores[1].latColumn() == stores[0].latColumn()
+		&& stores[1].lonColumn() == stores[0].lonColumn() && stores[1].eleColumn() == stores[0].eleColumn();
 
-  return theTime;
+	std::cout << "Checking targeted GPMF walk: full " << secs[0] << "s, targeted " << secs[1] << "s : "
+		<< (bOK ? "PASSED." : "FAILED.") << std::endl;
 }
 
-std::string TD::getDateOnly() {
-	std::ostringstream os;
+//
+// A run of identically laid out payloads should find the GPS STRM by its learned offset
+// every time after the first; payloads that keep changing layout must always fall back
+// to the scan. Either way the samples have to match the full recursive walk.
+//
+void unittest_GPSOffsetCache() {
+	const unsigned int numPayloads = 1000;
+	std::vector<uint32_t> plain = buildGPSPayload("200704123456.000", 391234567, -1051234567, 1600000);
+	std::vector<uint32_t> busy = buildGPSPayload("200704123457.000", 391234667, -1051234667, 1601000, 400);
+	std::vector<uint32_t>* sequences[2][2] = { { &busy, &busy }, { &plain, &busy } };
+	uint64_t hits[2], misses[2];
+	bool bOK = true;
 
-	os << year << "-" 
-		<< std::setfill('0') << std::setw(2) << month << "-" 
-		<< std::setfill('0') << std::setw(2) << day;
+	for (int seq = 0; seq < 2; seq++) {
+		SampleStore stores[2];
 
-	return std::string(os.str()); 
+		for (int targeted = 0; targeted < 2; targeted++) {
+			GoProMeta gpm;
+
+			gpm.setSecondsBetweenSamples(0);
+			gpm.setTargetedWalk(targeted == 1);
+
+			for (unsigned int i = 0; i < numPayloads && bOK; i++) {
+				std::vector<uint32_t> &p = *sequences[seq][i & 1];
+
+				bOK = gpm.processPayload(p.data(), p.size() * 4);
+			}
+
+			gpm.getOutputPoints(stores[targeted]);
+			hits[seq] = gpm.getGPSOffsetHits();
+			misses[seq] = gpm.getGPSOffsetMisses();
+		}
+
+		bOK = bOK && stores[0].size() == numPayloads * 18 && stores[1].size() == stores[0].size()
+			&& stores[1].timeColumn() == stores[0].timeColumn() && stores[1].latColumn() == stores[0].latColumn()
+			&& stores[1].lonColumn() == stores[0].lonColumn() && stores[1].eleColumn() == stores[0].eleColumn();
+	}
+
+	std::cout << "Checking GPS offset cache: same layout " << hits[0] << " hits " << misses[0] << " misses, changing layout "
+		<< hits[1] << " hits " << misses[1] << " misses : "
+		<< (bOK && hits[0] == numPayloads - 1 && misses[0] == 1 && hits[1] == 0 && misses[1] == numPayloads ? "PASSED." : "FAILED.") << std::endl;
 }
 
-std::ostream& operator<<(std::ostream& os, const TD& dt)
-{
-    os  << dt.year << '-' 
-    	<< std::setfill('0') << std::setw(2) << dt.month << '-' 
-    	<< std::setfill('0') << std::setw(2) << dt.day << 'T'
-    	<< std::setfill('0') << std::setw(2) << dt.hour << ':'
-    	<< std::setfill('0') << std::setw(2) << dt.minute << ':'
-    	<< std::setfill('0') << std::setw(2) << dt.second << 'Z';
-    return os;
+//
+// With one sample a minute and a GPSU that's the only one so far, the next payload worth
+// reading is the one two seconds (the drift margin) short of a minute on. With every sample
+// wanted nothing may be skipped.
+//
+void unittest_PayloadSkip() {
+	std::vector<uint32_t> whole = buildGPSPayload("200704123456.000", 391234567, -1051234567, 1600000);
+	std::vector<uint32_t> half = buildGPSPayload("200704123456.500", 391234567, -1051234567, 1600000);
+	GoProMeta coarse, coarseHalf, every;
+	uint32_t wanted[4];
+	bool bOK;
+
+	coarse.setSecondsBetweenSamples(60);
+	coarseHalf.setSecondsBetweenSamples(60);
+	every.setSecondsBetweenSamples(0);
+
+	wanted[0] = coarse.nextWantedPayload(1.0);		// No GPSU yet
+	bOK = coarse.processPayload(whole.data(), whole.size() * 4)
+		&& coarseHalf.processPayload(half.data(), half.size() * 4)
+		&& every.processPayload(whole.data(), whole.size() * 4);
+	wanted[1] = coarse.nextWantedPayload(1.001);
+	wanted[2] = coarseHalf.nextWantedPayload(1.0);
+	wanted[3] = every.nextWantedPayload(1.0);
+
+	std::cout << "Checking payload skip-ahead: " << wanted[0] << " " << wanted[1] << " " << wanted[2] << " " << wanted[3] << " : "
+		<< (bOK && wanted[0] == 0 && wanted[1] == 58 && wanted[2] == 58 && wanted[3] == 0 ? "PASSED." : "FAILED.") << std::endl;
 }
 
-void TD::readGPMeta(char* gp) {
-   	// UTC Time format yymmddhhmmss.sss 
-   	year  = 2000 + 10*(gp[0]-'0') + (gp[1]-'0');
-   	month = 10*(gp[2]-'0') + (gp[3]-'0');
-   	day   = 10*(gp[4]-'0') + (gp[5]-'0');
-   	hour  = 10*(gp[6]-'0') + (gp[7]-'0');
-   	minute= 10*(gp[8]-'0') + (gp[9]-'0');
-   	second= 10*(gp[10]-'0')+ (gp[11]-'0');	
+//
+// End to end on a generated clip: every sample comes out with no decimation, skipping
+// payloads at one sample a minute keeps exactly what reading all of them keeps, every
+// sample's media time is where it sits in its payload, and --dryrun's scan finds the
+// first and last fix. A clip that only gets a lock a few payloads in must lose nothing to
+// the skipping either, and its start time is that of the first sample kept.
+//
+void unittest_SynthMP4() {
+	const char* fname = "/tmp/unittest_synth.mp4";
+	SynthMP4Config cfg;
+	SampleStore every, skipped, unskipped, late[2];
+	FileScan scan;
+	TD start;
+	uint64_t numSkipped = 0;
+	bool bOK, bLate;
+
+	// Before the lock the GPSU is garbage. Payload skipping mustn't jump over the first good
+	// sample on its account, and the streaming order's start time has to be that sample's.
+	cfg.payloads = 10;
+	cfg.unlockedPayloads = 4;
+	bLate = writeSynthMP4(fname, cfg);
+	for (int pass = 0; pass < 3 && bLate; pass++) {
+		GoProMeta gpm;
+
+		gpm.setSecondsBetweenSamples(5);
+		gpm.setSkipPayloads(pass != 1);
+		bLate = gpm.openFile(fname) && (pass == 2 ? gpm.readStartTime(start) : gpm.processFile());
+		if (pass < 2)
+			gpm.getOutputPoints(late[pass]);
+	}
+	bLate = bLate && late[0].size() > 0 && late[0].timeColumn() == late[1].timeColumn()
+		&& late[0].getTimeMs(0) == cfg.startMs + cfg.unlockedPayloads * 1001 && start.getEpochMs() == late[0].getTimeMs(0);
+
+	cfg = SynthMP4Config();
+	cfg.payloads = 300;
+	bOK = writeSynthMP4(fname, cfg);
+
+	for (int pass = 0; pass < 3 && bOK; pass++) {
+		GoProMeta gpm;
+
+		gpm.setSecondsBetweenSamples(pass == 0 ? 0 : 60);
+		gpm.setSkipPayloads(pass == 1);
+		bOK = gpm.openFile(fname) && gpm.processFile();
+		gpm.getOutputPoints(pass == 0 ? every : pass == 1 ? skipped : unskipped);
+		if (pass == 1)
+			numSkipped = gpm.getPayloadsSkipped();
+		else if (pass == 2)
+			gpm.scanFile(scan);
+	}
+
+	bOK = bOK && every.size() == cfg.payloads * cfg.gpsSamples && every.getTimeMs(0) == cfg.startMs
+		&& skipped.size() == 5 && skipped.timeColumn() == unskipped.timeColumn() && skipped.latColumn() == unskipped.latColumn()
+		&& numSkipped > 250
+		&& scan.bHasFix && scan.numPayloads == cfg.payloads && scan.start.getEpochMs() == cfg.startMs
+		&& scan.end.getEpochMs() == cfg.startMs + (cfg.payloads - 1) * 1001 && scan.endLat == every.getLat(every.size() - 1)
+		&& skipped.mediaColumn() == unskipped.mediaColumn();
+
+	// Payloads are 1001 ticks of a 1000 timescale.
+	for (size_t i = 0; i < every.size() && bOK; i++) {
+		double expected = every.getPayload(i) * 1001.0 + 1001.0 * (i % cfg.gpsSamples) / cfg.gpsSamples;
+		bOK = fabs(every.getMediaMs(i) - expected) <= 1.0;
+	}
 
-   	bIsSet=true;
-   	calcTime();	
+	std::cout << "Checking synthetic MP4: " << every.size() << " samples, " << skipped.size() << " at 60s with "
+		<< numSkipped << " payloads skipped, first kept " << start << " : " << (bOK && bLate ? "PASSED." : "FAILED.") << std::endl;
+	remove(fname);
 }
 
-int TD::getSeconds() { return second; };
+//
+// --stats counters on a synthetic clip: every payload read once and nothing read twice.
+//
+void unittest_Stats() {
+	const char* fname = "/tmp/unittest_stats.mp4";
+	SynthMP4Config cfg;
+	FileStats stats[2];
+	uint64_t payloadBytes = 0;
+	bool bOK;
+
+	cfg.payloads = 120;
+	cfg.paddingBytes = 100000;
+	bOK = writeSynthMP4(fname, cfg);
+
+	for (uint32_t i = 0; i < cfg.payloads; i++) {
+		std::vector<uint8_t> p;
+
+		synthPayload(cfg, i, p);
+		payloadBytes += p.size();
+	}
 
-bool operator<(TD& lhs, TD& rhs)
-{
-	return (lhs.getTime() < rhs.getTime());
+	for (int pass = 0; pass < 2 && bOK; pass++) {
+		GoProMeta gpm;
+		uint64_t allocationsBefore = heapAllocations();
+
+		gpm.setStats(&stats[pass]);
+		gpm.setSecondsBetweenSamples(pass == 0 ? 0 : 60);
+		gpm.setReadGap(0);
+		bOK = gpm.openFile(fname) && gpm.processFile();
+		gpm.closeFile();
+		stats[pass].allocations += heapAllocations() - allocationsBefore;
+	}
+
+	// The reader's own mallocs - itself, moov and the sample tables at least - are in there.
+	size_t src = OpenMP4Source((char*)fname, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE);
+	uint32_t readerAllocations = GetAllocations(src);
+	CloseSource(src);
+
+	FileStats &all = stats[0], &sparse = stats[1];
+	bOK = bOK && readerAllocations >= 4 && all.allocations >= readerAllocations && all.payloads == cfg.payloads && all.payloadsSkipped == 0 && all.samples == cfg.payloads * cfg.gpsSamples
+		&& all.bytesRead > payloadBytes && all.bytesRead < payloadBytes + 65536 && all.fileBytes > cfg.payloads * cfg.paddingBytes
+		&& all.klvs >= cfg.payloads * 5 && all.ns[FileStats::STAGE_READ] > 0 && all.ns[FileStats::STAGE_SCALE] > 0
+		&& all.ns[FileStats::STAGE_WALK] > 0 && all.allocations > 0
+		&& sparse.payloads + sparse.payloadsSkipped == cfg.payloads && sparse.samples == 2 && sparse.bytesRead < all.bytesRead / 10;
+
+	RunStats run;
+	std::ostringstream json;
+	run.addFile(fname, all);
+	run.addFile(fname, sparse);
+	run.stop();
+	run.write(json, true);
+	bOK = bOK && run.total.files == 2 && run.total.payloads == all.payloads + sparse.payloads
+		&& json.str().find("\"total\":{\"files\":2,") != std::string::npos;
+
+	std::cout << "Checking --stats counters: " << all.bytesRead << " of " << all.fileBytes << " bytes read in "
+		<< all.readCalls << " reads, " << sparse.bytesRead << " at 60s, " << readerAllocations << " reader allocations : " << (bOK ? "PASSED." : "FAILED.") << std::endl;
+	remove(fname);
 }
+#endif
@@ -21,40 +21,59 @@
 #include "gpmf-parser/GPMF_parser.h"
 #include "gpmf-parser/GPMF_mp4reader.h"
 
+#include "samplestore.h"
+#include "stats.h"
+#include "utctime.h"
+
+//
+// A UTC point in time, kept as milliseconds since the epoch. Everything (comparisons,
+// output, the date) works off that one integer - see utctime.h.
+//
 class TD {
 public:
 	TD();
 	~TD();
 	friend std::ostream& operator<<(std::ostream& os, const TD& dt);
-	friend bool operator<(TD& lhs, TD& rhs);
-	void readGPMeta(char* gp);
-	int getSeconds();
-	time_t getTime();
-	std::string getDateOnly();
+	friend bool operator<(const TD& lhs, const TD& rhs);
+	void readGPMeta(const char* gp);
+	void setFields(int _year, int _month, int _day, int _hour, int _minute, int _second, int _millis=0);
+	int getSeconds() const;
+	time_t getTime() const;							// Whole seconds since the epoch
+	int64_t getEpochMs() const { return ms; };
+	void setEpochMs(int64_t _ms) { ms = _ms; bIsSet = true; };
+	std::string getDateOnly() const;
 	bool isValid() { return bIsSet; };
 	void setToCurrentTime();		// get current time and set values from there.
 protected:
-	void calcTime();
-	int year, month, day, hour, minute, second;
-	time_t theTime;
+	int64_t ms;
 	bool bIsSet;
 };
 
-class GPSSample {
-public:
-	GPSSample(TD &_t, double _lat, double _lon, double _ele);
-	~GPSSample();
-	friend std::ostream& operator<<(std::ostream& os, const GPSSample& gs);
-	friend bool operator<(GPSSample& lhs, GPSSample& rhs);
-	time_t getTime() { return t.getTime(); };
-	std::string getDateOnly();
-	double getLat() { return lat; };
-	double getLon() { return lon; };
-	double getEle() { return ele; };
-	TD getTD() { return t; };
-protected:
-	TD t;
-	double lat, lon, ele;
+//
+// What --dryrun learns about a file from its sample tables plus the first and last payloads
+// that hold a GPS fix. start/end and the locations are only meaningful with bHasFix.
+//
+struct FileScan {
+	FileScan() : bOpened(false), bHasFix(false), numPayloads(0), duration(0.0),
+		startLat(0.0), startLon(0.0), endLat(0.0), endLon(0.0) {};
+	bool bOpened;
+	bool bHasFix;
+	uint32_t numPayloads;
+	double duration;		// Seconds of GPMF track
+	TD start, end;
+	double startLat, startLon;
+	double endLat, endLon;
+};
+
+//
+// Where the streaming pre-pass sorts a file. bProcessable is set for the files processFile()
+// will take (or a cache entry stands in for) - they get a track name in a batch run, with
+// or without samples.
+//
+struct FileStart {
+	FileStart() : bProcessable(false) {};
+	bool bProcessable;
+	std::string key;		// "YYYY-MM-DDTHH:MM:SSZ" of the first sample kept, empty if none is
 };
 
 class GoProMeta {
@@ -62,17 +81,44 @@ public:
 	GoProMeta();
 	~GoProMeta();
 	void setSecondsBetweenSamples(unsigned int newtiming);
+	void setUseMemoryMap(bool bUse) { bUseMemoryMap = bUse; };
+	void setReadGap(int64_t gapBytes) { readGap = gapBytes; };	// <0 keeps the reader's default
+	void setTargetedWalk(bool bTargeted) { bTargetedWalk = bTargeted; };	// false walks every KLV of every payload
+	void setSkipPayloads(bool bSkip) { bSkipPayloads = bSkip; };	// false reads every payload whatever the sample timing
+	void setLockThresholds(unsigned int _minLockState, unsigned int _maxPrecision);
+	void setStats(FileStats* _pStats) { pStats = _pStats; };	// Timings and counters of the files to come go here, NULL stops them
 	bool openFile(const char* filename);
+	void closeFile();
 	bool processFile();
-	void getOutputPoints(std::vector<GPSSample> &samps);
+	bool readStartTime(TD &start);	// Time of the first sample processFile() would keep
+	bool isProcessable() { return mp4 != 0 && metadatalength != 0.0 && numPayloads != 0; };	// processFile()'s up front checks
+	void scanFile(FileScan &scan);	// --dryrun: decodes only the first and last payloads with a fix
+	void getOutputPoints(SampleStore &samps);
+	std::string getSummary();
+	std::string getErrors() { return errors; };	// What went wrong with the current file, one line each
+	bool processPayload(uint32_t* data, uint32_t payloadsize);
+	uint32_t getScratchAllocations() { return scratchAllocations + payloadBuffers.allocations; };	// Growths of the reusable buffers
+	uint64_t getGPSOffsetHits() { return gpsOffsetHits; };		// Payloads whose GPS STRM was where the last one's was
+	uint64_t getGPSOffsetMisses() { return gpsOffsetMisses; };	// Payloads that needed a scan for it
+	uint64_t getPayloadsSkipped() { return payloadsSkipped; };		// Never read as they couldn't hold a wanted sample
+	uint32_t getPayloadsRead() { return payloadsRead; };			// Of the current file
+	uint64_t getBytesRead() { return mp4 ? GetBytesRead(mp4, NULL) : 0; };	// Of the current file, until closeFile()
+	uint32_t nextWantedPayload(double duration);	// processFile()'s skip-ahead
 
 protected:
+	bool processKey();
+	bool walkGPSStreams();
+	bool walkLearnedGPSStream(bool &bFound);
+	bool decodeFixedPayload(uint32_t index);
 	bool processGPS5();
 	bool processGPSU();
 	bool processGPSF();
 	bool processGPSP();
-	void recordSample(double* ptr);
-	void recordSampleIfAppropriate(double* ptr);
+	void setPayloadTime(uint32_t index);
+	uint32_t mediaMsOf(uint32_t sample, uint32_t samples);
+	void recordSample(double* ptr, uint32_t mediaMs);
+	void recordSampleIfAppropriate(double* ptr, uint32_t mediaMs);
+	bool isTimeToSample();
 
 	uint8_t lockState;	// 0=No_Lock, 2=2D_Lock, 3=3D_Lock
 	uint16_t GPSPrecision;
@@ -83,13 +129,32 @@ protected:
 	size_t mp4;
 	GPMF_stream metadata_stream, *ms;
 	double metadatalength;
-	uint32_t *payload;
+	uint32_t *payload;		// Read-only view owned by the mp4 source (see GetPayloadView)
+	bool bUseMemoryMap;
+	bool bTargetedWalk;		// Leave each DEVC once its GPS stream has been walked
+	uint32_t gpsStreamOffset;	// Word offset of the GPS STRM in the last payload, 0 when not known
+	uint64_t gpsOffsetHits;
+	uint64_t gpsOffsetMisses;
+	bool bSkipPayloads;
+	uint64_t payloadsSkipped;
+	int64_t readGap;
 	unsigned int secondsBetweenSamples;
+	unsigned int minLockState;	// Samples below this GPSF fix level are skipped
+	unsigned int maxPrecision;	// Samples with a GPSP (DOP x 100) above this are skipped
 	uint32_t numPayloads;
+	uint32_t payloadsRead;
+	uint32_t payloadIndex;		// Payload currently being parsed - recorded with each sample
+	uint32_t gpsuPayloadIndex;	// Payload the GPSU in currentTime came from
+	double payloadIn, payloadOut;	// Media time span of the payload being parsed, in seconds
 	TD currentTime;
 	time_t nextSampleTime;
-	std::vector<GPSSample> GPSSamples;
+	SampleStore GPSSamples;
 	std::string fName;
+	std::string errors;		// Collected for the caller rather than printed, like the summary
+	std::vector<double> scaledScratch;	// GPS5 scaled to doubles - reused by every payload and file
+	uint32_t scratchAllocations;
+	mp4buffers payloadBuffers;			// Lent to each mp4 source so payload reads reuse them across files
+	FileStats* pStats;
 };
 
 #endif
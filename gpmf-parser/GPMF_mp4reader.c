@@ -27,6 +27,12 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifndef _WINDOWS
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
 #include "GPMF_mp4reader.h"
 #include "GPMF_common.h"
@@ -65,11 +71,13 @@ uint32_t *GetPayload(size_t handle, uint32_t *lastpayload, uint32_t index)
 		if ((mp4->filesize >= mp4->metaoffsets[index]+mp4->metasizes[index]) && (mp4->metasizes[index] > 0))
 		{
 			MP4buffer = (uint32_t *)realloc((void *)lastpayload, mp4->metasizes[index]);
+			mp4->allocations++;
 
 			if (MP4buffer)
 			{
 				LONGSEEK(mp4->mediafp, mp4->metaoffsets[index], SEEK_SET);
-				fread(MP4buffer, 1, mp4->metasizes[index], mp4->mediafp);
+				mp4->bytesread += fread(MP4buffer, 1, mp4->metasizes[index], mp4->mediafp);
+				mp4->readcalls++;
 				mp4->filepos = mp4->metaoffsets[index] + mp4->metasizes[index];
 				return MP4buffer;
 			}
@@ -82,6 +90,340 @@ uint32_t *GetPayload(size_t handle, uint32_t *lastpayload, uint32_t index)
 }
 
 
+// A camera original has about a second of video (4-15MB at GoPro bitrates) between
+// consecutive GPMF payloads. Reading across that costs far more than the seek it saves
+// on any disk or SD reader (break even is ~64K on flash, ~1.5M on a spinning disk), so
+// by default only payloads that really sit together - metadata-only files, remuxed
+// GPMF tracks - are merged.
+#define MP4_DEFAULT_READ_GAP		(64*1024)			// merge payloads separated by less than this
+#define MP4_MIN_READ_BATCH			(8*1024*1024)		// a batch may always span this much...
+#define MP4_READ_BATCH_GAPS			16					// ...or this many gaps, whichever is more
+#define MP4_MAX_BATCH_PAYLOADS		256					// two iovecs per payload stays well under IOV_MAX
+
+// maxbatchbytes 0 derives the cap from the gap, so a large gap is never silently cut short.
+void SetPayloadReadGap(size_t handle, uint64_t gapbytes, uint64_t maxbatchbytes)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL) return;
+
+	mp4->readgap = gapbytes;
+	mp4->readbatch_max = maxbatchbytes ? maxbatchbytes : gapbytes * MP4_READ_BATCH_GAPS;
+	if (mp4->readbatch_max < MP4_MIN_READ_BATCH)
+		mp4->readbatch_max = MP4_MIN_READ_BATCH;
+	mp4->batchcount = 0;
+}
+
+#ifndef _WINDOWS
+// Sort payload indices by file offset. GoPro writes them in order so the merge
+// passes are normally skipped entirely.
+static int BuildReadOrder(mp4object *mp4)
+{
+	uint32_t i, width, n = mp4->indexcount;
+	uint32_t *tmp;
+
+	if (mp4->readorder) return 1;
+
+	mp4->readorder = (uint32_t *)malloc(n * 4 + 4);
+	mp4->readrank = (uint32_t *)malloc(n * 4 + 4);
+	mp4->allocations += 2;
+	if (mp4->readorder == NULL || mp4->readrank == NULL)
+		goto fail;
+
+	for (i = 0; i < n; i++)
+		mp4->readorder[i] = i;
+
+	for (i = 1; i < n; i++)
+		if (mp4->metaoffsets[i - 1] > mp4->metaoffsets[i])
+			break;
+
+	if (i < n)
+	{
+		uint32_t *src = mp4->readorder;
+		tmp = (uint32_t *)malloc(n * 4 + 4);
+		mp4->allocations++;
+		if (tmp == NULL)
+			goto fail;
+
+		for (width = 1; width < n; width *= 2)
+		{
+			uint32_t *dst = (src == mp4->readorder) ? tmp : mp4->readorder;
+			for (i = 0; i < n; i += 2 * width)
+			{
+				uint32_t a = i, amax = i + width < n ? i + width : n;
+				uint32_t b = amax, bmax = i + 2 * width < n ? i + 2 * width : n;
+				uint32_t k = i;
+				while (a < amax && b < bmax)
+					dst[k++] = (mp4->metaoffsets[src[b]] < mp4->metaoffsets[src[a]]) ? src[b++] : src[a++];
+				while (a < amax) dst[k++] = src[a++];
+				while (b < bmax) dst[k++] = src[b++];
+			}
+			src = dst;
+		}
+		if (src != mp4->readorder)
+			memcpy(mp4->readorder, src, n * 4);
+		free(tmp);
+	}
+
+	for (i = 0; i < n; i++)
+		mp4->readrank[mp4->readorder[i]] = i;
+
+	return 1;
+
+fail:
+	if (mp4->readorder) free(mp4->readorder);
+	if (mp4->readrank) free(mp4->readrank);
+	mp4->readorder = mp4->readrank = NULL;
+	mp4->readgap = 0;	// don't try again
+	return 0;
+}
+
+static int PreadvFully(mp4object *mp4, int fd, struct iovec *iov, int niov, uint64_t offset)
+{
+	while (niov > 0)
+	{
+		ssize_t got = preadv(fd, iov, niov, (off_t)offset);
+		mp4->readcalls++;
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return 0;
+
+		mp4->bytesread += (uint64_t)got;
+		offset += (uint64_t)got;
+		while (niov > 0 && (size_t)got >= iov->iov_len)
+		{
+			got -= (ssize_t)iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (niov > 0)
+		{
+			iov->iov_base = (uint8_t *)iov->iov_base + got;
+			iov->iov_len -= (size_t)got;
+		}
+	}
+	return 1;
+}
+
+// Fetch 'index' together with its neighbours in file order. Payloads whose gap
+// is within readgap are pulled in by a single preadv(), the gaps landing in a
+// throwaway buffer, so a whole run of payloads costs one syscall and one seek.
+static uint32_t *ReadPayloadBatch(mp4object *mp4, uint32_t index)
+{
+	struct iovec iov[MP4_MAX_BATCH_PAYLOADS * 2];
+	uint32_t rank, count = 0, k, niov = 0;
+	uint64_t start, end, packed = 0, maxgap = 0, pos = 0;
+
+	if (!BuildReadOrder(mp4))
+		return NULL;
+
+	rank = mp4->readrank[index];
+	start = end = mp4->metaoffsets[index];
+
+	while (rank + count < mp4->indexcount && count < MP4_MAX_BATCH_PAYLOADS)
+	{
+		uint32_t idx = mp4->readorder[rank + count];
+		uint64_t off = mp4->metaoffsets[idx], size = mp4->metasizes[idx];
+
+		if (size == 0 || off + size > mp4->filesize)
+			break;
+		if (count)
+		{
+			if (off < end || off - end > mp4->readgap || off + size - start > mp4->readbatch_max)
+				break;
+			if (off - end > maxgap)
+				maxgap = off - end;
+		}
+		packed += (size + 3) & ~3;
+		end = off + size;
+		count++;
+	}
+	if (count == 0)
+		return NULL;
+
+	if (mp4->buffers->batchbuffer_size < packed)
+	{
+		uint8_t *newbuffer = (uint8_t *)realloc(mp4->buffers->batchbuffer, (size_t)packed);
+		if (newbuffer == NULL) return NULL;
+		mp4->buffers->batchbuffer = newbuffer;
+		mp4->allocations++;
+		mp4->buffers->batchbuffer_size = packed;
+		mp4->buffers->allocations++;
+	}
+	if (mp4->buffers->gapsink_size < maxgap)
+	{
+		uint8_t *newsink = (uint8_t *)realloc(mp4->buffers->gapsink, (size_t)maxgap);
+		if (newsink == NULL) return NULL;
+		mp4->buffers->gapsink = newsink;
+		mp4->allocations++;
+		mp4->buffers->gapsink_size = maxgap;
+		mp4->buffers->allocations++;
+	}
+	if (mp4->buffers->batchpos == NULL)
+	{
+		mp4->buffers->batchpos = (uint32_t *)malloc(MP4_MAX_BATCH_PAYLOADS * 4);
+		if (mp4->buffers->batchpos == NULL) return NULL;
+		mp4->allocations++;
+		mp4->buffers->allocations++;
+	}
+
+	end = start;
+	for (k = 0; k < count; k++)
+	{
+		uint32_t idx = mp4->readorder[rank + k];
+		uint64_t off = mp4->metaoffsets[idx], size = mp4->metasizes[idx];
+
+		if (off > end)
+		{
+			iov[niov].iov_base = mp4->buffers->gapsink;
+			iov[niov].iov_len = (size_t)(off - end);
+			niov++;
+		}
+		iov[niov].iov_base = mp4->buffers->batchbuffer + pos;
+		iov[niov].iov_len = (size_t)size;
+		niov++;
+
+		mp4->buffers->batchpos[k] = (uint32_t)pos;
+		pos += (size + 3) & ~3;
+		end = off + size;
+	}
+
+	mp4->batchcount = 0;
+	if (!PreadvFully(mp4, fileno(mp4->mediafp), iov, (int)niov, start))
+		return NULL;
+
+	mp4->batchfirst = rank;
+	mp4->batchcount = count;
+	return (uint32_t *)(mp4->buffers->batchbuffer + mp4->buffers->batchpos[0]);
+}
+#endif
+
+uint32_t *GetPayloadView(size_t handle, uint32_t index)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL) return NULL;
+
+	if (index < mp4->indexcount && mp4->metasizes[index] > 0 && mp4->filesize >= mp4->metaoffsets[index] + mp4->metasizes[index])
+	{
+		// GPMF is parsed as 32-bit words, so only aligned payloads can be used in place.
+		if (mp4->mapbase && mp4->metaoffsets[index] + mp4->metasizes[index] <= mp4->maplen && (mp4->metaoffsets[index] & 3) == 0)
+		{
+			mp4->bytesread += mp4->metasizes[index];
+			return (uint32_t *)(mp4->mapbase + mp4->metaoffsets[index]);
+		}
+
+#ifndef _WINDOWS
+		if (mp4->mapbase == NULL && mp4->mediafp && mp4->readgap)
+		{
+			uint32_t *batched;
+
+			if (mp4->batchcount && mp4->readrank)
+			{
+				uint32_t rank = mp4->readrank[index];
+				if (rank >= mp4->batchfirst && rank < mp4->batchfirst + mp4->batchcount)
+					return (uint32_t *)(mp4->buffers->batchbuffer + mp4->buffers->batchpos[rank - mp4->batchfirst]);
+			}
+
+			batched = ReadPayloadBatch(mp4, index);
+			if (batched)
+				return batched;
+			// otherwise fall through to a plain single payload read
+		}
+#endif
+
+		if (mp4->buffers->viewbuffer_size < mp4->metasizes[index])
+		{
+			uint32_t *newbuffer = (uint32_t *)realloc((void *)mp4->buffers->viewbuffer, mp4->metasizes[index]);
+			if (newbuffer == NULL) return NULL;
+			mp4->buffers->viewbuffer = newbuffer;
+			mp4->allocations++;
+			mp4->buffers->viewbuffer_size = mp4->metasizes[index];
+			mp4->buffers->allocations++;
+		}
+
+		if (mp4->mapbase)
+		{
+			memcpy(mp4->buffers->viewbuffer, mp4->mapbase + mp4->metaoffsets[index], mp4->metasizes[index]);
+			mp4->bytesread += mp4->metasizes[index];
+			return mp4->buffers->viewbuffer;
+		}
+
+		if (mp4->mediafp)
+		{
+			LONGSEEK(mp4->mediafp, mp4->metaoffsets[index], SEEK_SET);
+			mp4->readcalls++;
+			if (fread(mp4->buffers->viewbuffer, 1, mp4->metasizes[index], mp4->mediafp) != mp4->metasizes[index])
+				return NULL;
+			mp4->bytesread += mp4->metasizes[index];
+			mp4->filepos = mp4->metaoffsets[index] + mp4->metasizes[index];
+			return mp4->buffers->viewbuffer;
+		}
+	}
+
+	return NULL;
+}
+
+
+uint32_t IsMappedSource(size_t handle)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL) return 0;
+
+	return mp4->mapbase != NULL;
+}
+
+
+#define MMAP_ADVISE_MERGE	(64*1024)	// payload ranges closer than this share one madvise() call
+
+static void MapSource(mp4object *mp4)
+{
+#ifndef _WINDOWS
+	void *base;
+	uint32_t i;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	uint64_t advstart = 0, advend = 0;
+
+	if (mp4 == NULL || mp4->mediafp == NULL || mp4->filesize == 0 || pagesize <= 0)
+		return;
+
+	base = mmap(NULL, (size_t)mp4->filesize, PROT_READ, MAP_PRIVATE, fileno(mp4->mediafp), 0);
+	if (base == MAP_FAILED)
+		return;  // stay on the FILE* path
+
+	mp4->mapbase = (uint8_t *)base;
+	mp4->maplen = mp4->filesize;
+
+	// The GPMF payloads are a tiny fraction of a video file, so turn off kernel
+	// readahead for the mapping and instead ask for just the payload pages.
+	madvise(base, (size_t)mp4->maplen, MADV_RANDOM);
+
+	for (i = 0; i < mp4->indexcount; i++)
+	{
+		uint64_t start = mp4->metaoffsets[i] & ~((uint64_t)pagesize - 1);
+		uint64_t end = mp4->metaoffsets[i] + mp4->metasizes[i];
+
+		if (end > mp4->maplen)
+			continue;
+
+		if (advend && start >= advstart && start <= advend + MMAP_ADVISE_MERGE)
+		{
+			if (end > advend) advend = end;
+			continue;
+		}
+
+		if (advend)
+			madvise(mp4->mapbase + advstart, (size_t)(advend - advstart), MADV_WILLNEED);
+		advstart = start;
+		advend = end;
+	}
+	if (advend)
+		madvise(mp4->mapbase + advstart, (size_t)(advend - advstart), MADV_WILLNEED);
+#else
+	(void)mp4;
+#endif
+}
+
+
 void LongSeek(mp4object *mp4, int64_t offset)
 {
 	if (mp4 && offset)
@@ -104,6 +446,26 @@ void FreePayload(uint32_t *lastpayload)
 		free(lastpayload);
 }
 
+void AttachPayloadBuffers(size_t handle, mp4buffers *buffers)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL) return;
+
+	mp4->buffers = buffers ? buffers : &mp4->ownbuffers;
+	mp4->batchcount = 0;	// whatever a batch left in the other buffers is not ours
+}
+
+void FreePayloadBuffers(mp4buffers *buffers)
+{
+	if (buffers == NULL) return;
+
+	if (buffers->viewbuffer) free(buffers->viewbuffer);
+	if (buffers->batchbuffer) free(buffers->batchbuffer);
+	if (buffers->batchpos) free(buffers->batchpos);
+	if (buffers->gapsink) free(buffers->gapsink);
+	memset(buffers, 0, sizeof(mp4buffers));
+}
+
 
 uint32_t GetPayloadSize(size_t handle, uint32_t index)
 {
@@ -116,718 +478,542 @@ uint32_t GetPayloadSize(size_t handle, uint32_t index)
 	return 0;
 }
 
+uint64_t GetBytesRead(size_t handle, uint32_t *readcalls)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL) return 0;
 
-#define MAX_NEST_LEVEL	20
+	if (readcalls) *readcalls = mp4->readcalls;
+	return mp4->bytesread;
+}
 
-size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype)  //RAW or within MP4
+uint32_t GetAllocations(size_t handle)
 {
-	mp4object *mp4 = (mp4object *)malloc(sizeof(mp4object));
+	mp4object *mp4 = (mp4object *)handle;
 	if (mp4 == NULL) return 0;
 
-	memset(mp4, 0, sizeof(mp4object));
+	return mp4->allocations;
+}
 
-#ifdef _WINDOWS
-	struct _stat64 mp4stat;
-	_stat64(filename, &mp4stat);
-#else
-	struct stat mp4stat;
-	stat(filename, &mp4stat);
-#endif
-	mp4->filesize = mp4stat.st_size;
-//	printf("filesize = %ld\n", mp4->filesize);
-	if (mp4->filesize < 64) return 0;
+uint64_t GetSourceFileSize(size_t handle)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL) return 0;
 
+	return mp4->filesize;
+}
+
+
+#define MAX_NEST_LEVEL	20
+
+size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype)  //RAW or within MP4
+{
+	return OpenMP4SourceEx(filename, traktype, traksubtype, 0);
+}
+
+
+// Positioned read that leaves the FILE* position alone.
+static size_t ReadAt(mp4object *mp4, uint64_t offset, void *buffer, size_t length)
+{
 #ifdef _WINDOWS
-	fopen_s(&mp4->mediafp, filename, "rb");
+	if (LONGSEEK(mp4->mediafp, offset, SEEK_SET) != 0) return 0;
+	size_t done = fread(buffer, 1, length, mp4->mediafp);
+	mp4->readcalls++;
+	mp4->bytesread += done;
+	return done;
 #else
-	mp4->mediafp = fopen(filename, "rb");
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t got = pread(fileno(mp4->mediafp), (uint8_t *)buffer + done, length - done, (off_t)(offset + done));
+		mp4->readcalls++;
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+		done += (size_t)got;
+	}
+	mp4->bytesread += done;
+	return done;
 #endif
+}
 
-	if (mp4->mediafp)
-	{
-		uint32_t qttag, qtsize32, skip, type = 0, subtype = 0, num;
-		size_t len;
-		int32_t nest = 0;
-		uint64_t nestsize[MAX_NEST_LEVEL] = { 0 };
-		uint64_t lastsize = 0, qtsize;
+static uint32_t MemBE32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
 
+static uint64_t MemBE64(const uint8_t *p)
+{
+	return ((uint64_t)MemBE32(p) << 32) | (uint64_t)MemBE32(p + 4);
+}
 
-		do
-		{
-			len = fread(&qtsize32, 1, 4, mp4->mediafp);
-			len += fread(&qttag, 1, 4, mp4->mediafp);
-			mp4->filepos += len;
-			if (len == 8 && mp4->filepos < mp4->filesize)
-			{
-				if (mp4->filepos == 8 && qttag != MAKEID('f', 't', 'y', 'p'))
-				{
-					CloseSource((size_t)mp4);
-					mp4 = NULL;
-					break;
-				}
+static uint32_t MemTag(const uint8_t *p) // same byte order as MAKEID()
+{
+	uint32_t tag;
+	memcpy(&tag, p, 4);
+	return tag;
+}
 
-				if (!GPMF_VALID_FOURCC(qttag))
-				{
-					CloseSource((size_t)mp4);
-					mp4 = NULL;
-					break;
-				}
+#define MOOV_MAX_SIZE	(256*1024*1024)	// refuse to buffer anything larger than this
 
-				qtsize32 = BYTESWAP32(qtsize32);
+#define MOOV_PARSE_FAIL	0	// invalid or unsupported, the source is rejected
+#define MOOV_PARSE_OK	1
+#define MOOV_PARSE_STOP	2	// stop walking, keep what has been gathered so far
 
-				if (qtsize32 == 1) // 64-bit Atom
-				{
-					len = fread(&qtsize, 1, 8, mp4->mediafp);
-					mp4->filepos += len;
-					qtsize = BYTESWAP64(qtsize) - 8;
-				}
-				else
-					qtsize = qtsize32;
+typedef struct moov_parse_state
+{
+	uint32_t traktype;
+	uint32_t traksubtype;
+	uint32_t type;		// handler type of the trak currently being walked
+} moov_parse_state;
+
+//
+// Walk a run of sibling atoms held in memory. Containers on the path to the sample
+// tables are recursed into, the tables of the wanted trak are decoded, and every
+// other atom is stepped over without being touched.
+//
+static int ParseMoovAtoms(mp4object *mp4, moov_parse_state *st, const uint8_t *buf, uint64_t buflen)
+{
+	uint64_t pos = 0;
 
-				if(qtsize-len > (mp4->filesize - mp4->filepos))  // not parser truncated files.
-				{
-					CloseSource((size_t)mp4);
-					mp4 = NULL;
-					break;
-				}
+	while (pos + 8 <= buflen)
+	{
+		uint64_t qtsize = MemBE32(buf + pos), hdrsize = 8, bodylen;
+		uint32_t qttag = MemTag(buf + pos + 4), num;
+		const uint8_t *body;
+		int ret = MOOV_PARSE_OK;
 
-				nest++;
+		if (!GPMF_VALID_FOURCC(qttag))
+			return MOOV_PARSE_FAIL;
 
-				if (qtsize < 8) break;
-				if (nest >= MAX_NEST_LEVEL) break;
+		if (qtsize == 1) // 64-bit Atom
+		{
+			if (pos + 16 > buflen)
+				return MOOV_PARSE_FAIL;
+			qtsize = MemBE64(buf + pos + 8);
+			hdrsize = 16;
+		}
 
-				nestsize[nest] = qtsize;
-				lastsize = qtsize;
+		if (qtsize < hdrsize)
+			return MOOV_PARSE_STOP;
+		if (qtsize > buflen - pos)  // not parser truncated files.
+			return MOOV_PARSE_FAIL;
+
+		body = buf + pos + hdrsize;
+		bodylen = qtsize - hdrsize;
+
+		if (qttag == MAKEID('m', 'o', 'o', 'v') ||
+			qttag == MAKEID('m', 'd', 'i', 'a') ||
+			qttag == MAKEID('m', 'i', 'n', 'f') ||
+			qttag == MAKEID('g', 'm', 'i', 'n') ||
+			qttag == MAKEID('d', 'i', 'n', 'f') ||
+			qttag == MAKEID('a', 'l', 'i', 's') ||
+			qttag == MAKEID('s', 't', 'b', 'l'))
+		{
+			ret = ParseMoovAtoms(mp4, st, body, bodylen);
+		}
+		else if (qttag == MAKEID('t', 'r', 'a', 'k')) //trak header
+		{
+			if (mp4->trak_num+1 < MAX_TRACKS)
+				mp4->trak_num++;
 
-#if PRINT_MP4_STRUCTURE	
+			ret = ParseMoovAtoms(mp4, st, body, bodylen);
+		}
+		else if (qttag == MAKEID('m', 'v', 'h', 'd') && bodylen >= 20) //mvhd  movie header
+		{
+			mp4->clockdemon = MemBE32(body + 12);
+			mp4->clockcount = MemBE32(body + 16);
+		}
+		else if (qttag == MAKEID('m', 'd', 'h', 'd') && bodylen >= sizeof(media_header)) //mdhd  media header
+		{
+			mp4->trak_clockdemon = MemBE32(body + 12);
+			mp4->trak_clockcount = MemBE32(body + 16);
 
-				for (int i = 1; i < nest; i++) printf("    ");
-				printf("%c%c%c%c (%lld)\n", (qttag & 0xff), ((qttag >> 8) & 0xff), ((qttag >> 16) & 0xff), ((qttag >> 24) & 0xff), qtsize);
+			if (mp4->videolength == 0.0) // Get the video length from the first track
+			{
+				mp4->videolength = (float)((double)mp4->trak_clockcount / (double)mp4->trak_clockdemon);
+			}
+		}
+		else if (qttag == MAKEID('h', 'd', 'l', 'r') && bodylen >= 12) //hldr
+		{
+			uint32_t temp = MemTag(body + 8);  // type will be 'meta' for the correct trak.
 
-				if (qttag == MAKEID('m', 'd', 'a', 't') ||
-					qttag == MAKEID('f', 't', 'y', 'p') ||
-					qttag == MAKEID('u', 'd', 't', 'a') ||
-					qttag == MAKEID('f', 'r', 'e', 'e'))
+			if (temp != MAKEID('a', 'l', 'i', 's') && temp != MAKEID('u', 'r', 'l', ' '))
+				st->type = temp;
+		}
+		else if (qttag == MAKEID('e', 'd', 't', 's') && bodylen >= 16) //edit list
+		{
+			if (MemTag(body + 4) == MAKEID('e', 'l', 's', 't') && MemTag(body + 8) == 0)
+			{
+				num = MemBE32(body + 12);
+				if (num <= ((bodylen - 16) / 12))
 				{
-					LongSeek(mp4, qtsize - 8);
-
-					NESTSIZE(qtsize);
-
-					continue;
+					uint32_t i;
+					for (i = 0; i < num; i++)
+					{
+						const uint8_t *seg = body + 16 + i * 12;
+						int32_t segment_duration = (int32_t)MemBE32(seg);		// in MP4 clock base
+						int32_t segment_mediaTime = (int32_t)MemBE32(seg + 4);	// in trak clock base
+
+						if (segment_mediaTime == -1) // the segment_duration for blanked time
+							mp4->trak_edit_list_offsets[mp4->trak_num] += segment_duration;  //samples are delay, data starts after presentation time zero.
+						else if (i == 0) // If the first editlst starts after zero, the track is offset by this time (time before presentation time zero.)
+							mp4->trak_edit_list_offsets[mp4->trak_num] -= (int32_t)((double)segment_mediaTime/(double)mp4->trak_clockdemon*(double)mp4->clockdemon); //convert to MP4 clock base.
+					}
+					if (st->type == st->traktype) // GPMF metadata 
+					{
+						mp4->metadataoffset_clockcount = mp4->trak_edit_list_offsets[mp4->trak_num]; //leave in MP4 clock base
+					}
 				}
-#endif
-				if (qttag != MAKEID('m', 'o', 'o', 'v') && //skip over all but these atoms
-					qttag != MAKEID('m', 'v', 'h', 'd') &&
-					qttag != MAKEID('t', 'r', 'a', 'k') &&
-					qttag != MAKEID('m', 'd', 'i', 'a') &&
-					qttag != MAKEID('m', 'd', 'h', 'd') &&
-					qttag != MAKEID('m', 'i', 'n', 'f') &&
-					qttag != MAKEID('g', 'm', 'i', 'n') &&
-					qttag != MAKEID('d', 'i', 'n', 'f') &&
-					qttag != MAKEID('a', 'l', 'i', 's') &&
-					qttag != MAKEID('s', 't', 's', 'd') &&
-					qttag != MAKEID('s', 't', 'b', 'l') &&
-					qttag != MAKEID('s', 't', 't', 's') &&
-					qttag != MAKEID('s', 't', 's', 'c') &&
-					qttag != MAKEID('s', 't', 's', 'z') &&
-					qttag != MAKEID('s', 't', 'c', 'o') &&
-					qttag != MAKEID('c', 'o', '6', '4') &&
-					qttag != MAKEID('h', 'd', 'l', 'r') &&
-					qttag != MAKEID('e', 'd', 't', 's'))
+			}
+		}
+		else if (qttag == MAKEID('s', 't', 's', 'd') && st->type == st->traktype && bodylen >= 16) //read the sample decription to determine the type of metadata
+		{
+			if (MemTag(body + 12) != st->traksubtype) // not MP4 metadata 
+				st->type = 0;
+		}
+		else if (qttag == MAKEID('s', 't', 's', 'c') && st->type == st->traktype && bodylen >= 8) // metadata stsc - offset chunks
+		{
+			num = MemBE32(body + 4);
+			if (num <= ((bodylen - 8) / sizeof(SampleToChunk)))
+			{
+				mp4->metastsc_count = num;
+				if (mp4->metastsc)
 				{
-					LongSeek(mp4, qtsize - 8);
-
-					NESTSIZE(qtsize);
+					free(mp4->metastsc);
+					mp4->metastsc = 0;
 				}
-				else
-					if (qttag == MAKEID('m', 'v', 'h', 'd')) //mvhd  movie header
-					{
-						len = fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&mp4->clockdemon, 1, 4, mp4->mediafp); mp4->clockdemon = BYTESWAP32(mp4->clockdemon);
-						len += fread(&mp4->clockcount, 1, 4, mp4->mediafp); mp4->clockcount = BYTESWAP32(mp4->clockcount);
+				if (num == 0)
+					return MOOV_PARSE_FAIL; //size of null
 
-						mp4->filepos += len;
-						LongSeek(mp4, qtsize - 8 - len); // skip over mvhd
-
-						NESTSIZE(qtsize);
-					}
-					else if (qttag == MAKEID('t', 'r', 'a', 'k')) //trak header
+				mp4->metastsc = (SampleToChunk *)malloc(num * sizeof(SampleToChunk));
+				mp4->allocations++;
+				if (mp4->metastsc)
+				{
+					uint32_t i;
+					for (i = 0; i < num; i++)
 					{
-
-						if (mp4->trak_num+1 < MAX_TRACKS)
-							mp4->trak_num++;
-
-						NESTSIZE(qtsize);
+						mp4->metastsc[i].chunk_num = MemBE32(body + 8 + i * 12);
+						mp4->metastsc[i].samples = MemBE32(body + 12 + i * 12);
+						mp4->metastsc[i].id = MemBE32(body + 16 + i * 12);
 					}
-					else if (qttag == MAKEID('m', 'd', 'h', 'd')) //mdhd  media header
-					{
-						media_header md;
-						len = fread(&md, 1, sizeof(md), mp4->mediafp);
-						if (len == sizeof(md))
-						{
-							md.creation_time = BYTESWAP32(md.creation_time);
-							md.modification_time = BYTESWAP32(md.modification_time);
-							md.time_scale = BYTESWAP32(md.time_scale);
-							md.duration = BYTESWAP32(md.duration);
-
-							mp4->trak_clockdemon = md.time_scale;
-							mp4->trak_clockcount = md.duration;
-
-							if (mp4->videolength == 0.0) // Get the video length from the first track
-							{
-								mp4->videolength = (float)((double)mp4->trak_clockcount / (double)mp4->trak_clockdemon);
-							}
-						}
+				}
+			}
+		}
+		else if (qttag == MAKEID('s', 't', 's', 'z') && st->type == st->traktype && bodylen >= 12) // metadata stsz - sizes
+		{
+			uint32_t equalsamplesize = MemBE32(body + 4);
 
-						mp4->filepos += len;
-						LongSeek(mp4, qtsize - 8 - len); // skip over mvhd
+			num = MemBE32(body + 8);
+			// if equalsamplesize != 0, it is the size of all the samples and the length should be 20 (size,fourcc,flags,samplesize,samplecount)
+			if ((num <= ((bodylen - 12) / sizeof(uint32_t))) || (equalsamplesize != 0 && qtsize == 20))
+			{
+				mp4->metasize_count = num;
+				if (mp4->metasizes)
+				{
+					free(mp4->metasizes);
+					mp4->metasizes = 0;
+				}
+				if (num == 0)
+					return MOOV_PARSE_FAIL; //size of null
 
-						NESTSIZE(qtsize);
-					}
-					else if (qttag == MAKEID('h', 'd', 'l', 'r')) //hldr
-					{
-						uint32_t temp;
-						len = fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&temp, 1, 4, mp4->mediafp);  // type will be 'meta' for the correct trak.
+				mp4->metasizes = (uint32_t *)malloc(num * 4);
+				mp4->allocations++;
+				if (mp4->metasizes)
+				{
+					uint32_t i;
+					for (i = 0; i < num; i++)
+						mp4->metasizes[i] = equalsamplesize ? equalsamplesize : MemBE32(body + 12 + i * 4);
+				}
+			}
+		}
+		else if ((qttag == MAKEID('s', 't', 'c', 'o') || qttag == MAKEID('c', 'o', '6', '4')) && st->type == st->traktype && bodylen >= 8) // metadata stco/co64 - offsets
+		{
+			uint32_t entrysize = (qttag == MAKEID('c', 'o', '6', '4')) ? 8 : 4;
+			const uint8_t *entries = body + 8;
 
-						if (temp != MAKEID('a', 'l', 'i', 's') && temp != MAKEID('u', 'r', 'l', ' '))
-							type = temp;
+			num = MemBE32(body + 4);
+			if (num == 0)
+				return MOOV_PARSE_FAIL; //size of null
 
-						mp4->filepos += len;
-						LongSeek(mp4, qtsize - 8 - len); // skip over hldr
+			if (num <= ((bodylen - 8) / entrysize))
+			{
+				uint32_t count = num;
 
-						NESTSIZE(qtsize);
+				mp4->metastco_count = num;
+				if (mp4->metaoffsets)
+				{
+					free(mp4->metaoffsets);
+					mp4->metaoffsets = 0;
+				}
 
-					}
-					else if (qttag == MAKEID('e', 'd', 't', 's')) //edit list
+				if (mp4->metastsc_count > 0 && num != mp4->metasize_count && mp4->metasizes)
+				{
+					// Several samples per chunk, expand the chunk offsets into per sample offsets.
+					if (entrysize == 4)
 					{
-						uint32_t elst,temp,num,i;
-						len = fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&elst, 1, 4, mp4->mediafp);
-						if (elst == MAKEID('e', 'l', 's', 't'))
+						uint64_t fileoffset = 0;
+						uint32_t stsc_pos = 0, stco_pos = 0, repeat = 1;
+
+						mp4->metaoffsets = (uint64_t *)malloc(count * 8);
+						mp4->allocations++;
+						if (mp4->metaoffsets)
 						{
-							len += fread(&temp, 1, 4, mp4->mediafp);
-							if (temp == 0)
+							mp4->metaoffsets[0] = fileoffset = MemBE32(entries);
+							num = 1;
+							while (num < mp4->metastco_count)
 							{
-								len += fread(&num, 1, 4, mp4->mediafp);
-								num = BYTESWAP32(num);
-								if (num <= ((qtsize - 8 - len) / 12))
+								if (repeat == mp4->metastsc[stsc_pos].samples)
 								{
-									int32_t segment_duration; //integer that specifies the duration of this edit segment in units of the movies time scale.
-									int32_t segment_mediaTime; //integer containing the starting time within the media of this edit segment(in media timescale units).If this field is set to 1, it is an empty edit.The last edit in a track should never be an empty edit.Any difference between the movies duration and the tracks duration is expressed as an implicit empty edit.
-									int32_t segment_mediaRate; //point number that specifies the relative rate at which to play the media corresponding to this edit segment.This rate value cannot be 0 or negative.
-									for (i = 0; i < num; i++)
+									if (stco_pos + 1 < mp4->metastco_count)
 									{
-										len += fread(&segment_duration, 1, 4, mp4->mediafp);
-										len += fread(&segment_mediaTime, 1, 4, mp4->mediafp);
-										len += fread(&segment_mediaRate, 1, 4, mp4->mediafp);
-
-										segment_duration = BYTESWAP32(segment_duration);  // in MP4 clock base
-										segment_mediaTime = BYTESWAP32(segment_mediaTime); // in trak clock base
-										segment_mediaRate = BYTESWAP32(segment_mediaRate); // Fixed-point 65536 = 1.0X
-
-										if (segment_mediaTime == -1) // the segment_duration for blanked time
-											mp4->trak_edit_list_offsets[mp4->trak_num] += segment_duration;  //samples are delay, data starts after presentation time zero.
-										else if (i == 0) // If the first editlst starts after zero, the track is offset by this time (time before presentation time zero.)
-											mp4->trak_edit_list_offsets[mp4->trak_num] -= (int32_t)((double)segment_mediaTime/(double)mp4->trak_clockdemon*(double)mp4->clockdemon); //convert to MP4 clock base.
+										stco_pos++;
+										fileoffset = (uint64_t)MemBE32(entries + stco_pos * 4);
 									}
-									if (type == traktype) // GPMF metadata 
+									else
 									{
-										mp4->metadataoffset_clockcount = mp4->trak_edit_list_offsets[mp4->trak_num]; //leave in MP4 clock base
+										fileoffset += (uint64_t)mp4->metasizes[num - 1];
 									}
-								}
-							}
-						}
-						mp4->filepos += len;
-						LongSeek(mp4, qtsize - 8 - len); // skip over edts
+									if (stsc_pos + 1 < mp4->metastsc_count)
+										if (mp4->metastsc[stsc_pos + 1].chunk_num == stco_pos + 1)
+											stsc_pos++;
 
-						NESTSIZE(qtsize);
-					}
-					else if (qttag == MAKEID('s', 't', 's', 'd')) //read the sample decription to determine the type of metadata
-					{
-						if (type == traktype) //like meta
-						{
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&subtype, 1, 4, mp4->mediafp);  // type will be 'meta' for the correct trak.
-							if (len == 16)
-							{
-								if (subtype != traksubtype) // not MP4 metadata 
+									repeat = 1;
+								}
+								else
 								{
-									type = 0; // MP4
+									fileoffset += (uint64_t)mp4->metasizes[num - 1];
+									repeat++;
 								}
+
+								mp4->metaoffsets[num] = fileoffset;
+								num++;
 							}
-							mp4->filepos += len;
-							LongSeek(mp4, qtsize - 8 - len); // skip over stsd
 						}
-						else
-							LongSeek(mp4, qtsize - 8);
-
-						NESTSIZE(qtsize);
 					}
-					else if (qttag == MAKEID('s', 't', 's', 'c')) // metadata stsc - offset chunks
+					else if (mp4->metasize_count)
 					{
-						if (type == traktype) // meta
+						uint64_t fileoffset;
+						uint32_t stsc_pos = 0, stco_pos = 0;
+
+						mp4->metaoffsets = (uint64_t *)malloc(mp4->metasize_count * 8);
+						mp4->allocations++;
+						if (mp4->metaoffsets)
 						{
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
+							fileoffset = MemBE64(entries);
+							mp4->metaoffsets[0] = fileoffset;
 
-							num = BYTESWAP32(num);
-							if (num <= ((qtsize - 8 - len)/sizeof(SampleToChunk)))
+							num = 1;
+							while (num < mp4->metasize_count)
 							{
-								mp4->metastsc_count = num;
-								if (mp4->metastsc)
+								if (num != mp4->metastsc[stsc_pos].chunk_num - 1 && 0 == (num - (mp4->metastsc[stsc_pos].chunk_num - 1)) % mp4->metastsc[stsc_pos].samples && stco_pos + 1 < count)
 								{
-									free(mp4->metastsc);
-									mp4->metastsc = 0;
-								}
-								if (num > 0)
-								{
-									mp4->metastsc = (SampleToChunk *)malloc(num * sizeof(SampleToChunk));
-									if (mp4->metastsc)
-									{
-										len += fread(mp4->metastsc, 1, num * sizeof(SampleToChunk), mp4->mediafp);
-
-										do
-										{
-											num--;
-											mp4->metastsc[num].chunk_num = BYTESWAP32(mp4->metastsc[num].chunk_num);
-											mp4->metastsc[num].samples = BYTESWAP32(mp4->metastsc[num].samples);
-											mp4->metastsc[num].id = BYTESWAP32(mp4->metastsc[num].id);
-										} while (num > 0);
-									}
+									stco_pos++;
+									fileoffset = MemBE64(entries + stco_pos * 8);
 								}
 								else
 								{
-									//size of null
-									CloseSource((size_t)mp4);
-									mp4 = NULL;
-									break;
+									fileoffset += (uint64_t)mp4->metasizes[num - 1];
 								}
+
+								mp4->metaoffsets[num] = fileoffset;
+								num++;
 							}
-							mp4->filepos += len;
-							LongSeek(mp4, qtsize - 8 - len); // skip over stsx
 						}
-						else
-							LongSeek(mp4, qtsize - 8);
+					}
+					else
+						return MOOV_PARSE_FAIL;
 
-						NESTSIZE(qtsize);
+					if (mp4->metastsc) free(mp4->metastsc);
+					mp4->metastsc = NULL;
+					mp4->metastsc_count = 0;
+				}
+				else
+				{
+					// One sample per chunk, the chunk offsets are the sample offsets.
+					mp4->metaoffsets = (uint64_t *)malloc(count * 8);
+					mp4->allocations++;
+					if (mp4->metaoffsets)
+					{
+						uint32_t i;
+						for (i = 0; i < count; i++)
+							mp4->metaoffsets[i] = (entrysize == 8) ? MemBE64(entries + i * 8) : (uint64_t)MemBE32(entries + i * 4);
 					}
-					else if (qttag == MAKEID('s', 't', 's', 'z')) // metadata stsz - sizes
+				}
+			}
+		}
+		else if (qttag == MAKEID('s', 't', 't', 's') && bodylen >= 8) // time to samples
+		{
+			num = MemBE32(body + 4);
+			if (num <= ((bodylen - 8) / 8))
+			{
+				int32_t entries = num;
+				uint32_t samples = 0;
+				const uint8_t *entry = body + 8;
+
+				if (st->type == MAKEID('v', 'i', 'd', 'e')) // video trak to get frame rate
+				{
+					while (entries > 0)
 					{
-						if (type == traktype) // meta
-						{
-							uint32_t equalsamplesize;
+						int32_t samplecount = (int32_t)MemBE32(entry);
+						int32_t duration = (int32_t)MemBE32(entry + 4);
+						entry += 8;
 
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&equalsamplesize, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
+						samples += samplecount;
+						entries--;
 
-							num = BYTESWAP32(num);
-							// if equalsamplesize != 0, it is the size of all the samples and the length should be 20 (size,fourcc,flags,samplesize,samplecount)
-							if ((num <= ((qtsize - 8 - len)/sizeof(uint32_t))) || (equalsamplesize != 0 && qtsize == 20))
-							{
-								mp4->metasize_count = num;
-								if (mp4->metasizes)
-								{
-									free(mp4->metasizes);
-									mp4->metasizes = 0;
-								}
-								if(num > 0)
-								{
-									mp4->metasizes = (uint32_t *)malloc(num * 4);
-									if (mp4->metasizes)
-									{
-										if (equalsamplesize == 0)
-										{
-											len += fread(mp4->metasizes, 1, num * 4, mp4->mediafp);
-											do
-											{
-												num--;
-												mp4->metasizes[num] = BYTESWAP32(mp4->metasizes[num]);
-											} while (num > 0);
-										}
-										else
-										{
-											equalsamplesize = BYTESWAP32(equalsamplesize);
-											do
-											{
-												num--;
-												mp4->metasizes[num] = equalsamplesize;
-											} while (num > 0);
-										}
-									}
-								}
-								else
-								{
-									//size of null
-									CloseSource((size_t)mp4);
-									mp4 = NULL;
-									break;
-								}
-							}
-							mp4->filepos += len;
-							LongSeek(mp4, qtsize - 8 - len); // skip over stsz
+						if (mp4->video_framerate_numerator == 0)
+						{
+							mp4->video_framerate_numerator = mp4->trak_clockdemon;
+							mp4->video_framerate_denominator = duration;
 						}
-						else
-							LongSeek(mp4, qtsize - 8);
-
-						NESTSIZE(qtsize);
 					}
-					else if (qttag == MAKEID('s', 't', 'c', 'o')) // metadata stco - offsets
+					mp4->video_frames = samples;
+				}
+				else if (st->type == st->traktype) // meta 
+				{
+					mp4->meta_clockdemon = mp4->trak_clockdemon;
+					mp4->meta_clockcount = mp4->trak_clockcount;
+
+					while (entries > 0)
 					{
-						if (type == traktype) // meta
-						{
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
-							num = BYTESWAP32(num);
-							if (num <= ((qtsize - 8 - len)/sizeof(uint32_t)))
-							{
-								mp4->metastco_count = num;
+						int32_t samplecount = (int32_t)MemBE32(entry);
+						int32_t duration = (int32_t)MemBE32(entry + 4);
+						entry += 8;
 
-								if (mp4->metastsc_count > 0 && num != mp4->metasize_count)
-								{
-									if (mp4->metaoffsets)
-									{
-										free(mp4->metaoffsets);
-										mp4->metaoffsets = 0;
-									}
-									if(num > 0)
-									{
-										mp4->metaoffsets = (uint64_t *)malloc(num * 8);
-										if (mp4->metaoffsets)
-										{
-											uint32_t *metaoffsets32 = NULL;
-											metaoffsets32 = (uint32_t *)malloc(num * 4);
-											if (metaoffsets32)
-											{
-												uint64_t fileoffset = 0;
-												int stsc_pos = 0;
-												int stco_pos = 0;
-												int repeat = 1;
-												len += fread(metaoffsets32, 1, num * 4, mp4->mediafp);
-												do
-												{
-													num--;
-													metaoffsets32[num] = BYTESWAP32(metaoffsets32[num]);
-												} while (num > 0);
-
-												mp4->metaoffsets[0] = fileoffset = metaoffsets32[stco_pos];
-												num = 1;
-												while (num < mp4->metastco_count)
-												{
-													if ((uint32_t)repeat == mp4->metastsc[stsc_pos].samples)
-													{
-														if ((uint32_t)stco_pos + 1 < mp4->metastco_count)
-														{
-															stco_pos++;
-															fileoffset = (uint64_t)metaoffsets32[stco_pos];
-														}
-														else
-														{
-															fileoffset += (uint64_t)mp4->metasizes[num - 1];
-														}
-														if ((uint32_t)stsc_pos + 1 < mp4->metastsc_count)
-															if (mp4->metastsc[stsc_pos + 1].chunk_num == (uint32_t)stco_pos + 1)
-																stsc_pos++;
-
-														repeat = 1;
-													}
-													else
-													{
-														fileoffset += (uint64_t)mp4->metasizes[num - 1];
-														repeat++;
-													}
-
-													mp4->metaoffsets[num] = fileoffset;
-													//int delta = metaoffsets[num] - metaoffsets[num - 1];
-													//printf("%3d:%08x, delta = %08x\n", num, (int)fileoffset, delta);
-
-													num++;
-												}
-
-												if (mp4->metastsc) free(mp4->metastsc);
-												mp4->metastsc = NULL;
-												mp4->metastsc_count = 0;
-
-												free(metaoffsets32);
-											}
-										}
-									}
-									else
-									{
-										//size of null
-										CloseSource((size_t)mp4);
-										mp4 = NULL;
-										break;
-									}
-								}
-								else
-								{
-									if (mp4->metaoffsets)
-									{
-										free(mp4->metaoffsets);
-										mp4->metaoffsets = 0;
-									}
-									if (num > 0)
-									{
-										mp4->metaoffsets = (uint64_t *)malloc(num * 8);
-										if (mp4->metaoffsets)
-										{
-											uint32_t *metaoffsets32 = NULL;
-											metaoffsets32 = (uint32_t *)malloc(num * 4);
-											if (metaoffsets32)
-											{
-												size_t readlen = fread(metaoffsets32, 1, num * 4, mp4->mediafp);
-												len += readlen;
-												do
-												{
-													num--;
-													mp4->metaoffsets[num] = BYTESWAP32(metaoffsets32[num]);
-												} while (num > 0);
-
-												free(metaoffsets32);
-											}
-										}
-									}
-									else
-									{
-										//size of null
-										CloseSource((size_t)mp4);
-										mp4 = NULL;
-										break;
-									}
-								}
-							}
-							mp4->filepos += len;
-							LongSeek(mp4, qtsize - 8 - len); // skip over stco
-						}
-						else
-							LongSeek(mp4, qtsize - 8);
+						samples += samplecount;
+						entries--;
 
-						NESTSIZE(qtsize);
+						mp4->metadatalength += (double)((double)samplecount * (double)duration / (double)mp4->meta_clockdemon);
+						if (samplecount > 1 || entries == 1)
+							mp4->basemetadataduration = mp4->metadatalength * (double)mp4->meta_clockdemon / (double)samples;
 					}
+				}
+			}
+		}
 
-					else if (qttag == MAKEID('c', 'o', '6', '4')) // metadata stco - offsets
-					{
-						if (type == traktype) // meta
-						{
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
-							num = BYTESWAP32(num);
+		if (ret != MOOV_PARSE_OK)
+			return ret;
 
-							if(num == 0)
-							{
-								//size of null
-								CloseSource((size_t)mp4);
-								mp4 = NULL;
-								break;
-							}
+		pos += qtsize;
+	}
 
-							if (num <= ((qtsize - 8 - len)/sizeof(uint64_t)))
-							{
-								mp4->metastco_count = num;
+	return MOOV_PARSE_OK;
+}
 
-								if (mp4->metastsc_count > 0 && num != mp4->metasize_count)
-								{
-									if (mp4->metaoffsets)
-									{
-										free(mp4->metaoffsets);
-										mp4->metaoffsets = 0;
-									}
-									if (mp4->metasize_count)
-									{
-										mp4->metaoffsets = (uint64_t *)malloc(mp4->metasize_count * 8);
-										if (mp4->metaoffsets)
-										{
-											uint64_t *metaoffsets64 = NULL;
-											metaoffsets64 = (uint64_t *)malloc(num * 8);
-											if (metaoffsets64)
-											{
-												uint64_t fileoffset = 0;
-												int stsc_pos = 0;
-												int stco_pos = 0;
-												len += fread(metaoffsets64, 1, num * 8, mp4->mediafp);
-												do
-												{
-													num--;
-													metaoffsets64[num] = BYTESWAP64(metaoffsets64[num]);
-												} while (num > 0);
-
-												fileoffset = metaoffsets64[0];
-												mp4->metaoffsets[0] = fileoffset;
-												//printf("%3d:%08x, delta = %08x\n", 0, (int)fileoffset, 0);
-
-												num = 1;
-												while (num < mp4->metasize_count)
-												{
-													if (num != mp4->metastsc[stsc_pos].chunk_num - 1 && 0 == (num - (mp4->metastsc[stsc_pos].chunk_num - 1)) % mp4->metastsc[stsc_pos].samples)
-													{
-														stco_pos++;
-														fileoffset = (uint64_t)metaoffsets64[stco_pos];
-													}
-													else
-													{
-														fileoffset += (uint64_t)mp4->metasizes[num - 1];
-													}
-
-													mp4->metaoffsets[num] = fileoffset;
-													//int delta = metaoffsets[num] - metaoffsets[num - 1];
-													//printf("%3d:%08x, delta = %08x\n", num, (int)fileoffset, delta);
-
-													num++;
-												}
-
-												if (mp4->metastsc) free(mp4->metastsc);
-												mp4->metastsc = NULL;
-												mp4->metastsc_count = 0;
-
-												free(metaoffsets64);
-											}
-										}
-									}
-									else
-									{
-										//size of null
-										CloseSource((size_t)mp4);
-										mp4 = NULL;
-										break;
-									}
-								}
-								else
-								{
-									if (mp4->metaoffsets)
-									{
-										free(mp4->metaoffsets);
-										mp4->metaoffsets = 0;
-									}
-									mp4->metaoffsets = (uint64_t *)malloc(num * 8);
-									if (mp4->metaoffsets)
-									{
-										len += fread(mp4->metaoffsets, 1, num * 8, mp4->mediafp);
-										do
-										{
-											num--;
-											mp4->metaoffsets[num] = BYTESWAP64(mp4->metaoffsets[num]);
-										} while (num > 0);
-									}
-								}
-							}
-							mp4->filepos += len;
-							LongSeek(mp4, qtsize - 8 - len); // skip over stco
-						}
-						else
-							LongSeek(mp4, qtsize - 8);
+//
+// The moov is located by stepping over the top level atoms (one small read each,
+// normally just ftyp and mdat), then read whole into one buffer and decoded from
+// memory. Opening a clip costs a handful of I/Os however many traks and atoms it has.
+//
+size_t OpenMP4SourceEx(char *filename, uint32_t traktype, uint32_t traksubtype, uint32_t flags)
+{
+	mp4object *mp4 = (mp4object *)malloc(sizeof(mp4object));
+	if (mp4 == NULL) return 0;
 
-						NESTSIZE(qtsize);
-					}
-					else if (qttag == MAKEID('s', 't', 't', 's')) // time to samples
-					{
-						if (type == MAKEID('v', 'i', 'd', 'e')) // video trak to get frame rate
-						{
-							uint32_t totaldur = 0, samples = 0;
-							int32_t entries = 0;
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
-							num = BYTESWAP32(num);
-							if (num <= ((qtsize - 8 - len) / 8))
-							{
-								entries = num;
+	memset(mp4, 0, sizeof(mp4object));
+	mp4->allocations = 1;
+	mp4->buffers = &mp4->ownbuffers;
 
-								while (entries > 0)
-								{
-									int32_t samplecount;
-									int32_t duration;
-									len += fread(&samplecount, 1, 4, mp4->mediafp);
-									samplecount = BYTESWAP32(samplecount);
-									len += fread(&duration, 1, 4, mp4->mediafp);
-									duration = BYTESWAP32(duration);
+#ifdef _WINDOWS
+	struct _stat64 mp4stat;
+	_stat64(filename, &mp4stat);
+#else
+	struct stat mp4stat;
+	stat(filename, &mp4stat);
+#endif
+	mp4->filesize = mp4stat.st_size;
+//	printf("filesize = %ld\n", mp4->filesize);
+	if (mp4->filesize < 64) return 0;
 
-									samples += samplecount;
-									entries--;
+#ifdef _WINDOWS
+	fopen_s(&mp4->mediafp, filename, "rb");
+#else
+	mp4->mediafp = fopen(filename, "rb");
+#endif
 
-									if (mp4->video_framerate_numerator == 0)
-									{
-										mp4->video_framerate_numerator = mp4->trak_clockdemon;
-										mp4->video_framerate_denominator = duration;
-									}
-								}
-								mp4->video_frames = samples;
-							}
-							mp4->filepos += len;
-							LongSeek(mp4, qtsize - 8 - len); // skip over stco
-						}
-						else
-						if (type == traktype) // meta 
-						{
-							uint32_t totaldur = 0, samples = 0;
-							int32_t entries = 0;
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
-							num = BYTESWAP32(num);
-							if (num <= ((qtsize - 8 - len)/8))
-							{
-								entries = num;
+	if (mp4->mediafp)
+	{
+		uint8_t header[16];
+		uint64_t pos = 0, moovpos = 0, moovsize = 0;
+		uint8_t *moov = NULL;
+		moov_parse_state st;
+		int ret = MOOV_PARSE_FAIL;
 
-								mp4->meta_clockdemon = mp4->trak_clockdemon;
-								mp4->meta_clockcount = mp4->trak_clockcount;
+		while (pos + 8 <= mp4->filesize)
+		{
+			uint64_t qtsize, hdrsize = 8;
+			uint32_t qttag;
+			size_t len = ReadAt(mp4, pos, header, sizeof(header));
 
-								while (entries > 0)
-								{
-									int32_t samplecount;
-									int32_t duration;
-									len += fread(&samplecount, 1, 4, mp4->mediafp);
-									samplecount = BYTESWAP32(samplecount);
-									len += fread(&duration, 1, 4, mp4->mediafp);
-									duration = BYTESWAP32(duration);
-
-									samples += samplecount;
-									entries--;
-
-									totaldur += duration;
-									mp4->metadatalength += (double)((double)samplecount * (double)duration / (double)mp4->meta_clockdemon);
-									if (samplecount > 1 || entries == 1)
-										mp4->basemetadataduration = mp4->metadatalength * (double)mp4->meta_clockdemon / (double)samples;
-								}
-							}
-							mp4->filepos += len;
-							LongSeek(mp4, qtsize - 8 - len); // skip over stco
-						}
-						else
-							LongSeek(mp4, qtsize - 8);
+			if (len < 8)
+				break;
 
-						NESTSIZE(qtsize);
-					}
-					else
-					{
-						NESTSIZE(8);
-					}
-			}
-			else
-			{
+			qtsize = MemBE32(header);
+			qttag = MemTag(header + 4);
+
+			if ((pos == 0 && qttag != MAKEID('f', 't', 'y', 'p')) || !GPMF_VALID_FOURCC(qttag))
 				break;
-			}
-		} while (len > 0);
 
-		if (mp4)
-		{
-			if (mp4->metasizes == NULL || mp4->metaoffsets == NULL)
+			if (qtsize == 1) // 64-bit Atom
 			{
-				CloseSource((size_t)mp4);
-				mp4 = NULL;
+				if (len < 16)
+					break;
+				qtsize = MemBE64(header + 8);
+				hdrsize = 16;
 			}
-			
-			// set the numbers of payload with both size and offset
-			if (mp4 != NULL)
+
+			if (qtsize < hdrsize || qtsize > mp4->filesize - pos)  // not parser truncated files.
+				break;
+
+			if (qttag == MAKEID('m', 'o', 'o', 'v'))
 			{
-				mp4->indexcount = mp4->metasize_count;
-				if (mp4->metastco_count < mp4->indexcount)
-					mp4->indexcount = mp4->metastco_count;
+				moovpos = pos + hdrsize;
+				moovsize = qtsize - hdrsize;
+				break;
 			}
+
+			pos += qtsize;
+		}
+
+		if (moovsize > 0 && moovsize <= MOOV_MAX_SIZE)
+		{
+			moov = (uint8_t *)malloc((size_t)moovsize);
+			mp4->allocations++;
+		}
+
+		if (moov && ReadAt(mp4, moovpos, moov, (size_t)moovsize) == moovsize)
+		{
+			st.traktype = traktype;
+			st.traksubtype = traksubtype;
+			st.type = 0;
+
+			// The mvhd and the trak headers sit inside moov, so treat moov as the first container.
+			ret = ParseMoovAtoms(mp4, &st, moov, moovsize);
+		}
+		if (moov)
+			free(moov);
+
+		mp4->filepos = mp4->filesize;
+
+		if (ret == MOOV_PARSE_FAIL || mp4->metasizes == NULL || mp4->metaoffsets == NULL)
+		{
+			CloseSource((size_t)mp4);
+			mp4 = NULL;
+		}
+
+		// set the numbers of payload with both size and offset
+		if (mp4 != NULL)
+		{
+			mp4->indexcount = mp4->metasize_count;
+			if (mp4->metastco_count < mp4->indexcount)
+				mp4->indexcount = mp4->metastco_count;
+
+			SetPayloadReadGap((size_t)mp4, MP4_DEFAULT_READ_GAP, 0);
+
+			if (flags & MP4_SOURCE_FLAG_MMAP)
+				MapSource(mp4);
 		}
 	}
 	else
@@ -873,6 +1059,16 @@ void CloseSource(size_t handle)
 		return;
 	}
 
+#ifndef _WINDOWS
+	if (mp4->mapbase)
+	{
+		munmap(mp4->mapbase, (size_t)mp4->maplen);
+		mp4->mapbase = NULL;
+	}
+#endif
+	FreePayloadBuffers(&mp4->ownbuffers);	// attached buffers stay with their owner
+	if (mp4->readorder) free(mp4->readorder);
+	if (mp4->readrank) free(mp4->readrank);
 	if (mp4->mediafp)
 	{
 		fclose(mp4->mediafp);
@@ -974,6 +1170,8 @@ size_t OpenMP4SourceUDTA(char *filename)
 	if (mp4 == NULL) return 0;
 
 	memset(mp4, 0, sizeof(mp4object));
+	mp4->allocations = 1;
+	mp4->buffers = &mp4->ownbuffers;
 
 #ifdef _WINDOWS
 	struct _stat64 mp4stat;
@@ -1050,6 +1248,7 @@ size_t OpenMP4SourceUDTA(char *filename)
 
 					mp4->metasizes = (uint32_t *)malloc(mp4->indexcount * 4 + 4);  memset(mp4->metasizes, 0, mp4->indexcount * 4 + 4);
 					mp4->metaoffsets = (uint64_t *)malloc(mp4->indexcount * 8 + 8);  memset(mp4->metaoffsets, 0, mp4->indexcount * 8 + 8);
+					mp4->allocations += 2;
 
 					mp4->metasizes[0] = (int)qtsize - 8;
 					mp4->metaoffsets[0] = LONGTELL(mp4->mediafp);
@@ -1230,6 +1429,7 @@ double GetGPMFSampleRate(size_t handle, uint32_t fourcc, uint32_t flags, double
 					uint32_t payloadpos = 0, payloadcount = 0;
 					double slope, top = 0.0, bot = 0.0, meanX = 0, meanY = 0;
 					uint32_t *repeatarray = (uint32_t *)malloc(mp4->indexcount * 4 + 4);
+					mp4->allocations++;
 					memset(repeatarray, 0, mp4->indexcount * 4 + 4);
 
 					samples = 0;
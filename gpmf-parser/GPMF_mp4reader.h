@@ -48,6 +48,20 @@ typedef struct SampleToChunk
 	uint32_t id;
 } SampleToChunk;
 
+// Payload read buffers. A source has its own, or the caller can lend it a set with
+// AttachPayloadBuffers() so they survive CloseSource() and get reused by the next file.
+typedef struct mp4buffers
+{
+	uint32_t *viewbuffer;	// copy used by GetPayloadView() when a zero-copy view isn't possible
+	uint32_t viewbuffer_size;
+	uint8_t *batchbuffer;	// payloads from the last batch, packed and 32-bit aligned
+	uint64_t batchbuffer_size;
+	uint32_t *batchpos;		// byte position in batchbuffer of each payload in the batch
+	uint8_t *gapsink;		// scratch for the bytes between payloads in a batch
+	uint64_t gapsink_size;
+	uint32_t allocations;	// number of times any of the above was (re)allocated
+} mp4buffers;
+
 #define MAX_TRACKS	16
 typedef struct mp4object
 {
@@ -73,6 +87,19 @@ typedef struct mp4object
 	FILE *mediafp;
 	uint64_t filesize;
 	uint64_t filepos;
+	uint8_t *mapbase;		// whole file mapping when opened with MP4_SOURCE_FLAG_MMAP, else NULL
+	uint64_t maplen;
+	mp4buffers ownbuffers;
+	mp4buffers *buffers;	// &ownbuffers unless the caller attached its own
+	uint64_t readgap;		// payloads this close together are fetched by one preadv(), 0 disables batching
+	uint64_t readbatch_max;	// upper limit on the file span covered by one batch
+	uint32_t *readorder;	// payload indices sorted by file offset
+	uint32_t *readrank;		// inverse of readorder
+	uint32_t batchfirst;	// readorder[] rank of the first payload held in batchbuffer
+	uint32_t batchcount;
+	uint64_t bytesread;		// everything read from the file, gaps included - mapped payloads count as read when viewed
+	uint32_t readcalls;		// read syscalls it took
+	uint32_t allocations;	// malloc/realloc calls for this source - itself, moov, sample tables and buffer growth
 } mp4object;
 
 #define MAKEID(a,b,c,d)			(((d&0xff)<<24)|((c&0xff)<<16)|((b&0xff)<<8)|(a&0xff))
@@ -104,7 +131,10 @@ typedef struct mp4object
 						( (((a>>8)&0xff)>='a'&&((a>>24)&0xff)<='z') || (((a>>8)&0xff)>='A'&&((a>>8)&0xff)<='Z') || (((a>>8)&0xff)>='0'&&((a>>8)&0xff)<='9') || (((a>>8)&0xff)==' ') ) && \
 						( (((a>>0)&0xff)>='a'&&((a>>24)&0xff)<='z') || (((a>>0)&0xff)>='A'&&((a>>0)&0xff)<='Z') || (((a>>0)&0xff)>='0'&&((a>>0)&0xff)<='9') || (((a>>0)&0xff)==' ') )) 
 
+#define MP4_SOURCE_FLAG_MMAP		1	// memory map the source, payloads become zero-copy views (falls back to FILE* if mapping fails)
+
 size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t subtype);
+size_t OpenMP4SourceEx(char *filename, uint32_t traktype, uint32_t subtype, uint32_t flags);
 size_t OpenMP4SourceUDTA(char *filename);
 void CloseSource(size_t handle);
 float GetDuration(size_t handle);
@@ -112,7 +142,15 @@ uint32_t GetVideoFrameRateAndCount(size_t handle, uint32_t *numer, uint32_t *dem
 uint32_t GetNumberPayloads(size_t handle);
 uint32_t *GetPayload(size_t handle, uint32_t *lastpayload, uint32_t index);
 void FreePayload(uint32_t *lastpayload);
+uint32_t *GetPayloadView(size_t handle, uint32_t index); // read-only payload owned by the source, valid until the next call or CloseSource()
+uint32_t IsMappedSource(size_t handle);
+void AttachPayloadBuffers(size_t handle, mp4buffers *buffers); // caller keeps ownership - free with FreePayloadBuffers()
+void FreePayloadBuffers(mp4buffers *buffers);
+void SetPayloadReadGap(size_t handle, uint64_t gapbytes, uint64_t maxbatchbytes); // batching of GetPayloadView() reads on the FILE* path, maxbatchbytes 0 derives it from the gap
 uint32_t GetPayloadSize(size_t handle, uint32_t index);
+uint64_t GetBytesRead(size_t handle, uint32_t *readcalls); // I/O since the source was opened, moov included
+uint32_t GetAllocations(size_t handle); // C heap allocations made for the source since it was opened
+uint64_t GetSourceFileSize(size_t handle);
 uint32_t GetPayloadTime(size_t handle, uint32_t index, double *in, double *out); //MP4 timestamps for the payload
 uint32_t GetPayloadRationalTime(size_t handle, uint32_t index, int32_t *in_numerator, int32_t *out_numerator, uint32_t *denominator);
 uint32_t GetEditListOffset(size_t handle, double *offset);
@@ -0,0 +1,160 @@
+//
+// Purpose-built GPX track writer for the export hot path.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+
+#include <string.h>
+
+#include "gpxwriter.h"
+#include "fastformat.h"
+
+// Fragments exactly as XmlStream laid them out with indentation on.
+static const char GPX_HEADER[] =
+	"<?xml version=\"1.0\"?>\n"
+	"\n<gpx xmlns=\"http://www.topografix.com/GPX/1/1\" creator=\"goproWhereWhen\" version=\"1.1\""
+	" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
+	" xsi:schemaLocation=\"http://www.topografix.com/GPX/1/1 http://www.topografix.com/GPX/1/1/gpx.xsd\">"
+	"\n  <metadata>"
+	"\n    <link href=\"http://www.ridebdr.com\">"
+	"\n      <text>Robert Wolff - ADV Fan</text>"
+	"\n    </link>"
+	"\n    <time>";
+static const char GPX_HEADER_END[] = "</time>\n  </metadata>";
+static const char TRK_START[] = "\n  <trk>\n    <name>";
+static const char TRK_NAME_END[] = "</name>\n    <trkseg";
+static const char TRK_END_EMPTY[] = "/>\n  </trk>";
+static const char TRK_END[] = "\n    </trkseg>\n  </trk>";
+static const char PT_LAT[] = "\n      <trkpt lat=\"";
+static const char PT_LON[] = "\" lon=\"";
+static const char PT_ELE[] = "\">\n        <ele>";
+static const char PT_TIME[] = "</ele>\n        <time>";
+static const char PT_END[] = "</time>\n      </trkpt>";
+static const char GPX_END[] = "\n</gpx>";
+
+// sizeof() - 1 drops the terminator
+#define APPEND_LITERAL(p, lit)	(memcpy(p, lit, sizeof(lit) - 1), (p) + sizeof(lit) - 1)
+
+GPXWriter::GPXWriter() {
+	fp = NULL;
+	used = 0;
+	precision = 6;
+	bTrackHasPoints = false;
+	bOK = false;
+}
+
+GPXWriter::~GPXWriter() {
+	if (fp)
+		close();
+}
+
+bool GPXWriter::open(const char* fname) {
+	fp = fopen(fname, "wb");
+	if (!fp) {
+		std::cerr << "ERROR: Could not open output file: " << fname << std::endl;
+		return false;
+	}
+
+	buffer.resize(BUFFER_SIZE);
+	used = 0;
+	bOK = true;
+	return true;
+}
+
+void GPXWriter::flushBuffer() {
+	if (used && fp && fwrite(&buffer[0], 1, used, fp) != used)
+		bOK = false;
+	used = 0;
+}
+
+void GPXWriter::append(const char* text, size_t len) {
+	if (!fp)
+		return;
+
+	if (used + len > buffer.size()) {
+		flushBuffer();
+
+		// Bigger than the whole buffer - straight through.
+		if (len > buffer.size()) {
+			if (fp && fwrite(text, 1, len, fp) != len)
+				bOK = false;
+			return;
+		}
+	}
+
+	memcpy(&buffer[used], text, len);
+	used += len;
+}
+
+void GPXWriter::writeHeader(const TD &stamp) {
+	char text[FORMAT_DATETIME_LEN + 16];
+	char* end = formatDateTime(text, stamp.getEpochMs());
+
+	append(GPX_HEADER, sizeof(GPX_HEADER) - 1);
+	append(text, end - text);
+	append(GPX_HEADER_END, sizeof(GPX_HEADER_END) - 1);
+}
+
+void GPXWriter::beginTrack(const std::string &name) {
+	append(TRK_START, sizeof(TRK_START) - 1);
+	append(name.data(), name.size());
+	append(TRK_NAME_END, sizeof(TRK_NAME_END) - 1);
+	bTrackHasPoints = false;
+}
+
+void GPXWriter::writePoint(int64_t timeMs, double lat, double lon, double ele) {
+	char* p;
+
+	if (!fp)
+		return;
+
+	if (used + MAX_POINT_TEXT > buffer.size())
+		flushBuffer();
+
+	p = &buffer[used];
+
+	// The first point closes the <trkseg start tag.
+	if (!bTrackHasPoints) {
+		*p++ = '>';
+		bTrackHasPoints = true;
+	}
+
+	p = APPEND_LITERAL(p, PT_LAT);
+	p = formatSignificant(p, lat, precision);
+	p = APPEND_LITERAL(p, PT_LON);
+	p = formatSignificant(p, lon, precision);
+	p = APPEND_LITERAL(p, PT_ELE);
+	p = formatSignificant(p, ele, precision);
+	p = APPEND_LITERAL(p, PT_TIME);
+	p = formatDateTime(p, timeMs);
+	p = APPEND_LITERAL(p, PT_END);
+
+	used = p - &buffer[0];
+}
+
+//
+// An empty track self-closes its trkseg, same as XmlStream did.
+//
+void GPXWriter::endTrack() {
+	if (bTrackHasPoints)
+		append(TRK_END, sizeof(TRK_END) - 1);
+	else
+		append(TRK_END_EMPTY, sizeof(TRK_END_EMPTY) - 1);
+}
+
+bool GPXWriter::close() {
+	if (!fp)
+		return false;
+
+	append(GPX_END, sizeof(GPX_END) - 1);
+	flushBuffer();
+
+	if (fclose(fp) != 0)
+		bOK = false;
+	fp = NULL;
+
+	return bOK;
+}
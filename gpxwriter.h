@@ -0,0 +1,52 @@
+#ifndef _GPXWRITER_H
+#define _GPXWRITER_H
+//
+// Purpose-built GPX track writer for the export hot path.
+//
+// Emits byte for byte what the XmlStream based writer produced (same indentation, same
+// number formatting at the same precision) but from precomputed tag fragments into one
+// large buffer that goes out in big fwrite()s - no per-tag strings, no tag stack and no
+// std::endl flush per line.
+//
+// Usage: open(), writeHeader(), then beginTrack()/writePoint()*/endTrack() per track, close().
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "goprometa.h"
+
+class GPXWriter {
+public:
+	GPXWriter();
+	~GPXWriter();
+	bool open(const char* fname);
+	void setPrecision(int _precision) { precision = _precision; };	// Significant digits, as with iostream precision()
+	void writeHeader(const TD &stamp);
+	void beginTrack(const std::string &name);
+	void writePoint(int64_t timeMs, double lat, double lon, double ele);
+	void endTrack();
+	bool close();
+
+protected:
+	void append(const char* text, size_t len);
+	void flushBuffer();
+
+	// Room for one complete trkpt - flush before writing a point when less than this is left.
+	enum { BUFFER_SIZE = 1 << 20, MAX_POINT_TEXT = 512 };
+
+	FILE* fp;
+	std::vector<char> buffer;
+	size_t used;
+	int precision;
+	bool bTrackHasPoints;
+	bool bOK;
+};
+
+#endif
@@ -0,0 +1,245 @@
+//
+// Synthetic GoPro style MP4 files - see mp4synth.h
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mp4synth.h"
+#include "utctime.h"
+
+const uint32_t PAYLOAD_TICKS = 1001;	// Track timescale is 1000, so 1.001s a payload
+const uint32_t TRACK_TIMESCALE = 1000;
+
+SynthMP4Config::SynthMP4Config() {
+	payloads = 60;
+	gpsSamples = 18;
+	acclSamples = 200;
+	gyroSamples = 200;
+	paddingBytes = 0;
+	startMs = utc::toMillis(2020, 7, 4, 12, 34, 56, 0);
+	lat = 39.1234567;
+	lon = -105.1234567;
+	ele = 1600.0;
+	gpsFix = 3;
+	unlockedPayloads = 0;
+	seed = 1;
+}
+
+void gpmfAppendKLV(std::vector<uint8_t> &out, const char* key, char type, uint8_t structSize, uint16_t repeat, const uint8_t* data) {
+	size_t len = (size_t)structSize * repeat;
+
+	out.insert(out.end(), key, key + 4);
+	out.push_back((uint8_t)type);
+	out.push_back(structSize);
+	out.push_back(repeat >> 8);
+	out.push_back(repeat & 0xff);
+	if (data)
+		out.insert(out.end(), data, data + len);
+	while (out.size() % 4)
+		out.push_back(0);
+}
+
+void gpmfAppendBE32(std::vector<uint8_t> &out, uint32_t v) {
+	out.push_back(v >> 24);
+	out.push_back((v >> 16) & 0xff);
+	out.push_back((v >> 8) & 0xff);
+	out.push_back(v & 0xff);
+}
+
+//
+// An IMU stream of 'samples' int16 triples of noise, with the sticky keys a camera puts first.
+//
+static void appendNoiseStream(std::vector<uint8_t> &devc, const char* key, const char* name, uint16_t samples, uint32_t &rng) {
+	std::vector<uint8_t> strm, scal, tsmp, data;
+
+	gpmfAppendBE32(tsmp, samples);
+	gpmfAppendBE32(scal, 418);
+	data.reserve(samples * 6);
+	for (uint32_t i = 0; i < samples * 6u; i++) {
+		rng = rng * 1664525 + 1013904223;
+		data.push_back(rng >> 24);
+	}
+
+	gpmfAppendKLV(strm, "STNM", 'c', 1, strlen(name), (const uint8_t*)name);
+	gpmfAppendKLV(strm, "ORIN", 'c', 1, 3, (const uint8_t*)"ZXY");
+	gpmfAppendKLV(strm, "TSMP", 'L', 4, 1, tsmp.data());
+	gpmfAppendKLV(strm, "SCAL", 's', 2, 1, scal.data() + 2);
+	gpmfAppendKLV(strm, key, 's', 6, samples, data.data());
+	gpmfAppendKLV(devc, "STRM", 0, 4, strm.size() / 4, strm.data());
+}
+
+//
+// Payload 'index' of the clip described by 'cfg'. GPSU moves on 1.001s a payload and the
+// position about 10m north and 10m east every second.
+//
+void synthPayload(const SynthMP4Config &cfg, uint32_t index, std::vector<uint8_t> &out) {
+	const uint32_t scales[5] = { 10000000, 10000000, 1000, 1000, 100 };
+	const char* gpsName = "GPS (Lat., Long., Alt., 2D speed, 3D speed)";
+	std::vector<uint8_t> strm, devc, fix, precision, scal, gps5, dvid;
+	bool bUnlocked = index < cfg.unlockedPayloads;
+	int64_t ms = bUnlocked ? utc::toMillis(2000, 1, 1, 0, 0, 0, 0) : cfg.startMs + (int64_t)index * PAYLOAD_TICKS;
+	utc::Civil c = utc::fromMillis(ms);
+	uint32_t rng = cfg.seed * 2654435761u + index;
+	char gpsu[32];
+
+	snprintf(gpsu, sizeof(gpsu), "%02d%02d%02d%02d%02d%02d.%03d", c.year % 100, c.month, c.day,
+		c.hour, c.minute, c.second, c.millis);
+
+	gpmfAppendBE32(dvid, 1);
+	gpmfAppendBE32(fix, bUnlocked ? 0 : cfg.gpsFix);
+	precision.push_back(500 >> 8);
+	precision.push_back(500 & 0xff);
+	for (auto s: scales)
+		gpmfAppendBE32(scal, s);
+	for (uint32_t i = 0; i < cfg.gpsSamples; i++) {
+		double seconds = (index * PAYLOAD_TICKS + i * PAYLOAD_TICKS / cfg.gpsSamples) / 1000.0;
+
+		gpmfAppendBE32(gps5, (uint32_t)(int32_t)((cfg.lat + seconds * 0.00009) * 10000000.0));
+		gpmfAppendBE32(gps5, (uint32_t)(int32_t)((cfg.lon + seconds * 0.000116) * 10000000.0));
+		gpmfAppendBE32(gps5, (uint32_t)(int32_t)(cfg.ele * 1000.0));
+		gpmfAppendBE32(gps5, 14142);	// 14.142 m/s over ground
+		gpmfAppendBE32(gps5, 1414);		// 3D speed in cm/s
+	}
+
+	gpmfAppendKLV(strm, "STNM", 'c', 1, strlen(gpsName), (const uint8_t*)gpsName);
+	gpmfAppendKLV(strm, "GPSF", 'L', 4, 1, fix.data());
+	gpmfAppendKLV(strm, "GPSU", 'U', 16, 1, (const uint8_t*)gpsu);
+	gpmfAppendKLV(strm, "GPSP", 'S', 2, 1, precision.data());
+	gpmfAppendKLV(strm, "SCAL", 'L', 4, 5, scal.data());
+	gpmfAppendKLV(strm, "GPS5", 'l', 20, cfg.gpsSamples, gps5.data());
+
+	gpmfAppendKLV(devc, "DVID", 'L', 4, 1, dvid.data());
+	gpmfAppendKLV(devc, "DVNM", 'c', 1, 9, (const uint8_t*)"Synthetic");
+	if (cfg.acclSamples)
+		appendNoiseStream(devc, "ACCL", "Accelerometer", cfg.acclSamples, rng);
+	if (cfg.gyroSamples)
+		appendNoiseStream(devc, "GYRO", "Gyroscope", cfg.gyroSamples, rng);
+	gpmfAppendKLV(devc, "STRM", 0, 4, strm.size() / 4, strm.data());
+
+	out.clear();
+	gpmfAppendKLV(out, "DEVC", 0, 4, devc.size() / 4, devc.data());
+}
+
+//
+// MP4 atoms are built in memory (the moov is small) - except the mdat which is streamed.
+//
+static void put32(std::vector<uint8_t> &a, uint32_t v) { gpmfAppendBE32(a, v); }
+static void put16(std::vector<uint8_t> &a, uint16_t v) { a.push_back(v >> 8); a.push_back(v & 0xff); }
+static void putTag(std::vector<uint8_t> &a, const char* tag) { a.insert(a.end(), tag, tag + 4); }
+static void putZeros(std::vector<uint8_t> &a, size_t n) { a.insert(a.end(), n, 0); }
+
+static void atom(std::vector<uint8_t> &out, const char* tag, const std::vector<uint8_t> &body) {
+	put32(out, 8 + body.size());
+	putTag(out, tag);
+	out.insert(out.end(), body.begin(), body.end());
+}
+
+static void buildMoov(const SynthMP4Config &cfg, const std::vector<uint32_t> &sizes,
+		const std::vector<uint64_t> &offsets, std::vector<uint8_t> &moov) {
+	std::vector<uint8_t> mvhd, tkhd, mdhd, hdlr, stsd, stts, stsc, stsz, stco, stbl, minf, mdia, trak, body;
+	uint32_t duration = cfg.payloads * PAYLOAD_TICKS;
+	bool bLarge = !offsets.empty() && offsets.back() + sizes.back() > UINT32_MAX;
+
+	put32(mvhd, 0); put32(mvhd, 0); put32(mvhd, 0);
+	put32(mvhd, TRACK_TIMESCALE); put32(mvhd, duration);
+	put32(mvhd, 0x00010000); put16(mvhd, 0x0100); putZeros(mvhd, 10);
+	put32(mvhd, 0x00010000); putZeros(mvhd, 12); put32(mvhd, 0x00010000); putZeros(mvhd, 12); put32(mvhd, 0x40000000);
+	putZeros(mvhd, 24); put32(mvhd, 2);
+
+	put32(tkhd, 7); put32(tkhd, 0); put32(tkhd, 0); put32(tkhd, 1); put32(tkhd, 0); put32(tkhd, duration);
+	putZeros(tkhd, 16);
+	put32(tkhd, 0x00010000); putZeros(tkhd, 12); put32(tkhd, 0x00010000); putZeros(tkhd, 12); put32(tkhd, 0x40000000);
+	put32(tkhd, 0); put32(tkhd, 0);
+
+	put32(mdhd, 0); put32(mdhd, 0); put32(mdhd, 0);
+	put32(mdhd, TRACK_TIMESCALE); put32(mdhd, duration);
+	put16(mdhd, 0x55c4); put16(mdhd, 0);
+
+	put32(hdlr, 0); putTag(hdlr, "mhlr"); putTag(hdlr, "meta"); putZeros(hdlr, 12);
+	hdlr.push_back(9); putTag(hdlr, "GoPr"); putTag(hdlr, "o ME"); hdlr.push_back('T');
+
+	put32(stsd, 0); put32(stsd, 1);
+	put32(stsd, 20); putTag(stsd, "gpmd"); putZeros(stsd, 6); put16(stsd, 1); put32(stsd, 0);
+
+	put32(stts, 0); put32(stts, 1); put32(stts, cfg.payloads); put32(stts, PAYLOAD_TICKS);
+
+	put32(stsc, 0); put32(stsc, 1); put32(stsc, 1); put32(stsc, 1); put32(stsc, 1);
+
+	put32(stsz, 0); put32(stsz, 0); put32(stsz, sizes.size());
+	for (auto s: sizes)
+		put32(stsz, s);
+
+	put32(stco, 0); put32(stco, offsets.size());
+	for (auto o: offsets) {
+		if (bLarge)
+			put32(stco, o >> 32);
+		put32(stco, (uint32_t)o);
+	}
+
+	atom(stbl, "stsd", stsd);
+	atom(stbl, "stts", stts);
+	atom(stbl, "stsc", stsc);
+	atom(stbl, "stsz", stsz);
+	atom(stbl, bLarge ? "co64" : "stco", stco);
+	atom(minf, "stbl", stbl);
+	atom(mdia, "mdhd", mdhd);
+	atom(mdia, "hdlr", hdlr);
+	atom(mdia, "minf", minf);
+	atom(trak, "tkhd", tkhd);
+	atom(trak, "mdia", mdia);
+	atom(body, "mvhd", mvhd);
+	atom(body, "trak", trak);
+	atom(moov, "moov", body);
+}
+
+bool writeSynthMP4(const char* fname, const SynthMP4Config &cfg) {
+	std::vector<uint8_t> ftyp, header, payload, moov, zeros(cfg.paddingBytes < 1048576 ? cfg.paddingBytes : 1048576, 0);
+	std::vector<uint32_t> sizes;
+	std::vector<uint64_t> offsets;
+	uint64_t pos, mdatSize = 16;
+	FILE* fp;
+	bool bOK = true;
+
+	if (cfg.payloads == 0 || (fp = fopen(fname, "wb")) == NULL)
+		return false;
+
+	putTag(ftyp, "mp41"); put32(ftyp, 0x20130207); putTag(ftyp, "mp41");
+	atom(header, "ftyp", ftyp);
+
+	// The mdat size isn't known until the end - it's always written as a 64 bit atom.
+	put32(header, 1); putTag(header, "mdat"); put32(header, 0); put32(header, 0);
+	bOK = fwrite(header.data(), 1, header.size(), fp) == header.size();
+	pos = header.size();
+
+	for (uint32_t i = 0; i < cfg.payloads && bOK; i++) {
+		for (uint64_t left = cfg.paddingBytes; left && bOK; ) {
+			size_t n = left < zeros.size() ? left : zeros.size();
+
+			bOK = fwrite(zeros.data(), 1, n, fp) == n;
+			left -= n;
+		}
+		pos += cfg.paddingBytes;
+		mdatSize += cfg.paddingBytes;
+
+		synthPayload(cfg, i, payload);
+		offsets.push_back(pos);
+		sizes.push_back(payload.size());
+		bOK = bOK && fwrite(payload.data(), 1, payload.size(), fp) == payload.size();
+		pos += payload.size();
+		mdatSize += payload.size();
+	}
+
+	buildMoov(cfg, sizes, offsets, moov);
+	bOK = bOK && fwrite(moov.data(), 1, moov.size(), fp) == moov.size();
+
+	header.clear();
+	put32(header, mdatSize >> 32);
+	put32(header, (uint32_t)mdatSize);
+	bOK = bOK && fseek(fp, 8 + ftyp.size() + 8, SEEK_SET) == 0 && fwrite(header.data(), 1, 8, fp) == 8;
+
+	return fclose(fp) == 0 && bOK;
+}
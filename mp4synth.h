@@ -0,0 +1,45 @@
+#ifndef _MP4SYNTH_H
+#define _MP4SYNTH_H
+//
+// Synthetic GoPro style MP4 files for the unit tests and the benchmark - no camera footage
+// needed. A file has one GPMF 'meta' track with a payload every 1.001s, each a DEVC holding
+//   STRM ACCL  (optional, random int16 triples)
+//   STRM GYRO  (optional, random int16 triples)
+//   STRM GPS   GPSF, GPSU, GPSP, SCAL, GPS5
+// in the order HERO cameras write them. 'paddingBytes' of zeros go in front of every
+// payload in the mdat as a stand-in for the video and audio a real file interleaves.
+//
+// The moov is just enough for GPMF_mp4reader: mvhd and one trak with mdhd, hdlr 'meta',
+// stsd 'gpmd' and the stts/stsc/stsz/stco (co64 past 4GB) sample tables.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+struct SynthMP4Config {
+	SynthMP4Config();
+	uint32_t payloads;			// Clip length in payloads (1.001s each)
+	uint16_t gpsSamples;		// GPS5 samples per payload
+	uint16_t acclSamples;		// 0 leaves the ACCL stream out
+	uint16_t gyroSamples;		// 0 leaves the GYRO stream out
+	uint64_t paddingBytes;		// Zeros in front of each payload in the mdat
+	int64_t startMs;			// GPSU of the first payload
+	double lat, lon, ele;		// Where the track starts - it heads north east from there
+	uint32_t gpsFix;			// GPSF of every payload (0 = no lock, 3 = 3D)
+	uint32_t unlockedPayloads;	// The first few have no lock and a GPSU stuck at 2000-01-01 instead
+	uint32_t seed;				// For the ACCL/GYRO noise
+};
+
+// KLV building blocks, big endian like GPMF itself. 'out' is kept 32 bit aligned.
+void gpmfAppendKLV(std::vector<uint8_t> &out, const char* key, char type, uint8_t structSize, uint16_t repeat, const uint8_t* data);
+void gpmfAppendBE32(std::vector<uint8_t> &out, uint32_t v);
+
+void synthPayload(const SynthMP4Config &cfg, uint32_t index, std::vector<uint8_t> &out);
+bool writeSynthMP4(const char* fname, const SynthMP4Config &cfg);
+
+#endif
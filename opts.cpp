@@ -6,6 +6,7 @@
 //
 
 #include "opts.h"
+#include "utctime.h"
 
 opts::opts() {
 		logFileName="";
@@ -15,6 +16,26 @@ opts::opts() {
 		fileExtList.clear();
 		inFile="";
 		timeBetweenSamples = 5;
+		jobs = 1;
+		walkJobs = 0;
+		useMemoryMap = false;
+		streaming = false;
+		dryRun = false;
+		stats = false;
+		statsJSON = false;
+		nearQuery = false;
+		nearLat = nearLon = nearRadius = 0.0;
+		timeQuery = false;
+		queryFromMs = queryToMs = 0;
+		readGap = -1;
+		cacheDir="";
+		minLockState = 1;
+		maxPrecision = 1000;
+		exportGPX = false;
+		exportCSV = false;
+		exportArrow = false;
+		arrowFile = "samples.arrows";
+		csvColumns="";
 	};
 
 opts::~opts() {};
@@ -29,6 +50,55 @@ bool opts::expandPath(const char* inPath, std::string &expandedPath) {
   return status==0;
 }
 
+//
+// Accepts a plain byte count or one with a K/M/G suffix (ie 512K, 16M)
+//
+bool opts::parseByteCount(const char* in, int64_t &bytes) {
+  char* end;
+  long long val = strtoll(in, &end, 10);
+
+  if (end == in || val < 0)
+  	return false;
+
+  switch (*end) {
+  	case 'g': case 'G': val *= 1024;
+  	// fall through
+  	case 'm': case 'M': val *= 1024;
+  	// fall through
+  	case 'k': case 'K': val *= 1024;
+  		end++;
+  		break;
+  	default:
+  		break;
+  }
+
+  bytes = val;
+  return *end == '\0';
+}
+
+//
+// lat,lon,radius - decimal degrees and meters (ie 45.5231,-122.6765,250)
+//
+bool opts::parseNear(const char* in, double &lat, double &lon, double &radius) {
+  char* end;
+
+  lat = strtod(in, &end);
+  if (end == in || *end != ',')
+  	return false;
+  in = end + 1;
+
+  lon = strtod(in, &end);
+  if (end == in || *end != ',')
+  	return false;
+  in = end + 1;
+
+  radius = strtod(in, &end);
+  if (end == in || *end != '\0')
+  	return false;
+
+  return lat >= -90.0 && lat <= 90.0 && lon >= -180.0 && lon <= 180.0 && radius >= 0.0;
+}
+
 void opts::processOpts(int argc, const char** argv) {
 	    struct getopt args( argc, argv );
 
@@ -76,6 +146,123 @@ void opts::processOpts(int argc, const char** argv) {
 	    	timeBetweenSamples = (unsigned int)atoi( args["--timebetweensamples"].c_str() );
 	    }
 
+	    if (args.has("--jobs")) {
+	    	// 0 means one worker per core.
+	    	jobs = (unsigned int)atoi( args["--jobs"].c_str() );
+	    }
+
+	    if (args.has("--walkjobs")) {
+	    	// 0 picks a default from the core count.
+	    	walkJobs = (unsigned int)atoi( args["--walkjobs"].c_str() );
+	    }
+
+	    if( args.has("--mmap") ) {
+	        useMemoryMap=true;
+	    }
+
+	    if( args.has("--stream") ) {
+	        streaming=true;
+	    }
+
+	    if( args.has("--dryrun") ) {
+	        dryRun=true;
+	    }
+
+	    if( args.has("--stats") ) {
+	        stats=true;
+	        statsJSON = args["--stats"] == "json";
+	    }
+
+	    if( args.has("--readgap") ) {
+	    	if (!parseByteCount(args["--readgap"].c_str(), readGap)) {
+	    		std::cout << "ERROR: --readgap expects a byte count such as 65536, 512K or 16M" << std::endl;
+	    		exit(-6);
+	    	}
+	    }
+
+	    if( args.has("--cachedir") ) {
+	    	if (!expandPath(args["--cachedir"].c_str(), cacheDir)) {
+	    		std::cout << "ERROR: Expansion of path failed: " << args["--cachedir"] << std::endl;
+	    		exit(-7);
+	    	}
+	    }
+
+	    if (args.has("--minlock")) {
+	    	minLockState = (unsigned int)atoi( args["--minlock"].c_str() );
+	    }
+
+	    if (args.has("--maxprecision")) {
+	    	maxPrecision = (unsigned int)atoi( args["--maxprecision"].c_str() );
+	    }
+
+	    if( args.has("--exportgpx") ) {
+	        exportGPX=true;
+	    }
+
+	    if( args.has("--exportcsv") ) {
+	        exportCSV=true;
+	    }
+
+	    if( args.has("--csvcolumns") ) {
+	        csvColumns = args["--csvcolumns"];
+	    }
+
+	    if( args.has("--exportarrow") ) {
+	        exportArrow=true;
+	    }
+
+	    if( args.has("--arrowfile") ) {
+	        arrowFile = args["--arrowfile"];
+	    }
+
+	    if( args.has("--near") ) {
+	    	if (!parseNear(args["--near"].c_str(), nearLat, nearLon, nearRadius)) {
+	    		std::cout << "ERROR: --near expects lat,lon,radius in decimal degrees and meters - for example: --near=45.5231,-122.6765,250" << std::endl;
+	    		exit(-10);
+	    	}
+	    	nearQuery = true;
+	    }
+
+	    if( args.has("--at") ) {
+	    	if (!utc::parseDateTime(args["--at"].c_str(), queryFromMs)) {
+	    		std::cout << "ERROR: --at expects a UTC time as YYYY-MM-DDTHH:MM[:SS] - for example: --at=2020-07-04T14:32" << std::endl;
+	    		exit(-12);
+	    	}
+	    	queryToMs = queryFromMs;
+	    	timeQuery = true;
+	    }
+
+	    if( args.has("--between") ) {
+	    	std::string range = args["--between"];
+	    	size_t comma = range.find(',');
+
+	    	if (comma == std::string::npos || !utc::parseDateTime(range.substr(0, comma).c_str(), queryFromMs)
+	    			|| !utc::parseDateTime(range.substr(comma + 1).c_str(), queryToMs) || queryToMs < queryFromMs) {
+	    		std::cout << "ERROR: --between expects two UTC times, earliest first - for example: --between=2020-07-04T14:00,2020-07-04T15:30" << std::endl;
+	    		exit(-12);
+	    	}
+	    	timeQuery = true;
+	    }
+
+	    if( args.has("--at") + args.has("--between") + nearQuery > 1 ) {
+	        std::cout << "ERROR: Only one of --near, --at and --between can be given" << std::endl;
+	        exit(-13);
+	    }
+
+	    if( (nearQuery || timeQuery) && args.has("--stream") ) {
+	        std::cout << "ERROR: --near, --at and --between look through every sample at the end and can't be used with --stream" << std::endl;
+	        exit(-11);
+	    }
+
+	    if( exportArrow && args.has("--stream") ) {
+	        std::cout << "ERROR: --exportarrow needs every sample at the end and can't be used with --stream" << std::endl;
+	        exit(-9);
+	    }
+
+	    // GPX is what you get when no export is asked for.
+	    if (!exportGPX && !exportCSV && !exportArrow)
+	    	exportGPX = true;
+
 	    if( args.has("--recursive") ) {
 	        sourceDirRecursive=true;
 	    }
@@ -90,6 +277,24 @@ void opts::showHelp() {
 			<< " --fileext=extlist [no '*' or '.' ... just extensions separated by commas (ie mp4,mov,mpeg)]" << std::endl
 			<< " --infile=filename [process a singular input file - mutually exclusive from --sourcedir and --fileext]" << std::endl
 			<< " --recursive : Process sourcedir and all directories under it. (default: false)" << std::endl
+			<< " --jobs=N : Extract N files in parallel. 0 uses one worker per core. (default: 1)" << std::endl
+			<< " --walkjobs=N : Scan sourcedir with N threads. 0 picks one based on core count. (default: 0)" << std::endl
+			<< " --mmap : Memory map source files and parse GPMF payloads in place. (default: false)" << std::endl
+			<< " --readgap=bytes : Merge payload reads separated by less than this into one read, 0 disables. One read spans up to 16 gaps (at least 8M). (default: 64K)" << std::endl
+			<< " --stream : Order files by start time and write each day's GPX as soon as it is complete. (default: false)" << std::endl
+			<< " --dryrun : Only list each file's start/end time, duration, payloads, first/last location and day. Nothing is written." << std::endl
+			<< " --near=lat,lon,radius : Instead of exporting, list the files with samples within radius meters of lat,lon and when they were there." << std::endl
+			<< " --at=time : Instead of exporting, list the files whose GPS track covers this UTC time (YYYY-MM-DDTHH:MM[:SS]), how far into each and where." << std::endl
+			<< " --between=from,to : Like --at for every file with GPS time between two UTC times." << std::endl
+			<< " --stats[=json] : Print per stage timings, bytes read, payload/KLV/sample and allocation counts per file and for the run to stderr." << std::endl
+			<< " --cachedir=<directory> : Keep extracted samples here and reuse them for unchanged files. (default: no cache)" << std::endl
+			<< " --minlock=N : Skip samples with a GPS fix below N (2=2D, 3=3D). (default: 1)" << std::endl
+			<< " --maxprecision=N : Skip samples whose GPS precision (DOP x 100) is above N. (default: 1000)" << std::endl
+			<< " --exportgpx : Write a <date>.gpx file per day. (default unless another export is given)" << std::endl
+			<< " --exportcsv : Write a <date>.csv file per day. Both may be given." << std::endl
+			<< " --exportarrow : Write every sample to one Arrow IPC stream file for pandas/DuckDB/polars. Not with --stream." << std::endl
+			<< " --arrowfile=filename : Where --exportarrow writes. (default: samples.arrows)" << std::endl
+			<< " --csvcolumns=list : CSV columns from time,lat,lon,ele,file,payload,media in the order wanted. (default: time,lat,lon,ele,file)" << std::endl
 			<< std::endl;
 	};
 
@@ -6,6 +6,7 @@
 #include <vector>
 
 #include <wordexp.h>
+#include <stdint.h>
 
 #include "getopt/getopt.hpp"
 
@@ -25,6 +26,8 @@ public:
 	void processOpts(int argc, const char** argv);
 	void showHelp();
 	bool expandPath(const char* inPath, std::string &expandedPath);
+	bool parseByteCount(const char* in, int64_t &bytes);
+	bool parseNear(const char* in, double &lat, double &lon, double &radius);
 
 	// Flags and option values
 	std::string logFileName;
@@ -34,6 +37,26 @@ public:
 	std::string fileExtRaw;
 	std::string inFile;
 	unsigned int timeBetweenSamples;
+	unsigned int jobs;
+	unsigned int walkJobs;
+	bool useMemoryMap;
+	bool streaming;
+	bool dryRun;
+	bool stats;
+	bool statsJSON;			// --stats=json
+	bool nearQuery;			// --near=lat,lon,radius
+	double nearLat, nearLon, nearRadius;	// Degrees and meters
+	bool timeQuery;			// --at=time or --between=from,to
+	int64_t queryFromMs, queryToMs;		// UTC, the same for --at
+	int64_t readGap;			// -1 leaves the reader default in place
+	std::string cacheDir;		// empty disables the sample cache
+	unsigned int minLockState;
+	unsigned int maxPrecision;
+	bool exportGPX;
+	bool exportCSV;
+	bool exportArrow;
+	std::string arrowFile;
+	std::string csvColumns;		// empty uses the CSVWriter defaults
 
 };
 #endif
@@ -0,0 +1,186 @@
+//
+// Live progress for long batch runs.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <sstream>
+#include <iomanip>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "progress.h"
+#include "stats.h"
+
+const int64_t NS_PER_MS = 1000000;
+
+ProgressReporter::ProgressReporter(std::ostream &_status, std::ostream &_out, bool _bTerminal) :
+	status(_status), out(_out), bTerminal(_bTerminal) {
+	start(0);
+}
+
+ProgressReporter::ProgressReporter() :
+	status(std::cerr), out(std::cout), bTerminal(isatty(fileno(stderr))) {
+	start(0);
+}
+
+void ProgressReporter::start(size_t _totalFiles) {
+	totalFiles = _totalFiles;
+	files = 0;
+	payloads = 0;
+	bytes = 0;
+	startNs = statsNowNs();
+	lastUpdateNs = startNs;
+	lastLogNs = startNs;
+	statusWidth = 0;
+	pending.clear();
+}
+
+void ProgressReporter::fileDone(uint64_t payloadsRead, uint64_t bytesRead) {
+	payloads += payloadsRead;
+	bytes += bytesRead;
+	files++;
+	update(false);
+}
+
+void ProgressReporter::print(const std::string &text) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		pending += text;
+	}
+	update(false);
+}
+
+//
+// Anything printed before it goes out first so the two streams stay in order.
+//
+void ProgressReporter::error(const std::string &text) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	clearStatus();
+	if (!pending.empty()) {
+		out << pending << std::flush;
+		pending.clear();
+	}
+	status << text;
+}
+
+void ProgressReporter::finish() {
+	update(true);
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (bTerminal && statusWidth) {
+		status << '\n';
+		statusWidth = 0;
+	}
+}
+
+static std::string formatDuration(double seconds) {
+	std::ostringstream os;
+	long s = (long)(seconds + 0.5);
+
+	if (s >= 3600)
+		os << s / 3600 << ":" << std::setw(2) << std::setfill('0') << (s / 60) % 60;
+	else
+		os << s / 60;
+	os << ":" << std::setw(2) << std::setfill('0') << s % 60;
+
+	return os.str();
+}
+
+std::string ProgressReporter::statusLine() {
+	std::ostringstream os;
+	double elapsed = (statsNowNs() - startNs) / 1e9;
+	uint64_t done = files;
+
+	os << std::fixed << done << "/" << totalFiles << " files";
+	if (elapsed > 0.0)
+		os << std::setprecision(1) << ", " << done / elapsed << " files/s, "
+			<< std::setprecision(0) << payloads / elapsed << " payloads/s, "
+			<< std::setprecision(1) << bytes / 1e6 / elapsed << " MB/s";
+	os << ", elapsed " << formatDuration(elapsed);
+
+	if (done && done < totalFiles)
+		os << ", ETA " << formatDuration(elapsed * (totalFiles - done) / done);
+
+	return os.str();
+}
+
+//
+// Needs 'lock'. Blanks the status line so other output starts on a clean one.
+//
+void ProgressReporter::clearStatus() {
+	if (bTerminal && statusWidth) {
+		status << '\r' + std::string(statusWidth, ' ') + '\r';
+		statusWidth = 0;
+	}
+}
+
+//
+// Rate limited - between redraws this is a clock read. A worker that finds another one
+// already redrawing just carries on.
+//
+void ProgressReporter::update(bool bForce) {
+	int64_t now = statsNowNs();
+
+	if (!bForce && now - lastUpdateNs < REDRAW_MS * NS_PER_MS)
+		return;
+
+	std::unique_lock<std::mutex> guard(lock, std::defer_lock);
+	if (bForce)
+		guard.lock();
+	else if (!guard.try_lock())
+		return;
+
+	lastUpdateNs = now;
+
+	if (!pending.empty()) {
+		clearStatus();
+		out << pending << std::flush;
+		pending.clear();
+	}
+
+	std::string line = statusLine();
+
+	if (bTerminal) {
+		// One write for the whole line - std::cerr doesn't buffer.
+		std::string draw = '\r' + line;
+		if (line.size() < statusWidth)
+			draw += std::string(statusWidth - line.size(), ' ');
+		status << draw << std::flush;
+		statusWidth = line.size();
+	}
+	else if (bForce || now - lastLogNs >= LOG_INTERVAL_MS * NS_PER_MS) {
+		status << line + '\n' << std::flush;
+		lastLogNs = now;
+	}
+}
+
+void unittest_Progress() {
+	std::ostringstream status, out;
+	ProgressReporter progress(status, out, false);
+	bool bOK;
+
+	progress.start(4);
+	progress.print("a.MP4: 10 points\n");
+	progress.fileDone(100, 1000000);
+	progress.print("b.MP4: 20 points\n");
+	progress.fileDone(50, 500000);
+
+	// Held until a redraw - none is due yet.
+	bOK = out.str().empty() && status.str().empty()
+		&& progress.statusLine().find("2/4 files") == 0 && progress.statusLine().find("ETA") != std::string::npos;
+
+	progress.error("ERROR: c.MP4\n");
+	bOK = bOK && out.str() == "a.MP4: 10 points\nb.MP4: 20 points\n" && status.str() == "ERROR: c.MP4\n";
+
+	progress.fileDone(0, 0);
+	progress.fileDone(0, 0);
+	progress.finish();
+	bOK = bOK && status.str().find("ERROR: c.MP4\n4/4 files, ") == 0 && status.str().find("ETA") == std::string::npos
+		&& status.str().back() == '\n';
+
+	std::cout << "Checking progress reporter: " << (bOK ? "PASSED." : "FAILED.") << std::endl;
+}
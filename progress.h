@@ -0,0 +1,55 @@
+#ifndef _PROGRESS_H
+#define _PROGRESS_H
+//
+// Live progress for long batch runs: files done out of the total, files/s, payloads/s,
+// MB/s actually read, elapsed time and an ETA on one status line.
+//
+// Workers report each finished file from whatever thread they run on. The status line is
+// redrawn at most every REDRAW_MS (in place with '\r' on a terminal, as a plain line every
+// LOG_INTERVAL_MS otherwise), and the per-file summaries handed to print() are held and
+// written out with the next redraw - so the extraction never waits on a flushing console.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <string>
+#include <mutex>
+#include <atomic>
+
+#include <stdint.h>
+
+class ProgressReporter {
+public:
+	ProgressReporter(std::ostream &_status, std::ostream &_out, bool _bTerminal);
+	ProgressReporter();		// std::cerr/std::cout, in place redraws if stderr is a terminal
+	void start(size_t _totalFiles);
+	void fileDone(uint64_t payloadsRead, uint64_t bytesRead);	// Any thread
+	void print(const std::string &text);	// For 'out', written with the next redraw
+	void error(const std::string &text);	// For 'status', written right away
+	void finish();
+	std::string statusLine();
+
+protected:
+	void update(bool bForce);
+	void clearStatus();		// Needs 'lock'
+
+	enum { REDRAW_MS = 250, LOG_INTERVAL_MS = 10000 };
+
+	std::ostream &status;
+	std::ostream &out;
+	bool bTerminal;
+	size_t totalFiles;
+	std::atomic<uint64_t> files;
+	std::atomic<uint64_t> payloads;
+	std::atomic<uint64_t> bytes;
+	std::atomic<int64_t> lastUpdateNs;
+	int64_t startNs;
+	int64_t lastLogNs;
+	size_t statusWidth;		// What's on the terminal's status line right now
+	std::string pending;
+	std::mutex lock;
+};
+
+#endif
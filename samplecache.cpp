@@ -0,0 +1,250 @@
+//
+// On-disk cache of extracted samples keyed by path, size and mtime.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "samplecache.h"
+
+static const char CACHE_MAGIC[8] = { 'G', 'W', 'W', 'C', 'A', 'C', 'H', 'E' };
+static const uint32_t CACHE_VERSION = 6;	// Bump whenever the layout below changes.
+static const size_t ROW_BYTES = sizeof(int64_t) + 3 * sizeof(int32_t) + 2 * sizeof(uint32_t);
+
+//
+// Layout of an entry (native byte order - the cache is local to this machine):
+//   magic[8], version, pathlen, path, source size, source mtime,
+//   secondsBetweenSamples, minLockState, maxPrecision,
+//   summarylen, summary, samplecount, then the SampleStore columns one after the other:
+//   int64 time in ms[samplecount], int32 lat and lon in 1e-7 degrees[samplecount] each,
+//   int32 ele in mm[samplecount], uint32 payload index[samplecount], uint32 media ms[samplecount]
+//
+
+SampleCache::SampleCache() {
+
+}
+
+SampleCache::~SampleCache() {
+
+}
+
+//
+// Create the directory (and any missing parents) if needed.
+//
+bool SampleCache::setCacheDir(const char* dir) {
+	std::string path(dir ? dir : "");
+
+	cacheDir = "";
+	if (path == "")
+		return false;
+
+	while (path.size() > 1 && path.back() == '/')
+		path.pop_back();
+
+	for (size_t pos = 1; pos <= path.size(); pos++) {
+		if (pos == path.size() || path[pos] == '/') {
+			std::string partial = path.substr(0, pos);
+			if (mkdir(partial.c_str(), 0755) != 0 && errno != EEXIST) {
+				std::cerr << "ERROR: Could not create cache directory: " << partial << std::endl;
+				return false;
+			}
+		}
+	}
+
+	cacheDir = path;
+	return true;
+}
+
+//
+// FNV-1a of the path keeps entry names short and filesystem safe.
+// The full path is stored inside the entry to rule out collisions.
+//
+std::string SampleCache::entryName(const char* filename) {
+	uint64_t hash = 14695981039346656037ULL;
+	char name[32];
+
+	for (const char* p = filename; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 1099511628211ULL;
+	}
+
+	snprintf(name, sizeof(name), "%016llx.gwc", (unsigned long long)hash);
+	return cacheDir + "/" + name;
+}
+
+static bool readBlock(FILE* fp, void* dest, size_t len) {
+	return fread(dest, 1, len, fp) == len;
+}
+
+static bool readString(FILE* fp, std::string &str) {
+	uint32_t len;
+
+	if (!readBlock(fp, &len, sizeof(len)) || len > 65536)
+		return false;
+
+	str.resize(len);
+	return len == 0 || readBlock(fp, &str[0], len);
+}
+
+static void writeString(FILE* fp, const std::string &str) {
+	uint32_t len = str.size();
+
+	fwrite(&len, sizeof(len), 1, fp);
+	fwrite(str.data(), 1, len, fp);
+}
+
+template<class T> static bool readColumn(FILE* fp, std::vector<T> &col, uint32_t count) {
+	col.resize(count);
+	return count == 0 || readBlock(fp, &col[0], count * sizeof(T));
+}
+
+template<class T> static void writeColumn(FILE* fp, const std::vector<T> &col) {
+	if (!col.empty())
+		fwrite(&col[0], sizeof(T), col.size(), fp);
+}
+
+//
+// Opens the entry for 'filename' and checks it's for this very file and these parameters.
+// Returns the file sitting on the first column, or NULL for a miss - any mismatch along
+// the way is simply a miss, the entry gets rewritten after extraction. That includes a
+// sample count the rest of the entry can't hold (truncated or corrupt), which is caught
+// before anything is sized by it.
+//
+FILE* SampleCache::openEntry(const char* filename, const ExtractionParams &params, std::string &summary, uint32_t &count) {
+	struct stat st, entrySt;
+	long pos;
+	char magic[sizeof(CACHE_MAGIC)];
+	uint32_t version;
+	int64_t size, mtime;
+	ExtractionParams stored;
+	std::string path;
+	FILE* fp;
+
+	if (!isEnabled() || stat(filename, &st) != 0)
+		return NULL;
+
+	fp = fopen(entryName(filename).c_str(), "rb");
+	if (!fp)
+		return NULL;
+
+	if (readBlock(fp, magic, sizeof(magic)) && !memcmp(magic, CACHE_MAGIC, sizeof(magic))
+		&& readBlock(fp, &version, sizeof(version)) && version == CACHE_VERSION
+		&& readString(fp, path) && path == filename
+		&& readBlock(fp, &size, sizeof(size)) && size == (int64_t)st.st_size
+		&& readBlock(fp, &mtime, sizeof(mtime)) && mtime == (int64_t)st.st_mtime
+		&& readBlock(fp, &stored, sizeof(stored))
+		&& stored.secondsBetweenSamples == params.secondsBetweenSamples
+		&& stored.minLockState == params.minLockState
+		&& stored.maxPrecision == params.maxPrecision
+		&& readString(fp, summary)
+		&& readBlock(fp, &count, sizeof(count))
+		&& fstat(fileno(fp), &entrySt) == 0 && (pos = ftell(fp)) >= 0
+		&& (uint64_t)count * ROW_BYTES <= (uint64_t)(entrySt.st_size - pos))
+		return fp;
+
+	fclose(fp);
+	return NULL;
+}
+
+bool SampleCache::load(const char* filename, const ExtractionParams &params, SampleStore &samples, std::string &summary) {
+	std::vector<int64_t> timeMs;
+	std::vector<int32_t> lat, lon, ele;
+	std::vector<uint32_t> payload, mediaMs;
+	uint32_t count;
+	FILE* fp;
+	bool bHit = false;
+
+	fp = openEntry(filename, params, summary, count);
+	if (!fp)
+		return false;
+
+	if (readColumn(fp, timeMs, count) && readColumn(fp, lat, count)
+		&& readColumn(fp, lon, count) && readColumn(fp, ele, count) && readColumn(fp, payload, count)
+		&& readColumn(fp, mediaMs, count)) {
+		samples.assignColumns(std::move(timeMs), std::move(lat), std::move(lon), std::move(ele), std::move(payload),
+			std::move(mediaMs));
+		bHit = true;
+	}
+
+	fclose(fp);
+	return bHit;
+}
+
+//
+// The streaming pre-pass only needs to know where a file sorts - the time column comes
+// first, so that's a single int64 past the header.
+//
+bool SampleCache::loadFirstTime(const char* filename, const ExtractionParams &params, bool &bHasSamples, int64_t &firstMs) {
+	std::string summary;
+	uint32_t count;
+	FILE* fp;
+	bool bHit;
+
+	fp = openEntry(filename, params, summary, count);
+	if (!fp)
+		return false;
+
+	bHasSamples = count > 0;
+	bHit = count == 0 || readBlock(fp, &firstMs, sizeof(firstMs));
+
+	fclose(fp);
+	return bHit;
+}
+
+bool SampleCache::store(const char* filename, const ExtractionParams &params, const SampleStore &samples, const std::string &summary) {
+	struct stat st;
+	std::string entry, tmpName;
+	uint32_t version = CACHE_VERSION, count = samples.size();
+	int64_t size, mtime;
+	FILE* fp;
+	bool bOK;
+
+	if (!isEnabled() || stat(filename, &st) != 0)
+		return false;
+
+	size = st.st_size;
+	mtime = st.st_mtime;
+
+	// Write to a private name and rename into place so that a concurrent run
+	// (or a crash part way through) never leaves a half written entry behind.
+	entry = entryName(filename);
+	tmpName = entry + "." + std::to_string((long)getpid()) + ".tmp";
+
+	fp = fopen(tmpName.c_str(), "wb");
+	if (!fp)
+		return false;
+
+	fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC), fp);
+	fwrite(&version, sizeof(version), 1, fp);
+	writeString(fp, filename);
+	fwrite(&size, sizeof(size), 1, fp);
+	fwrite(&mtime, sizeof(mtime), 1, fp);
+	fwrite(&params, sizeof(params), 1, fp);
+	writeString(fp, summary);
+	fwrite(&count, sizeof(count), 1, fp);
+	writeColumn(fp, samples.timeColumn());
+	writeColumn(fp, samples.latColumn());
+	writeColumn(fp, samples.lonColumn());
+	writeColumn(fp, samples.eleColumn());
+	writeColumn(fp, samples.payloadColumn());
+	writeColumn(fp, samples.mediaColumn());
+
+	bOK = !ferror(fp);
+	bOK = (fclose(fp) == 0) && bOK;
+
+	if (!bOK || rename(tmpName.c_str(), entry.c_str()) != 0) {
+		unlink(tmpName.c_str());
+		return false;
+	}
+
+	return true;
+}
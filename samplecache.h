@@ -0,0 +1,49 @@
+#ifndef _SAMPLECACHE_H
+#define _SAMPLECACHE_H
+//
+// On-disk cache of extracted samples so unchanged MP4 files don't have to be
+// opened and parsed again on the next run.
+//
+// Each source file gets one cache file named after a hash of its path. The entry
+// records the path, size and mtime of the source as well as the extraction
+// parameters in effect, and is only used when all of them still match.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "samplestore.h"
+
+// Everything that changes which samples GoProMeta keeps.
+struct ExtractionParams {
+	ExtractionParams() : secondsBetweenSamples(5), minLockState(1), maxPrecision(1000) {};
+	uint32_t secondsBetweenSamples;
+	uint32_t minLockState;
+	uint32_t maxPrecision;
+};
+
+class SampleCache {
+public:
+	SampleCache();
+	~SampleCache();
+	bool setCacheDir(const char* dir);
+	bool isEnabled() { return cacheDir != ""; };
+	bool load(const char* filename, const ExtractionParams &params, SampleStore &samples, std::string &summary);
+	// Just the time of the first cached sample (bHasSamples false for a file that kept none).
+	bool loadFirstTime(const char* filename, const ExtractionParams &params, bool &bHasSamples, int64_t &firstMs);
+	bool store(const char* filename, const ExtractionParams &params, const SampleStore &samples, const std::string &summary);
+
+protected:
+	std::string entryName(const char* filename);
+	FILE* openEntry(const char* filename, const ExtractionParams &params, std::string &summary, uint32_t &count);
+
+	std::string cacheDir;
+};
+
+#endif
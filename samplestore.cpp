@@ -0,0 +1,156 @@
+//
+// Columnar (structure of arrays) storage for GPS samples.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iomanip>
+#include <sstream>
+
+#include <math.h>
+
+#include "samplestore.h"
+#include "utctime.h"
+
+std::atomic<unsigned long> SampleStore::copies(0);
+std::atomic<unsigned long> SampleStore::rowCopies(0);
+
+std::ostream& operator<<(std::ostream& os, const UTCMillis& t)
+{
+	utc::writeDateTime(os, utc::fromMillis(t.ms));
+	return os;
+}
+
+SampleStore::SampleStore() {
+
+}
+
+SampleStore::SampleStore(const SampleStore &other) : timeMs(other.timeMs), lat(other.lat), lon(other.lon), ele(other.ele), payload(other.payload), mediaMs(other.mediaMs), ranges(other.ranges) {
+	copies.fetch_add(1, std::memory_order_relaxed);
+}
+
+SampleStore::~SampleStore() {
+
+}
+
+SampleStore& SampleStore::operator=(const SampleStore &other) {
+	timeMs = other.timeMs;
+	lat = other.lat;
+	lon = other.lon;
+	ele = other.ele;
+	payload = other.payload;
+	mediaMs = other.mediaMs;
+	ranges = other.ranges;
+	copies.fetch_add(1, std::memory_order_relaxed);
+	return *this;
+}
+
+void SampleStore::reserve(size_t n) {
+	if (n > timeMs.capacity())
+		rowCopies.fetch_add(size(), std::memory_order_relaxed);
+	timeMs.reserve(n);
+	lat.reserve(n);
+	lon.reserve(n);
+	ele.reserve(n);
+	payload.reserve(n);
+	mediaMs.reserve(n);
+}
+
+void SampleStore::push_back(int64_t _timeMs, double _lat, double _lon, double _ele, uint32_t _payload, uint32_t _mediaMs) {
+	timeMs.push_back(_timeMs);
+	lat.push_back((int32_t)llround(_lat * DEGREE_UNITS));
+	lon.push_back((int32_t)llround(_lon * DEGREE_UNITS));
+	ele.push_back((int32_t)llround(_ele * METRE_UNITS));
+	payload.push_back(_payload);
+	mediaMs.push_back(_mediaMs);
+}
+
+void SampleStore::clear() {
+	timeMs.clear();
+	lat.clear();
+	lon.clear();
+	ele.clear();
+	payload.clear();
+	mediaMs.clear();
+	ranges.clear();
+}
+
+//
+// Takes over ready-made columns (all the same length), ie from the sample cache.
+//
+void SampleStore::assignColumns(std::vector<int64_t> &&_timeMs, std::vector<int32_t> &&_lat, std::vector<int32_t> &&_lon, std::vector<int32_t> &&_ele,
+								std::vector<uint32_t> &&_payload, std::vector<uint32_t> &&_mediaMs) {
+	timeMs = std::move(_timeMs);
+	lat = std::move(_lat);
+	lon = std::move(_lon);
+	ele = std::move(_ele);
+	payload = std::move(_payload);
+	mediaMs = std::move(_mediaMs);
+	ranges.clear();
+}
+
+//
+// Returns the index of the new range. An empty store with nothing reserved simply takes
+// over the other's columns; otherwise they're appended column by column (no per-sample work).
+//
+size_t SampleStore::append(const std::string &name, SampleStore &&other) {
+	Range r;
+
+	r.name = name;
+	r.first = size();
+	r.count = other.size();
+
+	if (empty() && timeMs.capacity() == 0) {
+		timeMs = std::move(other.timeMs);
+		lat = std::move(other.lat);
+		lon = std::move(other.lon);
+		ele = std::move(other.ele);
+		payload = std::move(other.payload);
+		mediaMs = std::move(other.mediaMs);
+	}
+	else {
+		if (size() + other.size() > timeMs.capacity())
+			rowCopies.fetch_add(size(), std::memory_order_relaxed);
+		rowCopies.fetch_add(other.size(), std::memory_order_relaxed);
+
+		timeMs.insert(timeMs.end(), other.timeMs.begin(), other.timeMs.end());
+		lat.insert(lat.end(), other.lat.begin(), other.lat.end());
+		lon.insert(lon.end(), other.lon.begin(), other.lon.end());
+		ele.insert(ele.end(), other.ele.begin(), other.ele.end());
+		payload.insert(payload.end(), other.payload.begin(), other.payload.end());
+		mediaMs.insert(mediaMs.end(), other.mediaMs.begin(), other.mediaMs.end());
+	}
+
+	other.clear();
+	ranges.push_back(r);
+	return ranges.size() - 1;
+}
+
+//
+// One range per file, in order. A lone file into an empty store is still just a move.
+// Each file's columns are freed as soon as they're in.
+//
+void SampleStore::append(std::vector<std::pair<std::string, SampleStore>> &&files) {
+	size_t total = size();
+
+	for (auto &f: files)
+		total += f.second.size();
+
+	if (!(empty() && files.size() == 1))
+		reserve(total);
+
+	for (auto &f: files) {
+		append(f.first, std::move(f.second));
+		f.second = SampleStore();
+	}
+	files.clear();
+}
+
+std::string SampleStore::getDateOnly(size_t i) const {
+	std::ostringstream os;
+
+	utc::writeDate(os, utc::fromMillis(timeMs[i]));
+
+	return std::string(os.str());
+}
@@ -0,0 +1,122 @@
+#ifndef _SAMPLESTORE_H
+#define _SAMPLESTORE_H
+//
+// Columnar (structure of arrays) storage for GPS samples.
+//
+// Instead of one object per point, each field lives in its own vector: UTC time as
+// int64 milliseconds since the epoch plus lat, lon and ele, the index of the MP4 payload
+// the point came from and where it falls in the video (media time, ms from the start of
+// the clip). That's 28 bytes a point and the grouping/export loops only stream through
+// the columns they actually use.
+//
+// Lat/lon are kept as int32 1e-7 degrees and ele as int32 millimetres - the units of a
+// GPS5 stream (SCAL 10000000, 10000000, 1000), so a GoPro sample is stored as its raw
+// value. Reading one back divides by the same scale the GPMF parser uses, which gives the
+// very same double as scaling it straight from the stream (any SCAL dividing these, ie
+// 1000000 or 100, round trips exactly as well).
+//
+// A store can hold the samples of many files back to back. Each file is a named Range
+// of rows and a SampleSpan is a lightweight read-only view of one such range.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <stdint.h>
+
+//
+// Streams as YYYY-MM-DDTHH:MM:SSZ - the format GPX wants.
+//
+struct UTCMillis {
+	explicit UTCMillis(int64_t _ms) : ms(_ms) {};
+	friend std::ostream& operator<<(std::ostream& os, const UTCMillis& t);
+	int64_t ms;
+};
+
+class SampleStore {
+public:
+	struct Range {
+		std::string name;
+		size_t first;
+		size_t count;
+	};
+
+	enum { DEGREE_UNITS = 10000000, METRE_UNITS = 1000 };
+
+	SampleStore();
+	SampleStore(const SampleStore &other);
+	SampleStore(SampleStore &&other) = default;
+	~SampleStore();
+	SampleStore& operator=(const SampleStore &other);
+	SampleStore& operator=(SampleStore &&other) = default;
+
+	void reserve(size_t n);
+	// Rounded to the store's units. Lat/lon must be within +-214 degrees and ele +-2147 km.
+	void push_back(int64_t _timeMs, double _lat, double _lon, double _ele, uint32_t _payload=0, uint32_t _mediaMs=0);
+	void clear();
+	void assignColumns(std::vector<int64_t> &&_timeMs, std::vector<int32_t> &&_lat, std::vector<int32_t> &&_lon, std::vector<int32_t> &&_ele,
+						std::vector<uint32_t> &&_payload, std::vector<uint32_t> &&_mediaMs);
+	size_t size() const { return timeMs.size(); };
+	bool empty() const { return timeMs.empty(); };
+
+	// Moves every row of 'other' onto the end of this store as a single range called 'name'.
+	size_t append(const std::string &name, SampleStore &&other);
+	// Same for many files at once - room for all of them is made first, so the rows already
+	// here never move again.
+	void append(std::vector<std::pair<std::string, SampleStore>> &&files);
+	const std::vector<Range>& getRanges() const { return ranges; };
+	void renameRange(size_t index, const std::string &name) { ranges[index].name = name; };
+
+	int64_t getTimeMs(size_t i) const { return timeMs[i]; };
+	double getLat(size_t i) const { return toDegrees(lat[i]); };
+	double getLon(size_t i) const { return toDegrees(lon[i]); };
+	double getEle(size_t i) const { return toMetres(ele[i]); };
+	uint32_t getPayload(size_t i) const { return payload[i]; };
+	uint32_t getMediaMs(size_t i) const { return mediaMs[i]; };
+	std::string getDateOnly(size_t i) const;	// YYYY-MM-DD (UTC)
+
+	const std::vector<int64_t>& timeColumn() const { return timeMs; };
+	// In store units - toDegrees()/toMetres() turn a value into what getLat() etc. return.
+	const std::vector<int32_t>& latColumn() const { return lat; };
+	const std::vector<int32_t>& lonColumn() const { return lon; };
+	const std::vector<int32_t>& eleColumn() const { return ele; };
+	static double toDegrees(int32_t v) { return (double)v / (double)DEGREE_UNITS; };
+	static double toMetres(int32_t v) { return (double)v / (double)METRE_UNITS; };
+	const std::vector<uint32_t>& payloadColumn() const { return payload; };
+	const std::vector<uint32_t>& mediaColumn() const { return mediaMs; };
+
+	// Whole-store copies are counted - samples should be moved, never copied. So are rows
+	// copied in from another store or shuffled along when a column has to grow.
+	static unsigned long getCopyCount() { return copies.load(std::memory_order_relaxed); };
+	static unsigned long getRowCopyCount() { return rowCopies.load(std::memory_order_relaxed); };
+
+protected:
+	std::vector<int64_t> timeMs;
+	std::vector<int32_t> lat, lon;		// 1e-7 degrees
+	std::vector<int32_t> ele;			// mm
+	std::vector<uint32_t> payload;		// MP4 payload index
+	std::vector<uint32_t> mediaMs;		// Media time in the clip, edit list included
+	std::vector<Range> ranges;
+
+	static std::atomic<unsigned long> copies;
+	static std::atomic<unsigned long> rowCopies;
+};
+
+//
+// Read-only window onto 'count' rows of a store starting at 'first'.
+// Valid for as long as the store isn't modified.
+//
+struct SampleSpan {
+	SampleSpan() : store(NULL), first(0), count(0) {};
+	SampleSpan(const SampleStore* _store, size_t _first, size_t _count) : store(_store), first(_first), count(_count) {};
+	const SampleStore* store;
+	size_t first;
+	size_t count;
+};
+
+#endif
@@ -0,0 +1,265 @@
+//
+// Grid index over the samples of a SampleStore for --near queries.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include <math.h>
+
+#include "spatialindex.h"
+
+const double EARTH_RADIUS_METERS = 6371000.0;
+const double DEG_TO_RAD = M_PI / 180.0;
+
+constexpr double SpatialIndex::DEFAULT_CELL_DEGREES;
+
+SpatialIndex::SpatialIndex(double _cellDegrees) {
+	store = NULL;
+	cellDegrees = _cellDegrees > 0.0 ? _cellDegrees : DEFAULT_CELL_DEGREES;
+	latCells = (int64_t)ceil(180.0 / cellDegrees);
+	lonCells = (int64_t)ceil(360.0 / cellDegrees);
+}
+
+double SpatialIndex::distanceMeters(double lat1, double lon1, double lat2, double lon2) {
+	double dLat = (lat2 - lat1) * DEG_TO_RAD;
+	double dLon = (lon2 - lon1) * DEG_TO_RAD;
+	double a = sin(dLat / 2) * sin(dLat / 2) + cos(lat1 * DEG_TO_RAD) * cos(lat2 * DEG_TO_RAD) * sin(dLon / 2) * sin(dLon / 2);
+
+	return 2.0 * EARTH_RADIUS_METERS * asin(std::min(1.0, sqrt(a)));
+}
+
+int64_t SpatialIndex::latCellOf(double lat) const {
+	int64_t cell = (int64_t)floor((lat + 90.0) / cellDegrees);
+
+	return std::max((int64_t)0, std::min(latCells - 1, cell));
+}
+
+// Not wrapped - a query can run off either end of the -180..180 range.
+int64_t SpatialIndex::lonCellOf(double lon) const {
+	return (int64_t)floor((lon + 180.0) / cellDegrees);
+}
+
+void SpatialIndex::build(const SampleStore &_store) {
+	store = &_store;
+	entries.resize(_store.size());
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		int64_t lonCell = lonCellOf(_store.getLon(i)) % lonCells;
+
+		if (lonCell < 0)
+			lonCell += lonCells;
+		entries[i].key = cellKey(latCellOf(_store.getLat(i)), lonCell);
+		entries[i].row = (uint32_t)i;
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+		return a.key != b.key ? a.key < b.key : a.row < b.row;
+	});
+}
+
+//
+// Checks every sample filed under cells lonFirst..lonLast (0 based, not wrapped) of one row of cells.
+// A cell whose corners are all inside the circle is inside as a whole and taken without
+// looking at its samples - the farthest point of a cell this small is always a corner.
+//
+void SpatialIndex::scanCells(int64_t latCell, int64_t lonFirst, int64_t lonLast, double lat, double lon, double radiusMeters,
+							std::vector<size_t> &rows) const {
+	uint64_t last = cellKey(latCell, lonLast);
+	double cellLat = latCell * cellDegrees - 90.0;
+	auto it = std::lower_bound(entries.begin(), entries.end(), cellKey(latCell, lonFirst),
+		[](const Entry &e, uint64_t key) { return e.key < key; });
+
+	while (it != entries.end() && it->key <= last) {
+		uint64_t key = it->key;
+		double cellLon = (int64_t)(key - cellKey(latCell, 0)) * cellDegrees - 180.0;
+		bool bInside = true;
+
+		for (int corner = 0; corner < 4 && bInside; corner++)
+			bInside = distanceMeters(lat, lon, cellLat + (corner & 1) * cellDegrees, cellLon + (corner >> 1) * cellDegrees) <= radiusMeters;
+
+		for (; it != entries.end() && it->key == key; ++it) {
+			if (bInside || distanceMeters(lat, lon, store->getLat(it->row), store->getLon(it->row)) <= radiusMeters)
+				rows.push_back(it->row);
+		}
+	}
+}
+
+void SpatialIndex::query(double lat, double lon, double radiusMeters, std::vector<size_t> &rows) const {
+	collect(lat, lon, radiusMeters, rows);
+	std::sort(rows.begin(), rows.end());
+}
+
+//
+// Every row within the circle, in index order.
+//
+void SpatialIndex::collect(double lat, double lon, double radiusMeters, std::vector<size_t> &rows) const {
+	rows.clear();
+	if (!store || entries.empty() || radiusMeters < 0.0)
+		return;
+
+	// The circle's bounding box - the longitude span is the widest point of the spherical cap.
+	double angle = std::min(radiusMeters / EARTH_RADIUS_METERS, M_PI);
+	double dLat = angle / DEG_TO_RAD;
+	double latMin = lat - dLat, latMax = lat + dLat;
+	double sinAngle = sin(angle), cosLat = cos(lat * DEG_TO_RAD);
+	bool bAllLon = latMin <= -90.0 || latMax >= 90.0 || angle >= M_PI / 2 || sinAngle >= cosLat;
+	int64_t lonFirst = 0, lonLast = lonCells - 1;
+
+	if (!bAllLon) {
+		double dLon = asin(sinAngle / cosLat) / DEG_TO_RAD;
+
+		lonFirst = lonCellOf(lon - dLon);
+		lonLast = lonCellOf(lon + dLon);
+		if (lonLast - lonFirst + 1 >= lonCells) {
+			lonFirst = 0;
+			lonLast = lonCells - 1;
+		}
+	}
+
+	for (int64_t latCell = latCellOf(latMin); latCell <= latCellOf(latMax); latCell++) {
+		if (lonFirst < 0) {
+			scanCells(latCell, lonFirst + lonCells, lonCells - 1, lat, lon, radiusMeters, rows);
+			scanCells(latCell, 0, lonLast, lat, lon, radiusMeters, rows);
+		}
+		else if (lonLast >= lonCells) {
+			scanCells(latCell, lonFirst, lonCells - 1, lat, lon, radiusMeters, rows);
+			scanCells(latCell, 0, lonLast - lonCells, lat, lon, radiusMeters, rows);
+		}
+		else
+			scanCells(latCell, lonFirst, lonLast, lat, lon, radiusMeters, rows);
+	}
+}
+
+void SpatialIndex::near(double lat, double lon, double radiusMeters, std::vector<FileMatch> &matches) const {
+	std::vector<size_t> rows;
+	std::vector<size_t> slot;		// Range index -> position in 'matches' + 1
+
+	matches.clear();
+	collect(lat, lon, radiusMeters, rows);
+	if (rows.empty())
+		return;
+
+	// Ranges sit back to back in row order - each row's range is a binary search away.
+	const std::vector<SampleStore::Range> &ranges = store->getRanges();
+	slot.resize(ranges.size());
+
+	for (auto row: rows) {
+		auto it = std::upper_bound(ranges.begin(), ranges.end(), row,
+			[](size_t r, const SampleStore::Range &range) { return r < range.first; });
+		if (it == ranges.begin())
+			continue;
+
+		size_t r = (--it) - ranges.begin();
+		int64_t t = store->getTimeMs(row);
+
+		if (row >= it->first + it->count)
+			continue;
+
+		uint32_t media = store->getMediaMs(row);
+
+		if (!slot[r]) {
+			matches.push_back({r, 0, t, t, media, media});
+			slot[r] = matches.size();
+		}
+
+		FileMatch &m = matches[slot[r] - 1];
+		m.samples++;
+		if (t < m.firstMs) {
+			m.firstMs = t;
+			m.firstMediaMs = media;
+		}
+		if (t > m.lastMs) {
+			m.lastMs = t;
+			m.lastMediaMs = media;
+		}
+	}
+
+	std::sort(matches.begin(), matches.end(), [](const FileMatch &a, const FileMatch &b) {
+		return a.firstMs != b.firstMs ? a.firstMs < b.firstMs : a.range < b.range;
+	});
+}
+
+//
+// Index queries against a brute force check of every sample, the antimeridian and the
+// poles included, then the time for a query over a few million points.
+//
+void unittest_SpatialIndex() {
+	std::mt19937 rng(68);
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	SampleStore store;
+	SpatialIndex index;
+	bool bOK = true;
+
+	// Files of 2000 samples wandering around a handful of places.
+	const double places[][2] = { {45.5, -122.6}, {0.0, 179.999}, {-33.9, 151.2}, {89.99, 10.0}, {51.5, 0.0} };
+	for (int f = 0; f < 50; f++) {
+		SampleStore file;
+		double lat = places[f % 5][0], lon = places[f % 5][1];
+
+		for (int i = 0; i < 2000; i++) {
+			lat = std::max(-90.0, std::min(90.0, lat + (unit(rng) - 0.5) * 0.002));
+			lon += (unit(rng) - 0.5) * 0.004;
+			if (lon >= 180.0)
+				lon -= 360.0;
+			file.push_back(1593866096000LL + f * 3600000LL + i * 1000, lat, lon, 100.0, i / 18, i * 1000);
+		}
+		store.append("file" + std::to_string(f), std::move(file));
+	}
+
+	index.build(store);
+
+	for (int q = 0; q < 200 && bOK; q++) {
+		size_t center = (size_t)(unit(rng) * store.size());
+		double lat = store.getLat(center) + (unit(rng) - 0.5) * 0.01;
+		double lon = store.getLon(center) + (unit(rng) - 0.5) * 0.01;
+		double radius = q % 10 == 0 ? 50000.0 : unit(rng) * 2000.0;
+		std::vector<size_t> rows, expected;
+
+		index.query(lat, lon, radius, rows);
+		for (size_t i = 0; i < store.size(); i++)
+			if (SpatialIndex::distanceMeters(lat, lon, store.getLat(i), store.getLon(i)) <= radius)
+				expected.push_back(i);
+
+		bOK = rows == expected;
+	}
+
+	std::vector<SpatialIndex::FileMatch> matches;
+	index.near(store.getLat(2500), store.getLon(2500), 1.0, matches);
+	bOK = bOK && !matches.empty() && matches[0].range == 1 && matches[0].firstMs <= store.getTimeMs(2500)
+		&& matches[0].lastMs >= store.getTimeMs(2500) && matches[0].firstMediaMs <= 500000 && matches[0].lastMediaMs >= 500000
+		&& matches[0].firstMediaMs == matches[0].firstMs - store.getTimeMs(2000);
+
+	// Scale: 5M points, 1000 files of them, all crammed into the same small area - the
+	// worst case for the grid as every query lands in crowded cells.
+	SampleStore big;
+	SpatialIndex bigIndex;
+	double lat = 40.0, lon = -105.0;
+
+	for (int f = 0; f < 1000; f++) {
+		SampleStore file;
+
+		for (int i = 0; i < 5000; i++) {
+			lat += (unit(rng) - 0.5) * 0.0004;
+			lon += (unit(rng) - 0.5) * 0.0004;
+			file.push_back((f * 5000LL + i) * 1000, lat, lon, 0.0);
+		}
+		big.append("file" + std::to_string(f), std::move(file));
+	}
+
+	auto t0 = std::chrono::steady_clock::now();
+	bigIndex.build(big);
+	auto t1 = std::chrono::steady_clock::now();
+	for (int q = 0; q < 100; q++)
+		bigIndex.near(big.getLat(q * 50000), big.getLon(q * 50000), 1000.0, matches);
+	auto t2 = std::chrono::steady_clock::now();
+
+	std::cout << "Checking spatial index: build of " << big.size() << " points " << std::chrono::duration<double>(t1 - t0).count()
+		<< "s, 1km query " << std::chrono::duration<double, std::milli>(t2 - t1).count() / 100 << "ms : "
+		<< (bOK ? "PASSED." : "FAILED.") << std::endl;
+}
@@ -0,0 +1,67 @@
+#ifndef _SPATIALINDEX_H
+#define _SPATIALINDEX_H
+//
+// "Which clips did I shoot near this spot?" - a grid index over every sample of a SampleStore.
+//
+// The world is cut into cellDegrees x cellDegrees lat/lon cells and every row of the store
+// is filed under its cell, sorted by cell key (latCell * lonCells + lonCell). One row of
+// cells is then a single contiguous key range, so a query is a binary search per row of
+// cells the circle touches and an exact great circle check of just the rows found there.
+// 16 bytes a sample on top of the store (a 64 bit key - there are ~1.6e10 cells - and a
+// 32 bit row, padded).
+//
+// Holds row numbers, not copies - valid until the store changes.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <vector>
+
+#include <stdint.h>
+
+#include "samplestore.h"
+
+class SpatialIndex {
+public:
+	// What a query turned up in one of the store's ranges (files).
+	struct FileMatch {
+		size_t range;		// Index into store.getRanges()
+		size_t samples;		// Matching samples
+		int64_t firstMs;	// Earliest and latest matching sample
+		int64_t lastMs;
+		uint32_t firstMediaMs;	// Media time of those two
+		uint32_t lastMediaMs;
+	};
+
+	SpatialIndex(double _cellDegrees = DEFAULT_CELL_DEGREES);
+	void build(const SampleStore &_store);
+	size_t size() const { return entries.size(); };
+	void query(double lat, double lon, double radiusMeters, std::vector<size_t> &rows) const;	// Ascending store rows
+	void near(double lat, double lon, double radiusMeters, std::vector<FileMatch> &matches) const;	// By first matching time
+
+	static double distanceMeters(double lat1, double lon1, double lat2, double lon2);
+
+protected:
+	struct Entry {
+		uint64_t key;
+		uint32_t row;
+	};
+
+	uint64_t cellKey(int64_t latCell, int64_t lonCell) const { return (uint64_t)latCell * lonCells + lonCell; };
+	int64_t latCellOf(double lat) const;
+	int64_t lonCellOf(double lon) const;
+	void collect(double lat, double lon, double radiusMeters, std::vector<size_t> &rows) const;
+	void scanCells(int64_t latCell, int64_t lonFirst, int64_t lonLast, double lat, double lon, double radiusMeters,
+					std::vector<size_t> &rows) const;
+
+	static constexpr double DEFAULT_CELL_DEGREES = 0.002;		// ~220m north-south
+
+	const SampleStore* store;
+	double cellDegrees;
+	int64_t latCells;
+	int64_t lonCells;
+	std::vector<Entry> entries;		// Sorted by key, then row
+};
+
+#endif
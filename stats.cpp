@@ -0,0 +1,186 @@
+//
+// --stats: per-stage timing and I/O counters, and the report they end up in.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iomanip>
+#include <new>
+#include <sstream>
+
+#include <stdlib.h>
+#include <string.h>
+
+// basename()
+#include <libgen.h>
+
+#include "stats.h"
+
+// Plain zero initialized, so it's usable from the very first allocation on any thread.
+static thread_local uint64_t threadAllocations = 0;
+
+void* operator new(std::size_t size) {
+	threadAllocations++;
+
+	if (size == 0)
+		size = 1;
+
+	do {
+		void* p = malloc(size);
+		if (p)
+			return p;
+
+		std::new_handler handler = std::get_new_handler();
+		if (!handler)
+			throw std::bad_alloc();
+		handler();
+	} while(1);
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+uint64_t heapAllocations() {
+	return threadAllocations;
+}
+
+void FileStats::clear() {
+	memset(ns, 0, sizeof(ns));
+	fileBytes = 0;
+	bytesRead = 0;
+	readCalls = 0;
+	payloads = 0;
+	payloadsSkipped = 0;
+	klvs = 0;
+	samples = 0;
+	allocations = 0;
+	files = 0;
+}
+
+void FileStats::add(const FileStats &other) {
+	for (int i = 0; i < STAGE_COUNT; i++)
+		ns[i] += other.ns[i];
+	fileBytes += other.fileBytes;
+	bytesRead += other.bytesRead;
+	readCalls += other.readCalls;
+	payloads += other.payloads;
+	payloadsSkipped += other.payloadsSkipped;
+	klvs += other.klvs;
+	samples += other.samples;
+	allocations += other.allocations;
+	files += other.files;
+}
+
+const char* FileStats::stageName(int stage) {
+	static const char* names[STAGE_COUNT] = { "open", "read", "walk", "scale", "group", "export" };
+
+	return stage >= 0 && stage < STAGE_COUNT ? names[stage] : "";
+}
+
+RunStats::RunStats() {
+	startNs = statsNowNs();
+	wallNs = 0;
+}
+
+void RunStats::addFile(const std::string &name, const FileStats &stats) {
+	names.push_back(name);
+	files.push_back(stats);
+	total.add(stats);
+	total.files++;
+}
+
+void RunStats::write(std::ostream &os, bool bJSON) const {
+	if (bJSON)
+		writeJSON(os);
+	else
+		writeTable(os);
+}
+
+//
+// One row per file, then the run. Times in ms, sizes in MB.
+//
+static void writeRow(std::ostream &os, const std::string &name, const FileStats &s) {
+	os << std::left << std::setw(24) << name.substr(0, 23) << std::right;
+	for (int i = 0; i < FileStats::STAGE_COUNT; i++)
+		os << std::setw(10) << std::setprecision(1) << s.ns[i] / 1e6;
+
+	os << std::setw(10) << std::setprecision(2) << s.bytesRead / 1e6
+		<< std::setw(10) << s.fileBytes / 1e6
+		<< std::setw(7) << std::setprecision(1) << (s.fileBytes ? 100.0 * s.bytesRead / s.fileBytes : 0.0)
+		<< std::setw(8) << s.readCalls
+		<< std::setw(9) << s.payloads
+		<< std::setw(9) << s.payloadsSkipped
+		<< std::setw(10) << s.klvs
+		<< std::setw(10) << s.samples
+		<< std::setw(10) << s.allocations << std::endl;
+}
+
+void RunStats::writeTable(std::ostream &os) const {
+	std::ostringstream out;
+
+	out << std::fixed << std::left << std::setw(24) << "file" << std::right;
+	for (int i = 0; i < FileStats::STAGE_COUNT; i++)
+		out << std::setw(10) << (std::string(FileStats::stageName(i)) + "ms");
+	out << std::setw(10) << "readMB" << std::setw(10) << "fileMB" << std::setw(7) << "read%"
+		<< std::setw(8) << "reads" << std::setw(9) << "payloads" << std::setw(9) << "skipped"
+		<< std::setw(10) << "KLVs" << std::setw(10) << "samples" << std::setw(10) << "allocs" << std::endl;
+
+	for (size_t i = 0; i < files.size(); i++) {
+		std::string name(names[i]);
+		writeRow(out, basename((char*)name.c_str()), files[i]);
+	}
+	writeRow(out, "TOTAL", total);
+
+	double seconds = wallNs / 1e9;
+	out << std::setprecision(3) << "Run: " << total.files << " files in " << seconds << "s";
+	if (seconds > 0.0)
+		out << std::setprecision(1) << ", " << total.bytesRead / 1e6 / seconds << " MB/s read, "
+			<< total.payloads / seconds << " payloads/s";
+	out << std::endl;
+
+	os << out.str();
+}
+
+static std::string jsonString(const std::string &in) {
+	std::ostringstream os;
+
+	os << '"';
+	for (unsigned char c: in) {
+		if (c == '"' || c == '\\')
+			os << '\\' << c;
+		else if (c < 0x20)
+			os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec << std::setfill(' ');
+		else
+			os << c;
+	}
+	os << '"';
+
+	return os.str();
+}
+
+static void writeJSONStats(std::ostream &os, const FileStats &s) {
+	os << "\"ns\":{";
+	for (int i = 0; i < FileStats::STAGE_COUNT; i++)
+		os << (i ? "," : "") << '"' << FileStats::stageName(i) << "\":" << s.ns[i];
+	os << "},\"fileBytes\":" << s.fileBytes << ",\"bytesRead\":" << s.bytesRead << ",\"readCalls\":" << s.readCalls
+		<< ",\"payloads\":" << s.payloads << ",\"payloadsSkipped\":" << s.payloadsSkipped << ",\"klvs\":" << s.klvs
+		<< ",\"samples\":" << s.samples << ",\"allocations\":" << s.allocations;
+}
+
+void RunStats::writeJSON(std::ostream &os) const {
+	std::ostringstream out;
+
+	out << "{\"files\":[";
+	for (size_t i = 0; i < files.size(); i++) {
+		out << (i ? "," : "") << "{\"name\":" << jsonString(names[i]) << ",";
+		writeJSONStats(out, files[i]);
+		out << "}";
+	}
+	out << "],\"total\":{\"files\":" << total.files << ",";
+	writeJSONStats(out, total);
+	out << "},\"wallNs\":" << wallNs << "}" << std::endl;
+
+	os << out.str();
+}
@@ -0,0 +1,96 @@
+#ifndef _STATS_H
+#define _STATS_H
+//
+// --stats: where the time goes and how much gets read, per file and for the whole run.
+//
+// Stage times come off the monotonic clock and are only taken when a FileStats is handed
+// in, so a run without --stats pays a NULL check per payload. The heap allocation count
+// is always kept (a thread local increment in operator new) and read as a before/after
+// difference on the thread doing the work. The MP4 reader is C and mallocs, so it keeps
+// its own count per source and GoProMeta adds that in when the file is closed.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include <stdint.h>
+
+inline int64_t statsNowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t heapAllocations();		// operator new calls made by the calling thread so far
+
+struct FileStats {
+	enum Stage {
+		STAGE_OPEN,		// OpenMP4Source - moov and sample tables
+		STAGE_READ,		// Payload reads (GetPayloadView)
+		STAGE_WALK,		// GPMF_Next and friends - everything in a payload but the scaling
+		STAGE_SCALE,	// GPMF_ScaledData
+		STAGE_GROUP,	// SamplesHandler taking the samples and grouping them by day
+		STAGE_EXPORT,	// GPX/CSV/Arrow writing
+		STAGE_COUNT
+	};
+
+	FileStats() { clear(); };
+	void clear();
+	void add(const FileStats &other);
+	static const char* stageName(int stage);
+
+	int64_t ns[STAGE_COUNT];
+	uint64_t fileBytes;			// Size of the MP4(s)
+	uint64_t bytesRead;			// What was actually read from them
+	uint64_t readCalls;
+	uint64_t payloads;			// Payloads parsed
+	uint64_t payloadsSkipped;	// Never read - see GoProMeta::nextWantedPayload()
+	uint64_t klvs;				// KLVs visited
+	uint64_t samples;			// GPS samples kept
+	uint64_t allocations;		// C++ new plus the MP4 reader's malloc/realloc
+	uint64_t files;
+};
+
+//
+// Adds up the FileStats of a run. Stages that aren't tied to one file (grouping and
+// export at the end) go straight into 'total'.
+//
+class RunStats {
+public:
+	RunStats();
+	void start() { startNs = statsNowNs(); };
+	void stop() { wallNs = statsNowNs() - startNs; };
+	void addFile(const std::string &name, const FileStats &stats);
+	void write(std::ostream &os, bool bJSON) const;
+
+	FileStats total;
+
+protected:
+	void writeTable(std::ostream &os) const;
+	void writeJSON(std::ostream &os) const;
+
+	std::vector<std::string> names;
+	std::vector<FileStats> files;
+	int64_t startNs;
+	int64_t wallNs;
+};
+
+//
+// Adds the time until it goes out of scope to one stage - does nothing without a FileStats.
+//
+class StageTimer {
+public:
+	StageTimer(FileStats* _pStats, FileStats::Stage _stage) :
+		pStats(_pStats), stage(_stage), startNs(_pStats ? statsNowNs() : 0) {};
+	~StageTimer() { if (pStats) pStats->ns[stage] += statsNowNs() - startNs; };
+
+protected:
+	FileStats* pStats;
+	FileStats::Stage stage;
+	int64_t startNs;
+};
+
+#endif
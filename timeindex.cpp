@@ -0,0 +1,221 @@
+//
+// Interval index over the GPS time span of every file for --at and --between queries.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+
+#include <math.h>
+
+#include "timeindex.h"
+#include "utctime.h"
+
+TimeIndex::TimeIndex() {
+	store = NULL;
+	leaves = 0;
+}
+
+void TimeIndex::build(const SampleStore &_store) {
+	const std::vector<SampleStore::Range> &ranges = _store.getRanges();
+
+	store = &_store;
+	intervals.clear();
+	maxEndMs.clear();
+
+	for (size_t r = 0; r < ranges.size(); r++) {
+		if (ranges[r].count == 0)
+			continue;
+
+		intervals.push_back({ _store.getTimeMs(ranges[r].first), _store.getTimeMs(ranges[r].first + ranges[r].count - 1), r });
+	}
+
+	std::sort(intervals.begin(), intervals.end(), [](const Interval &a, const Interval &b) {
+		return a.startMs != b.startMs ? a.startMs < b.startMs : a.range < b.range;
+	});
+
+	for (leaves = 1; leaves < intervals.size(); leaves *= 2)
+		;
+
+	// Unused leaves can't end late enough for anything.
+	maxEndMs.assign(2 * leaves, INT64_MIN);
+	for (size_t i = 0; i < intervals.size(); i++)
+		maxEndMs[leaves + i] = intervals[i].endMs;
+	for (size_t n = leaves - 1; n > 0; n--)
+		maxEndMs[n] = std::max(maxEndMs[2 * n], maxEndMs[2 * n + 1]);
+}
+
+//
+// Appends, in order, every interval below 'node' (covering [lo, hi)) that is before 'end'
+// and ends at or after fromMs.
+//
+void TimeIndex::collect(size_t node, size_t lo, size_t hi, size_t end, int64_t fromMs, std::vector<size_t> &found,
+						size_t &visited) const {
+	visited++;
+	if (lo >= end || maxEndMs[node] < fromMs)
+		return;
+
+	if (hi - lo == 1) {
+		found.push_back(lo);
+		return;
+	}
+
+	size_t mid = lo + (hi - lo) / 2;
+	collect(2 * node, lo, mid, end, fromMs, found, visited);
+	collect(2 * node + 1, mid, hi, end, fromMs, found, visited);
+}
+
+//
+// Linear between the samples either side of 'ms', which must be within the range's span.
+//
+void TimeIndex::positionAt(size_t range, int64_t ms, double &lat, double &lon, double &ele, double &mediaSeconds) const {
+	const SampleStore::Range &r = store->getRanges()[range];
+	const std::vector<int64_t> &times = store->timeColumn();
+	auto first = times.begin() + r.first, last = first + r.count;
+	size_t after = std::upper_bound(first, last, ms) - times.begin();
+
+	if (after == r.first || after == r.first + r.count) {
+		size_t i = after == r.first ? after : after - 1;
+		lat = store->getLat(i);
+		lon = store->getLon(i);
+		ele = store->getEle(i);
+		mediaSeconds = store->getMediaMs(i) / 1000.0;
+		return;
+	}
+
+	size_t before = after - 1;
+	int64_t span = times[after] - times[before];
+	double f = span > 0 ? (double)(ms - times[before]) / span : 0.0;
+	double dLon = store->getLon(after) - store->getLon(before);
+
+	// Take the short way round across the antimeridian.
+	if (dLon > 180.0)
+		dLon -= 360.0;
+	else if (dLon < -180.0)
+		dLon += 360.0;
+
+	lat = store->getLat(before) + f * (store->getLat(after) - store->getLat(before));
+	lon = store->getLon(before) + f * dLon;
+	ele = store->getEle(before) + f * (store->getEle(after) - store->getEle(before));
+	mediaSeconds = (store->getMediaMs(before) + f * ((double)store->getMediaMs(after) - store->getMediaMs(before))) / 1000.0;
+	if (lon > 180.0)
+		lon -= 360.0;
+	else if (lon < -180.0)
+		lon += 360.0;
+}
+
+void TimeIndex::between(int64_t fromMs, int64_t toMs, std::vector<Match> &matches, size_t* visited) const {
+	std::vector<size_t> found;
+	size_t nodes = 0;
+
+	matches.clear();
+	if (visited)
+		*visited = 0;
+	if (!store || intervals.empty() || toMs < fromMs)
+		return;
+
+	// Everything past here starts too late.
+	size_t end = std::upper_bound(intervals.begin(), intervals.end(), toMs,
+		[](int64_t t, const Interval &i) { return t < i.startMs; }) - intervals.begin();
+
+	collect(1, 0, leaves, end, fromMs, found, nodes);
+	if (visited)
+		*visited = nodes;
+
+	for (auto i: found) {
+		const Interval &in = intervals[i];
+		Match m;
+		double lat, lon, ele;
+
+		m.range = in.range;
+		m.fromMs = std::max(fromMs, in.startMs);
+		m.toMs = std::min(toMs, in.endMs);
+		positionAt(in.range, m.toMs, lat, lon, ele, m.toOffset);
+		positionAt(in.range, m.fromMs, m.lat, m.lon, m.ele, m.fromOffset);
+		matches.push_back(m);
+	}
+}
+
+//
+// Parsing, stabbing queries against a brute force scan of the intervals, interpolation,
+// that one absurdly long file doesn't turn queries into a scan, and the query time over a
+// long archive.
+//
+void unittest_TimeIndex() {
+	SampleStore store;
+	TimeIndex index;
+	int64_t ms = 0;
+	bool bOK;
+
+	bOK = utc::parseDateTime("2020-07-04T14:32:00Z", ms) && ms == utc::toMillis(2020, 7, 4, 14, 32, 0, 0)
+		&& utc::parseDateTime("2020-07-04 14:32", ms) && ms == utc::toMillis(2020, 7, 4, 14, 32, 0, 0)
+		&& utc::parseDateTime("2020-07-04T14:32:05.25", ms) && ms == utc::toMillis(2020, 7, 4, 14, 32, 5, 250)
+		&& !utc::parseDateTime("2020-07-04", ms) && !utc::parseDateTime("2020-13-04T14:32", ms)
+		&& !utc::parseDateTime("2020-07-04T14:32:5", ms) && !utc::parseDateTime("2020-07-04T14:32:00Zjunk", ms);
+
+	// 20000 clips of 5 minutes, a sample a second, starting every 4 minutes so neighbours
+	// overlap, plus one long clip overlapping lots of them. Files are added out of order and
+	// every clip got its GPS lock 2s in.
+	const int64_t base = utc::toMillis(2020, 7, 4, 0, 0, 0, 0);
+	const int clips = 20000;
+	const size_t outlier = clips + 1;
+	for (int c = 0; c < clips + 1; c++) {
+		SampleStore file;
+		int64_t start = c < clips ? base + (int64_t)((c * 7919) % clips) * 240000 : base + 1000000;
+		int samples = c < clips ? 300 : 20000;
+
+		for (int i = 0; i < samples; i++)
+			file.push_back(start + i * 1000, 40.0 + i * 0.001, 179.9995 + i * 0.001 - (179.9995 + i * 0.001 > 180.0 ? 360.0 : 0.0), i,
+				0, 2000 + i * 1000);
+		store.append("clip" + std::to_string(c), std::move(file));
+	}
+
+	// A GPS glitch: starts the day before everything else and "ends" ten years later.
+	SampleStore glitch;
+	glitch.push_back(base - 86400000, 40.0, -105.0, 0.0, 0, 0);
+	glitch.push_back(base + 10 * 365 * 86400000LL, 40.0, -105.0, 0.0, 1, 1000);
+	store.append("glitch", std::move(glitch));
+
+	index.build(store);
+
+	// Every query finds the glitch too, but only pays a walk down the tree for it.
+	std::vector<TimeIndex::Match> matches;
+	size_t visited, maxVisited = 0;
+	for (int q = 0; q < 500 && bOK; q++) {
+		int64_t t = base + (int64_t)q * 9876543 % ((int64_t)clips * 240000);
+		size_t expected = 0;
+
+		index.between(t, t, matches, &visited);
+		for (auto &r: store.getRanges())
+			if (store.getTimeMs(r.first) <= t && store.getTimeMs(r.first + r.count - 1) >= t)
+				expected++;
+
+		bOK = matches.size() == expected && matches[0].range == outlier && visited <= 64 * matches.size();
+		maxVisited = std::max(maxVisited, visited);
+		for (auto &m: matches)
+			bOK = bOK && m.fromMs == t && m.toMs == t && (m.range == outlier
+				|| fabs(m.fromOffset - 2.0 - (t - store.getTimeMs(store.getRanges()[m.range].first)) / 1000.0) < 1e-9);
+	}
+
+	// Half way between two samples - the antimeridian is crossed between 0 and 1.
+	index.at(base + 1000000 + 500, matches);
+	auto last = std::find_if(matches.begin(), matches.end(), [&](const TimeIndex::Match &m) { return m.range == (size_t)clips; });
+	bOK = bOK && last != matches.end() && fabs(last->lat - 40.0005) < 1e-9 && fabs(fabs(last->lon) - 180.0) < 1e-9
+		&& fabs(last->ele - 0.5) < 1e-9 && fabs(last->fromOffset - 2.5) < 1e-9;
+
+	index.between(base - 5000, base + 1000, matches);
+	bOK = bOK && matches.size() == 2 && matches[0].range == outlier && matches[0].fromMs == base - 5000
+		&& matches[1].fromMs == base && matches[1].toMs == base + 1000 && fabs(matches[1].toOffset - 3.0) < 1e-9;
+
+	auto t0 = std::chrono::steady_clock::now();
+	for (int q = 0; q < 10000; q++)
+		index.at(base + (int64_t)q * 479001 % ((int64_t)clips * 240000), matches);
+	auto t1 = std::chrono::steady_clock::now();
+
+	std::cout << "Checking time index: " << index.size() << " files, at most " << maxVisited << " nodes visited, "
+		<< std::chrono::duration<double, std::micro>(t1 - t0).count() / 10000
+		<< "us a query : " << (bOK ? "PASSED." : "FAILED.") << std::endl;
+}
@@ -0,0 +1,61 @@
+#ifndef _TIMEINDEX_H
+#define _TIMEINDEX_H
+//
+// "What was I filming at 14:32 on 2020-07-04?" - the [first, last] GPS time of every file in
+// a SampleStore, sorted by start.
+//
+// Over the sorted intervals sits an implicit segment tree holding the latest end under each
+// node. The files covering a time are the ones starting no later than it (a binary search
+// gives that prefix) whose end reaches it, and the tree finds those by only descending into
+// nodes whose latest end is late enough - O(log n) a match, however long a few files' spans
+// are (ie a GPS week rollover glitch making one clip end years later). Inside a file
+// the time is another binary search over its (time ordered) samples, and the position and
+// the media time (how far into the video) are interpolated between the samples either side.
+//
+// Holds range numbers, not copies - valid until the store changes.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <vector>
+
+#include <stdint.h>
+
+#include "samplestore.h"
+
+class TimeIndex {
+public:
+	// The part of a query that one of the store's ranges (files) covers.
+	struct Match {
+		size_t range;			// Index into store.getRanges()
+		int64_t fromMs;			// Query clipped to the file's samples
+		int64_t toMs;
+		double fromOffset;		// Seconds into the clip at fromMs and toMs - media time
+		double toOffset;
+		double lat, lon, ele;	// At fromMs
+	};
+
+	TimeIndex();
+	void build(const SampleStore &_store);
+	size_t size() const { return intervals.size(); };
+	void at(int64_t ms, std::vector<Match> &matches) const { between(ms, ms, matches); };
+	void between(int64_t fromMs, int64_t toMs, std::vector<Match> &matches, size_t* visited = NULL) const;	// By file start
+	void positionAt(size_t range, int64_t ms, double &lat, double &lon, double &ele, double &mediaSeconds) const;
+
+protected:
+	struct Interval {
+		int64_t startMs;
+		int64_t endMs;
+		size_t range;
+	};
+
+	void collect(size_t node, size_t lo, size_t hi, size_t end, int64_t fromMs, std::vector<size_t> &found, size_t &visited) const;
+
+	const SampleStore* store;
+	std::vector<Interval> intervals;	// Sorted by startMs
+	std::vector<int64_t> maxEndMs;		// Segment tree - node 1 is the root, node n's children 2n and 2n+1
+	size_t leaves;						// Power of two >= intervals.size()
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef _UTCTIME_H
+#define _UTCTIME_H
+//
+// Calendar <-> epoch conversions for UTC, without mktime()/gmtime().
+//
+// GPSU is already UTC so there is no reason to involve the local timezone. These are
+// pure integer arithmetic (no TZ lookups, no syscalls, no allocations) and the forward
+// direction is constexpr so it can be checked at compile time.
+//
+// The day arithmetic is the well known days_from_civil / civil_from_days pair, working
+// on a calendar shifted to start in March so the leap day lands at the end of the year.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <iomanip>
+
+#include <stdio.h>
+#include <stdint.h>
+
+namespace utc {
+
+// C++11 constexpr means one return statement per function - hence the small helpers.
+constexpr int64_t shiftedYear(int64_t y, int64_t m) { return y - (m <= 2 ? 1 : 0); }
+constexpr int64_t eraOf(int64_t y) { return (y >= 0 ? y : y - 399) / 400; }
+constexpr int64_t dayOfShiftedYear(int64_t m, int64_t d) { return (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1; }
+constexpr int64_t dayOfEra(int64_t yoe, int64_t doy) { return yoe * 365 + yoe / 4 - yoe / 100 + doy; }
+
+constexpr int64_t daysFromCivilShifted(int64_t y, int64_t m, int64_t d) {
+	return eraOf(y) * 146097 + dayOfEra(y - eraOf(y) * 400, dayOfShiftedYear(m, d)) - 719468;
+}
+
+// Days since 1970-01-01 for year/month(1-12)/day.
+constexpr int64_t daysFromCivil(int64_t y, int64_t m, int64_t d) {
+	return daysFromCivilShifted(shiftedYear(y, m), m, d);
+}
+
+// Milliseconds since the epoch.
+constexpr int64_t toMillis(int64_t y, int64_t mo, int64_t d, int64_t h, int64_t mi, int64_t s, int64_t ms) {
+	return ((daysFromCivil(y, mo, d) * 24 + h) * 60 + mi) * 60000 + s * 1000 + ms;
+}
+
+struct Civil {
+	int year, month, day, hour, minute, second, millis;
+};
+
+// Floors, so times before 1970 come out right as well.
+inline int64_t floorDiv(int64_t a, int64_t b) { return a / b - ((a % b != 0 && (a < 0) != (b < 0)) ? 1 : 0); }
+
+inline Civil fromMillis(int64_t ms) {
+	Civil c;
+	int64_t days = floorDiv(ms, 86400000);
+	int64_t msOfDay = ms - days * 86400000;
+
+	int64_t z = days + 719468;
+	int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+	int64_t doe = z - era * 146097;
+	int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int64_t mp = (5 * doy + 2) / 153;
+
+	c.day = (int)(doy - (153 * mp + 2) / 5 + 1);
+	c.month = (int)(mp < 10 ? mp + 3 : mp - 9);
+	c.year = (int)(yoe + era * 400 + (c.month <= 2 ? 1 : 0));
+
+	c.hour = (int)(msOfDay / 3600000);
+	c.minute = (int)(msOfDay / 60000 % 60);
+	c.second = (int)(msOfDay / 1000 % 60);
+	c.millis = (int)(msOfDay % 1000);
+	return c;
+}
+
+// YYYY-MM-DD
+inline void writeDate(std::ostream& os, const Civil& c) {
+	os  << c.year << '-'
+		<< std::setfill('0') << std::setw(2) << c.month << '-'
+		<< std::setfill('0') << std::setw(2) << c.day;
+}
+
+// YYYY-MM-DDTHH:MM:SSZ (whole seconds, as GPX wants)
+inline void writeDateTime(std::ostream& os, const Civil& c) {
+	writeDate(os, c);
+	os  << 'T'
+		<< std::setfill('0') << std::setw(2) << c.hour << ':'
+		<< std::setfill('0') << std::setw(2) << c.minute << ':'
+		<< std::setfill('0') << std::setw(2) << c.second << 'Z';
+}
+
+// Reads YYYY-MM-DDTHH:MM[:SS[.mmm]][Z] as UTC - a space works in place of the T.
+inline bool parseDateTime(const char* in, int64_t &ms) {
+	int y, mo, d, h, mi, s = 0, millis = 0, n = 0;
+
+	if (sscanf(in, "%4d-%2d-%2d%*1[T ]%2d:%2d%n", &y, &mo, &d, &h, &mi, &n) != 5 || n == 0)
+		return false;
+	in += n;
+
+	if (*in == ':') {
+		n = 0;
+		if (sscanf(in, ":%2d%n", &s, &n) != 1 || n != 3)
+			return false;
+		in += n;
+
+		if (*in == '.') {
+			int scale = 100;
+			for (in++; *in >= '0' && *in <= '9'; in++, scale /= 10)
+				millis += (*in - '0') * scale;
+		}
+	}
+
+	if (*in == 'Z')
+		in++;
+
+	if (*in || mo < 1 || mo > 12 || d < 1 || d > 31 || h > 23 || mi > 59 || s > 60 || h < 0 || mi < 0 || s < 0)
+		return false;
+
+	ms = toMillis(y, mo, d, h, mi, s, millis);
+	return true;
+}
+
+}
+
+#endif
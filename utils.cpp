@@ -9,12 +9,23 @@
 #include <iomanip>
 #include <string>
 #include <set>
+#include <algorithm>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
 
-const char* addToPath(const char* start, const char* add) {
+std::string addToPath(const char* start, const char* add) {
 	std::string path(start);
 
 	if (path.back() != '/')
@@ -22,57 +33,224 @@ const char* addToPath(const char* start, const char* add) {
 
 	path += add;
 
-	return path.c_str();
+	return path;
 }
 
-void getAllFilesFromPath(const char* inPath, bool bRecurse, std::vector<std::string>& files) {
-  	std::vector<std::string> dirs;
+//
+// Parallel directory walker behind getAllFilesFromPath().
+//
+// Directories sit on a shared queue and any idle worker picks up the next one. Subdirectories
+// are opened with openat() relative to their already open parent, so the kernel never resolves
+// the full path again. To keep from running out of descriptors on very wide trees only a limited
+// number of opened-but-not-yet-read directories are parked on the queue - beyond that a
+// subdirectory is queued by path and opened when its turn comes.
+//
+// Filesystems that don't fill in d_type (some NFS/CIFS mounts) fall back to fstatat().
+// An unreadable directory is recorded and skipped rather than ending the whole walk.
+//
+class DirWalker {
+public:
+	DirWalker(bool _bRecurse, const std::vector<std::string> &_exts) : bRecurse(_bRecurse), exts(_exts), pending(0), parkedFds(0), maxParkedFds(0) {};
+	void run(const char* inPath, unsigned int threads);
+
+	std::vector<std::string> files;
+	std::vector<std::string> errors;
+
+protected:
+	struct WorkItem {
+		std::string path;
+		int fd;		// -1 when only the path is known
+	};
+
+	void workerLoop();
+	void readDir(WorkItem &item, std::vector<std::string> &found, std::vector<WorkItem> &subdirs);
+	bool wantFile(const char* name);
+
+	bool bRecurse;
+	const std::vector<std::string> &exts;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<WorkItem> queue;
+	size_t pending;			// Queued plus in-progress directories. Zero means the walk is done.
+	std::atomic<size_t> parkedFds;		// Open descriptors currently waiting in 'queue' - changed under 'lock', read without it
+	size_t maxParkedFds;
+};
+
+static const size_t MAX_PARKED_FDS = 256;
+
+void DirWalker::run(const char* inPath, unsigned int threads) {
+	std::vector<std::thread> workers;
+
+	struct rlimit rl;
+
+	// Leave most of the descriptor limit to everyone else (including our own readers).
+	maxParkedFds = MAX_PARKED_FDS;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		maxParkedFds = std::min(maxParkedFds, (size_t)rl.rlim_cur / 4);
+
+	queue.push_back(WorkItem{ inPath, -1 });
+	pending = 1;
+
+	if (threads <= 1) {
+		workerLoop();
+	}
+	else {
+		for (unsigned int i = 0; i < threads; i++)
+			workers.push_back(std::thread(&DirWalker::workerLoop, this));
+
+		for (auto &w: workers)
+			w.join();
+	}
+
+	// Workers finish in any order - sort so the file list is the same on every run.
+	std::sort(files.begin(), files.end());
+	std::sort(errors.begin(), errors.end());
+}
+
+void DirWalker::workerLoop() {
+	std::vector<std::string> found;
+	std::vector<WorkItem> subdirs;
+
+	do {
+		WorkItem item;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [this]{ return !queue.empty() || pending == 0; });
+			if (queue.empty())
+				break;	// pending hit zero - nothing left anywhere
+
+			item = std::move(queue.front());
+			queue.pop_front();
+			if (item.fd >= 0)
+				parkedFds--;
+		}
+
+		found.clear();
+		subdirs.clear();
+		readDir(item, found, subdirs);
+
+		std::lock_guard<std::mutex> guard(lock);
+		files.insert(files.end(), found.begin(), found.end());
+		for (auto &sub: subdirs) {
+			if (sub.fd >= 0)
+				parkedFds++;
+			queue.push_back(std::move(sub));
+		}
+		pending += subdirs.size();
+		pending--;		// This directory is finished
+
+		if (pending == 0 || !subdirs.empty())
+			wake.notify_all();
+	} while(1);
+}
+
+//
+// Reads a single directory. Runs without the lock held.
+//
+void DirWalker::readDir(WorkItem &item, std::vector<std::string> &found, std::vector<WorkItem> &subdirs) {
+	int fd = item.fd;
 	DIR *dir;
 	struct dirent *dirItem;
 
-	files.clear();
-	dirs.clear();
-  	dirs.push_back(inPath);
-
-  	while (!dirs.empty()) {
-//  		cout << "TOP: dirs.size()=" << dirs.size() << endl;
-  		std::string curPath = dirs.back();
-  		dirs.pop_back();
-//  		std::cout << "Processing dir: " << curPath << std::endl;
-
-  		dir = opendir(curPath.c_str());
-  		// dir stream is now open and ready for business.
-  		if (!dir) {
-  			std::cerr << "ERROR: Directory could not be opened: " << curPath << std::endl;
-  			exit(-1);
-  		}
-
-  		dirItem = readdir(dir);
-  		while (dirItem) {
-  			// Will receive all file and dir entries including . and ..
-
-  			if (!(!strcmp(dirItem->d_name, ".") || !strcmp(dirItem->d_name, "..")))
-  			{
-	  			if (dirItem->d_type == DT_REG) {
-//		  			std::cout << "FILE: " << dirItem->d_name << std::endl;
-		  			files.push_back(addToPath(curPath.c_str(), dirItem->d_name));
-	  			}
-	  			// Only add directories in if we're in recursive mode.
-	  			else if (bRecurse && dirItem->d_type == DT_DIR) {
-//		  			std::cout << " DIR: " << dirItem->d_name << std::endl;
-		  			dirs.push_back(addToPath(curPath.c_str(), dirItem->d_name));
-	  			}
-	  		}
-
-	  		// Next entry please.
-  			dirItem = readdir(dir);
-  		}
-
-  		// Done with this directory. Close it.
-		closedir(dir);
-//  		cout << "BOTTOM: dirs.size()=" << dirs.size() << endl;
+	if (fd < 0)
+		fd = open(item.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-  	}
+	dir = (fd >= 0) ? fdopendir(fd) : NULL;
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+
+		std::lock_guard<std::mutex> guard(lock);
+		errors.push_back(item.path);
+		return;
+	}
+
+	while ((dirItem = readdir(dir)) != NULL) {
+		// Will receive all file and dir entries including . and ..
+		if (!strcmp(dirItem->d_name, ".") || !strcmp(dirItem->d_name, ".."))
+			continue;
+
+		unsigned char type = dirItem->d_type;
+
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+
+			// Don't follow links - same as d_type, which reports them as DT_LNK.
+			if (fstatat(dirfd(dir), dirItem->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+
+			if (S_ISREG(st.st_mode))
+				type = DT_REG;
+			else if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+		}
+
+		if (type == DT_REG) {
+			if (wantFile(dirItem->d_name))
+				found.push_back(addToPath(item.path.c_str(), dirItem->d_name));
+		}
+		// Only add directories in if we're in recursive mode.
+		else if (bRecurse && type == DT_DIR) {
+			WorkItem sub{ addToPath(item.path.c_str(), dirItem->d_name), -1 };
+
+			// Only a soft limit - a relaxed read is plenty, no need for the lock.
+			if (parkedFds.load(std::memory_order_relaxed) + subdirs.size() < maxParkedFds)
+				sub.fd = openat(dirfd(dir), dirItem->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+			subdirs.push_back(std::move(sub));
+		}
+	}
+
+	// Done with this directory. Close it (and the descriptor underneath).
+	closedir(dir);
+}
+
+//
+// An empty extension list keeps everything.
+//
+bool DirWalker::wantFile(const char* name) {
+	size_t len = strlen(name);
+
+	if (exts.empty())
+		return true;
+
+	for (auto &ext: exts) {
+		// Needs room for the '.' in front of the extension
+		if (len > ext.size() && name[len - ext.size() - 1] == '.'
+			&& !strcasecmp(name + len - ext.size(), ext.c_str()))
+			return true;
+	}
+
+	return false;
+}
+
+//
+// Collects every regular file under inPath whose extension is in 'exts'. The result is sorted.
+// Directories that could not be read land in 'errors' and the return is false, but everything
+// that could be reached is still in 'files'.
+//
+// threads of 0 picks a default based on the number of cores.
+//
+bool getAllFilesFromPath(const char* inPath, bool bRecurse, const std::vector<std::string> &exts,
+						std::vector<std::string> &files, std::vector<std::string> &errors, unsigned int threads) {
+	DirWalker walker(bRecurse, exts);
+
+	// Directory reads mostly wait on the disk or network, so more workers than cores pays off.
+	if (!threads)
+		threads = std::max(4u, 2 * std::thread::hardware_concurrency());
+
+	// Without recursion there is only ever the one directory.
+	if (!bRecurse)
+		threads = 1;
+
+	walker.run(inPath, threads);
+
+	files.swap(walker.files);
+	errors.swap(walker.errors);
+
+	return errors.empty();
 }
 
 void tailLowerCase(std::string source, unsigned int take, std::string &dest) {
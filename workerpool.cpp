@@ -0,0 +1,420 @@
+//
+// Pool of extraction workers which rip through a list of files in parallel.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <iostream>
+#include <thread>
+#include <sstream>
+#include <algorithm>
+#include <numeric>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "workerpool.h"
+#ifdef UNITTEST
+#include "mp4synth.h"
+#endif
+
+ExtractionPool::ExtractionPool(SamplesHandler* _pHandler, unsigned int _jobs) {
+	pHandler = _pHandler;
+
+	// Zero jobs means 'one per core'.
+	jobs = _jobs ? _jobs : std::thread::hardware_concurrency();
+	if (!jobs)
+		jobs = 1;
+
+	pCache = NULL;
+	pStats = NULL;
+	pProgress = NULL;
+	bUseMemoryMap = false;
+	readGap = -1;
+	maxInFlight = 0;
+	pFiles = NULL;
+	pSkipped = NULL;
+	nextFile = 0;
+	nextCommit = 0;
+}
+
+ExtractionPool::~ExtractionPool() {
+
+}
+
+void ExtractionPool::setSecondsBetweenSamples(unsigned int newtiming) {
+	params.secondsBetweenSamples = newtiming;
+}
+
+void ExtractionPool::setLockThresholds(unsigned int minLockState, unsigned int maxPrecision) {
+	params.minLockState = minLockState;
+	params.maxPrecision = maxPrecision;
+}
+
+//
+// Pre-pass for streaming: finds the first sample every file will keep and reorders 'files'
+// by its time. starts[i] comes back for files[i], its key "YYYY-MM-DDTHH:MM:SSZ" or empty
+// if no sample passes the thresholds (those sort first). The key is compared as text so
+// that it orders exactly the same way as the dates the exporters group by.
+//
+void ExtractionPool::orderByStartTime(std::vector<std::string> &files, std::vector<FileStart> &starts) {
+	std::vector<FileStart> found(files.size());
+	std::vector<size_t> order(files.size());
+	std::vector<std::string> sortedFiles;
+
+	// Each slot is only written by the worker that took its index.
+	runScan(files, [&](GoProMeta &gpm, size_t index) { found[index] = scanOne(gpm, files[index]); });
+
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return found[a].key != found[b].key ? found[a].key < found[b].key : files[a] < files[b];
+	});
+
+	starts.clear();
+	for (auto i: order) {
+		sortedFiles.push_back(files[i]);
+		starts.push_back(found[i]);
+	}
+
+	files.swap(sortedFiles);
+}
+
+//
+// --dryrun: scans[i] comes back with what a quick look at files[i] turned up. Nothing
+// beyond the sample tables and a couple of payloads per file is read.
+//
+void ExtractionPool::scanFiles(const std::vector<std::string> &files, std::vector<FileScan> &scans) {
+	scans.clear();
+	scans.resize(files.size());
+
+	runScan(files, [&](GoProMeta &gpm, size_t index) {
+		if (gpm.openFile(files[index].c_str()))
+			gpm.scanFile(scans[index]);
+		gpm.closeFile();
+	});
+}
+
+//
+// Hands every file of 'files' to 'scan' across up to 'jobs' threads, each with its own GoProMeta.
+//
+void ExtractionPool::runScan(const std::vector<std::string> &files, const std::function<void(GoProMeta&, size_t)> &scan) {
+	std::vector<std::thread> workers;
+	unsigned int numWorkers = std::min((size_t)jobs, files.size());
+
+	pFiles = &files;
+	nextFile = 0;
+
+	if (numWorkers <= 1) {
+		scanLoop(&scan);
+	}
+	else {
+		for (unsigned int i = 0; i < numWorkers; i++)
+			workers.push_back(std::thread(&ExtractionPool::scanLoop, this, &scan));
+
+		for (auto &w: workers)
+			w.join();
+	}
+
+	pFiles = NULL;
+}
+
+void ExtractionPool::scanLoop(const std::function<void(GoProMeta&, size_t)> *pScan) {
+	GoProMeta gpm;
+
+	gpm.setSecondsBetweenSamples(params.secondsBetweenSamples);
+	gpm.setUseMemoryMap(bUseMemoryMap);
+	gpm.setLockThresholds(params.minLockState, params.maxPrecision);
+
+	do {
+		size_t index;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (nextFile >= pFiles->size())
+				break;
+			index = nextFile++;
+		}
+
+		(*pScan)(gpm, index);
+	} while(1);
+}
+
+//
+// A file with a valid cache entry won't be opened by processFiles() either, so its key comes
+// from the entry (the first cached sample is the first kept one) and the MP4 is left alone.
+//
+FileStart ExtractionPool::scanOne(GoProMeta &gpm, const std::string &f) {
+	std::ostringstream os;
+	FileStart found;
+	TD start;
+	int64_t firstMs;
+	bool bHasSamples;
+
+	if (pCache && pCache->loadFirstTime(f.c_str(), params, bHasSamples, firstMs)) {
+		found.bProcessable = true;
+		if (bHasSamples) {
+			start.setEpochMs(firstMs);
+			os << start;
+		}
+	}
+	else if (gpm.openFile(f.c_str()) && gpm.isProcessable()) {
+		found.bProcessable = true;
+		if (gpm.readStartTime(start))
+			os << start;
+	}
+	gpm.closeFile();
+
+	found.key = os.str();
+	return found;
+}
+
+void ExtractionPool::processFiles(const std::vector<std::string> &files, std::vector<std::string> &skippedFiles) {
+	std::vector<std::thread> workers;
+	unsigned int numWorkers = jobs;
+
+	pFiles = &files;
+	pSkipped = &skippedFiles;
+	results.clear();
+	results.resize(files.size());
+	nextFile = 0;
+	nextCommit = 0;
+
+	if (numWorkers > files.size())
+		numWorkers = files.size();
+
+	// A single job runs right here on the calling thread - no need to spin one up.
+	if (numWorkers <= 1) {
+		workerLoop();
+	}
+	else {
+		for (unsigned int i = 0; i < numWorkers; i++)
+			workers.push_back(std::thread(&ExtractionPool::workerLoop, this));
+
+		for (auto &w: workers)
+			w.join();
+	}
+
+	results.clear();
+	pFiles = NULL;
+	pSkipped = NULL;
+}
+
+//
+// One GoProMeta per worker, reused file after file so its scratch buffers stay warm.
+//
+void ExtractionPool::workerLoop() {
+	GoProMeta gpm;
+
+	gpm.setSecondsBetweenSamples(params.secondsBetweenSamples);
+	gpm.setLockThresholds(params.minLockState, params.maxPrecision);
+	gpm.setUseMemoryMap(bUseMemoryMap);
+	gpm.setReadGap(readGap);
+
+	do {
+		size_t index;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+
+			// Don't run too far ahead of the commit point - everything finished but not yet
+			// committed is held in memory.
+			if (maxInFlight)
+				committed.wait(guard, [this]{ return nextFile - nextCommit < maxInFlight; });
+
+			if (nextFile >= pFiles->size())
+				break;
+			index = nextFile++;
+		}
+
+		// results[] is sized up front and each slot is only touched by the worker
+		// that owns 'index' until 'done' is set under the lock.
+		FileResult result;
+		extractOne(gpm, index, result);
+		if (pProgress)
+			pProgress->fileDone(result.payloadsRead, result.bytesRead);
+
+		std::lock_guard<std::mutex> guard(lock);
+		results[index] = std::move(result);
+		results[index].done = true;
+		commitReady();
+	} while(1);
+}
+
+void ExtractionPool::extractOne(GoProMeta &gpm, size_t index, FileResult &result) {
+	const std::string &f = (*pFiles)[index];
+	uint64_t allocationsBefore = heapAllocations();
+
+	gpm.setStats(pStats ? &result.stats : NULL);
+
+	// A cache hit never touches the MP4 itself.
+	if (pCache && pCache->load(f.c_str(), params, result.samples, result.summary)) {
+		result.opened = true;
+		result.processed = true;
+		result.stats.samples = result.samples.size();
+		result.stats.allocations += heapAllocations() - allocationsBefore;
+		return;
+	}
+
+	result.opened = gpm.openFile(f.c_str());
+	if (result.opened) {
+		result.processed = gpm.processFile();
+		if (result.processed) {
+			gpm.getOutputPoints(result.samples);
+			result.summary = gpm.getSummary();
+
+			if (pCache && !pCache->store(f.c_str(), params, result.samples, result.summary))
+				result.errors += "WARNING: Could not write cache entry for: " + f + "\n";
+		}
+		result.errors = gpm.getErrors() + result.errors;
+	}
+
+	result.payloadsRead = gpm.getPayloadsRead();
+	result.bytesRead = gpm.getBytesRead();
+	gpm.closeFile();
+	result.stats.allocations += heapAllocations() - allocationsBefore;
+}
+
+//
+// Must be called with 'lock' held.
+// Hands every completed result at the front of the list to the SamplesHandler.
+// Committing strictly in file order keeps the console output and the trackGroups
+// identical to a serial run no matter which worker finishes first.
+//
+void ExtractionPool::commitReady() {
+	while (nextCommit < results.size() && results[nextCommit].done) {
+		FileResult &r = results[nextCommit];
+		const std::string &f = (*pFiles)[nextCommit];
+
+		if (!r.errors.empty())
+			report(r.errors, true);
+
+		if (!r.opened) {
+			pSkipped->push_back(f);
+		}
+		else if (!r.processed) {
+			report("ERROR: Could not process file properly: " + f + "\n", true);
+		}
+		else {
+			report(r.summary, false);
+
+			uint64_t allocationsBefore = heapAllocations();
+			{
+				StageTimer timer(pStats ? &r.stats : NULL, FileStats::STAGE_GROUP);
+
+				// Insert samples into SamplesHandler for safe keeping
+				if (!pHandler->AddSampleSet(f.c_str(), std::move(r.samples))) {
+					report("Could not add samples for: " + f + "\n", true);
+					// continuing...
+				}
+			}
+			r.stats.allocations += heapAllocations() - allocationsBefore;
+		}
+
+		if (pStats)
+			pStats->addFile(f, r.stats);
+
+		// Release anything the handler didn't take (ie a failed file).
+		r.samples = SampleStore();
+		nextCommit++;
+		committed.notify_all();
+	}
+}
+
+//
+// Per-file console output goes through the progress reporter when there is one, so the
+// status line stays intact and nothing is flushed file by file.
+//
+void ExtractionPool::report(const std::string &text, bool bError) {
+	if (pProgress) {
+		if (bError)
+			pProgress->error(text);
+		else
+			pProgress->print(text);
+	}
+	else
+		(bError ? std::cerr : std::cout) << text;
+}
+
+#ifdef UNITTEST
+//
+// Three clips all called GX010001.MP4 in different directories, the first without a GPS lock
+// at all. It's processed all the same (no samples) and takes the plain name in a batch run,
+// so the two tracks that make it to the output must be named alike by both runs.
+//
+void unittest_StreamNames() {
+	const std::string dir("/tmp/unittest_streamnames");
+	const char* const subdirs[3] = { "a", "b", "c" };
+	std::vector<std::string> files, skipped, batchNames, streamNames;
+	std::vector<FileStart> starts;
+	SamplesHandler handler;
+	GPXStreamExporter stream(dir.c_str());
+	std::string gpx;
+	bool bOK = true;
+
+	mkdir(dir.c_str(), 0755);
+	for (int i = 0; i < 3 && bOK; i++) {
+		SynthMP4Config cfg;
+		std::string sub = dir + "/" + subdirs[i];
+
+		cfg.payloads = 5;
+		cfg.gpsFix = i == 0 ? 0 : 3;
+		cfg.startMs += i * 60000;
+		mkdir(sub.c_str(), 0755);
+		files.push_back(sub + "/GX010001.MP4");
+		bOK = writeSynthMP4(files.back().c_str(), cfg);
+	}
+
+	{
+		ExtractionPool pool(&handler, 1);
+
+		pool.processFiles(files, skipped);
+		handler.settleTrackNames();
+		for (auto &r: handler.getStore().getRanges())
+			if (r.count)
+				batchNames.push_back(r.name);
+	}
+
+	{
+		ExtractionPool pool(&stream, 1);
+		std::vector<std::string> ordered(files);
+
+		pool.orderByStartTime(ordered, starts);
+		stream.setFileOrder(ordered, starts);
+		pool.processFiles(ordered, skipped);
+		stream.finish();
+	}
+
+	// The tracks are written in name order, as are the batch ranges here.
+	{
+		FILE* fp = fopen((dir + "/2020-07-04.gpx").c_str(), "rb");
+		char buf[65536];
+		size_t len;
+
+		while (fp && (len = fread(buf, 1, sizeof(buf), fp)) > 0)
+			gpx.append(buf, len);
+		if (fp)
+			fclose(fp);
+	}
+	for (size_t pos = gpx.find("<name>"); pos != std::string::npos; pos = gpx.find("<name>", pos)) {
+		size_t end = gpx.find("</name>", pos);
+
+		pos += strlen("<name>");
+		streamNames.push_back(gpx.substr(pos, end - pos));
+	}
+
+	std::cout << "Checking stream track names match batch:";
+	for (auto &n: streamNames)
+		std::cout << " " << n;
+	std::cout << " : " << (bOK && skipped.empty() && batchNames.size() == 2 && streamNames == batchNames ? "PASSED." : "FAILED.") << std::endl;
+
+	remove((dir + "/2020-07-04.gpx").c_str());
+	for (auto &f: files)
+		remove(f.c_str());
+	for (auto sub: subdirs)
+		rmdir((dir + "/" + sub).c_str());
+	rmdir(dir.c_str());
+}
+#endif
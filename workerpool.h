@@ -0,0 +1,89 @@
+#ifndef _WORKERPOOL_H
+#define _WORKERPOOL_H
+//
+// Pool of extraction workers which rip through a list of files in parallel.
+// Each worker owns its own GoProMeta (and therefore its own GPMF_stream, mp4object
+// and scratch buffers, reused from one file to the next) while the results are
+// handed off to the SamplesHandler strictly in file-list order so the outcome is
+// identical to a serial run.
+//
+// Author: Robert Wolff
+// Copyright 2020 Robert Wolff with MIT license
+//
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "goprometa.h"
+#include "exporters.h"
+#include "samplecache.h"
+#include "stats.h"
+#include "progress.h"
+
+class ExtractionPool {
+public:
+	ExtractionPool(SamplesHandler* _pHandler, unsigned int _jobs);
+	~ExtractionPool();
+	void setSecondsBetweenSamples(unsigned int newtiming);
+	void setUseMemoryMap(bool bUse) { bUseMemoryMap = bUse; };
+	void setReadGap(int64_t gapBytes) { readGap = gapBytes; };
+	void setLockThresholds(unsigned int minLockState, unsigned int maxPrecision);
+	void setCache(SampleCache* _pCache) { pCache = _pCache; };	// NULL disables
+	void setMaxInFlight(size_t maxFiles) { maxInFlight = maxFiles; };	// 0 = no limit
+	// processFiles() adds each file to the stats as it's committed. Without a progress
+	// reporter the per file output goes straight to the console.
+	void setStats(RunStats* _pStats) { pStats = _pStats; };
+	void setProgress(ProgressReporter* _pProgress) { pProgress = _pProgress; };
+	unsigned int getJobs() { return jobs; };
+	void orderByStartTime(std::vector<std::string> &files, std::vector<FileStart> &starts);
+	void scanFiles(const std::vector<std::string> &files, std::vector<FileScan> &scans);	// --dryrun
+	void processFiles(const std::vector<std::string> &files, std::vector<std::string> &skippedFiles);
+
+protected:
+	// Outcome of a single file, parked here until it is its turn to be committed.
+	struct FileResult {
+		FileResult() : done(false), opened(false), processed(false), payloadsRead(0), bytesRead(0) {};
+		bool done;
+		bool opened;
+		bool processed;
+		uint32_t payloadsRead;
+		uint64_t bytesRead;
+		std::string summary;
+		std::string errors;		// Reported ahead of the summary when the file is committed
+		SampleStore samples;
+		FileStats stats;
+	};
+
+	void workerLoop();
+	void runScan(const std::vector<std::string> &files, const std::function<void(GoProMeta&, size_t)> &scan);
+	void scanLoop(const std::function<void(GoProMeta&, size_t)> *pScan);
+	FileStart scanOne(GoProMeta &gpm, const std::string &f);
+	void extractOne(GoProMeta &gpm, size_t index, FileResult &result);
+	void commitReady();
+	void report(const std::string &text, bool bError);
+
+	SamplesHandler* pHandler;
+	unsigned int jobs;
+	ExtractionParams params;
+	SampleCache* pCache;
+	RunStats* pStats;
+	ProgressReporter* pProgress;
+	bool bUseMemoryMap;
+	int64_t readGap;
+	size_t maxInFlight;
+
+	// State for the current processFiles() call. nextFile is handed out under
+	// the lock and nextCommit walks the results in order as they complete.
+	std::mutex lock;
+	std::condition_variable committed;	// Signalled as nextCommit moves when maxInFlight is set
+	const std::vector<std::string> *pFiles;
+	std::vector<std::string> *pSkipped;
+	std::vector<FileResult> results;
+	size_t nextFile;
+	size_t nextCommit;
+};
+
+#endif